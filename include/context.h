@@ -0,0 +1,59 @@
+/*
+ * This file is a part of cNES.
+ * Copyright (c) 2019, Max Roncace <mproncace@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "ppu.h"
+#include "rewind.h"
+#include "spin.h"
+#include "stats.h"
+#include "system.h"
+#include "util.h"
+#include "input/input_device.h"
+
+// everything belonging to a single emulated console
+// mapper state lives on the cartridge's Mapper, since it's created along with the cartridge
+typedef struct nes_context {
+    SystemState system;
+    PpuState ppu;
+    PpuDotTable ppu_dots;
+    PatternCache pattern_cache;
+    SpriteCache sprite_cache;
+    VramMap vram_map;
+    InputState input;
+    StatsState stats;
+    RewindState rewind;
+    SpinState spin;
+} NesContext;
+
+// the console which emulator calls on this thread operate on
+// the CPU's bus callbacks don't carry any user data, so the context is resolved through this instead of being passed
+extern THREAD_LOCAL NesContext *g_ctx;
+
+NesContext *create_context(void);
+
+void destroy_context(NesContext *ctx);
+
+void make_context_current(NesContext *ctx);
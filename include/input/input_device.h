@@ -25,6 +25,7 @@
 
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define CONTROLLER_TYPE_NONE 0
@@ -45,10 +46,19 @@ typedef struct controller_t {
     ControllerPollFunction poller;
     ControllerPushFunction pusher;
     void *state;
+    size_t state_size; // must be plain data, since it's copied as-is into save states
 } Controller;
 
+typedef struct {
+    Controller *controllers[2];
+    // driver callback used by standard controllers to refresh their button states
+    UintConsumer sc_poll_callback;
+} InputState;
+
 void init_controllers(void);
 
+void deinit_controllers(void);
+
 Controller *get_controller(unsigned int port);
 
 void controller_connect(Controller *controller);
@@ -30,3 +30,5 @@
 #include <stdio.h>
 
 Cartridge *load_rom(FILE *file, char *file_name);
+
+void unload_rom(Cartridge *cart);
@@ -27,6 +27,7 @@
 
 #include "cartridge.h"
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #define MAPPER_ID_NROM 0
@@ -42,7 +43,9 @@
 typedef void (*MapperInitFunction)(struct cartridge *cart);
 typedef uint8_t (*MemoryReadFunction)(struct cartridge *cart, uint16_t);
 typedef void (*MemoryWriteFunction)(struct cartridge *cart, uint16_t, uint8_t);
-typedef void (*MapperTickFunction)(void);
+typedef void (*MapperA12Function)(struct cartridge *cart, bool high, uint64_t dot);
+typedef void (*MapperEventFunction)(struct cartridge *cart);
+typedef void (*MapperRemapFunction)(struct cartridge *cart);
 
 typedef struct {
     unsigned int id;
@@ -52,7 +55,12 @@ typedef struct {
     MemoryWriteFunction ram_write_func;
     MemoryReadFunction vram_read_func;
     MemoryWriteFunction vram_write_func;
-    MapperTickFunction tick_func;
+    // PPU dots are counted from power-on, and each one ends with a "tick" after the CPU has run on the same edge
+    MapperA12Function a12_func; // called when PPU address line A12 changes, with the dot whose tick is the first to see it
+    MapperEventFunction event_func; // called on the tick of the dot passed to system_schedule_mapper_event
+    MapperRemapFunction remap_func; // points the CPU page table and the PPU's VRAM windows at the current banks, see CpuMemoryMap/VramMap
+    void *state; // mapper-specific registers, allocated when the mapper is created
+    size_t state_size; // must be plain data, since it's copied as-is into save states
 } Mapper;
 
 void mapper_init_nrom(Mapper *mapper, unsigned int submapper_id);
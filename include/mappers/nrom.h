@@ -26,9 +26,16 @@
 #pragma once
 
 #include "cartridge.h"
+#include "system.h"
 
 #include <stdint.h>
 
+// mappers which defer to the NROM VRAM functions must begin their state with this struct
+typedef struct {
+    // pretty sure this never existed in hardware, but some of blargg's tests rely on it
+    unsigned char chr_ram[CHR_RAM_SIZE];
+} NromState;
+
 uint8_t nrom_ram_read(Cartridge *cart, uint16_t addr);
 
 void nrom_ram_write(Cartridge *cart, uint16_t addr, uint8_t val);
@@ -36,3 +43,9 @@ void nrom_ram_write(Cartridge *cart, uint16_t addr, uint8_t val);
 uint8_t nrom_vram_read(Cartridge *cart, uint16_t addr);
 
 void nrom_vram_write(Cartridge *cart, uint16_t addr, uint8_t val);
+
+void nrom_map_prg(Cartridge *cart);
+
+void nrom_map_chr(Cartridge *cart);
+
+void nrom_remap(Cartridge *cart);
@@ -34,9 +34,30 @@
 #define RESOLUTION_H 256
 #define RESOLUTION_V 240
 
+#define CYCLES_PER_SCANLINE 341 // same across TV systems
+#define SCANLINE_COUNT_MAX 313 // Dendy
+
 // ~600 ms
 #define PPU_BUS_DECAY_CYCLES 3220000
 
+#define VRAM_MAX_SIZE 0x1000
+#define PALETTE_RAM_SIZE 0x20
+
+// the PPU outputs one of 64 colors, which the renderer maps to RGB
+#define PALETTE_SIZE 64
+#define PALETTE_INDEX_MASK (PALETTE_SIZE - 1)
+// each combination of the three emphasis bits gets its own variant of the palette
+#define EMPHASIS_COUNT 8
+#define OAM_PRIMARY_SIZE 0x100
+#define OAM_SECONDARY_SIZE 0x20
+
+#define PATTERN_TABLES_SIZE 0x2000
+#define PATTERN_TILE_SIZE 16
+
+#define VRAM_PAGE_SIZE 0x400
+#define VRAM_PAGE_COUNT 12 // covers $0000-$2FFF
+#define VRAM_NAME_TABLE_PAGE (PATTERN_TABLES_SIZE / VRAM_PAGE_SIZE) // first page of $2000-$2FFF
+
 typedef struct {
     uint8_t r;
     uint8_t g;
@@ -170,10 +191,183 @@ typedef enum MirroringMode { MIRROR_HORIZONTAL, MIRROR_VERTICAL,
                              MIRROR_SINGLE_LOWER, MIRROR_SINGLE_UPPER,
                              MIRROR_FOUR_SCREEN } MirroringMode;
 
+typedef struct {
+    unsigned int scanline_count;
+    unsigned int vbl_start_scanline;
+    unsigned int last_visible_scanline;
+    unsigned int pre_render_line;
+
+    MirroringMode mirror_mode;
+    uint16_t name_table_offsets[4]; // offset into name_table_mem of each quadrant of $2000-$2FFF
+
+    PpuControl control;
+    PpuMask mask;
+    PpuStatus status;
+    PpuInternalRegisters regs;
+    bool nmi_occurred;
+    bool nmi_occurred_buffer;
+
+    unsigned char name_table_mem[VRAM_MAX_SIZE];
+    unsigned char palette_ram[PALETTE_RAM_SIZE];
+    Sprite oam_ram[OAM_PRIMARY_SIZE / sizeof(Sprite)];
+    Sprite secondary_oam_ram[OAM_SECONDARY_SIZE / sizeof(Sprite)];
+
+    bool odd_frame;
+    uint16_t scanline;
+    uint16_t scanline_tick;
+
+    RenderMode render_mode;
+} PpuState;
+
+typedef enum {
+    LINE_VISIBLE, LINE_PRE_RENDER, LINE_VBLANK_START, LINE_IDLE, LINE_TYPE_COUNT
+} ScanlineType;
+
+// background fetch performed on a dot
+typedef enum {
+    BG_OP_NONE,
+    BG_OP_NT_ADDR, BG_OP_NT_FETCH,
+    BG_OP_AT_ADDR, BG_OP_AT_FETCH,
+    BG_OP_PT_LOW_ADDR, BG_OP_PT_LOW_FETCH,
+    BG_OP_PT_HIGH_ADDR, BG_OP_PT_HIGH_FETCH,
+    BG_OP_DUMMY_FETCH, // unused fetch at the end of the line, which is read but not latched
+} BgOp;
+
+// sprite evaluation/fetch step performed on a dot
+typedef enum {
+    SPRITE_OP_NONE,
+    SPRITE_OP_EVAL_RESET, SPRITE_OP_CLEAR_SECONDARY, SPRITE_OP_EVAL_READ, SPRITE_OP_EVAL_WRITE,
+    SPRITE_OP_FETCH_Y, SPRITE_OP_FETCH_TILE, SPRITE_OP_FETCH_ATTR, SPRITE_OP_FETCH_X,
+    SPRITE_OP_PT_LOW_ADDR, SPRITE_OP_PT_LOW_FETCH,
+    SPRITE_OP_PT_HIGH_ADDR, SPRITE_OP_PT_HIGH_FETCH,
+} SpriteOp;
+
+// everything else which happens on a dot, in the order it's performed
+#define DOT_CLEAR_NMI           0x0001
+#define DOT_CLEAR_STATUS        0x0002
+#define DOT_SET_VBLANK          0x0004
+#define DOT_COPY_VERT           0x0008 // vert(v) = vert(t)
+#define DOT_COPY_HORI           0x0010 // hori(v) = hori(t)
+#define DOT_INC_VERT            0x0020
+#define DOT_INC_HORI            0x0040
+#define DOT_SPRITE_EVAL_START   0x0080
+#define DOT_SPRITE_FETCH_START  0x0100
+#define DOT_PIXEL               0x0200
+#define DOT_SHIFT               0x0400
+#define DOT_ODD_FRAME_SKIP      0x0800
+
+#define DOT_LINE_EVENTS (DOT_CLEAR_NMI | DOT_CLEAR_STATUS | DOT_SET_VBLANK | DOT_COPY_VERT | DOT_COPY_HORI)
+// changes the CPU can see without going through the PPU's registers (i.e. the NMI line), plus the odd frame skip, which
+// changes the length of the line
+#define DOT_CPU_EVENTS (DOT_CLEAR_NMI | DOT_SET_VBLANK | DOT_ODD_FRAME_SKIP)
+// work which is skipped entirely while rendering is disabled
+#define DOT_RENDERING_ONLY (DOT_COPY_VERT | DOT_COPY_HORI | DOT_INC_VERT | DOT_INC_HORI \
+        | DOT_SPRITE_EVAL_START | DOT_SPRITE_FETCH_START)
+
+typedef struct {
+    uint8_t bg_op;
+    uint8_t sprite_op;
+    uint16_t flags;
+} PpuDot;
+
+// what the PPU does on every dot of every kind of scanline, so cycle_ppu can dispatch straight to the work at hand
+// instead of re-deriving it from the scanline and tick
+// this only depends on the TV system, so it's built by initialize_ppu and isn't part of PpuState
+typedef struct {
+    uint8_t line_types[SCANLINE_COUNT_MAX];
+    PpuDot dots[LINE_TYPE_COUNT][CYCLES_PER_SCANLINE];
+    // number of dots from each one to the next dot which does anything besides advancing the counters (or the end of
+    // the line), indexed by whether rendering is enabled
+    uint16_t idle_runs[2][LINE_TYPE_COUNT][CYCLES_PER_SCANLINE];
+    // number of dots from each one to the next one with a CPU event (or the end of the line)
+    uint16_t quiet_runs[LINE_TYPE_COUNT][CYCLES_PER_SCANLINE];
+    // PAL and Dendy PPUs draw a black border over the top line and the two outermost columns on each side
+    bool draws_border;
+    // PAL and Dendy PPUs have the red and green emphasis bits swapped
+    bool swaps_emphasis;
+} PpuDotTable;
+
+// composited sprite pixel, 0 if no sprite is opaque there
+#define SPRITE_PIXEL_PALETTE_MASK 0x1F // offset into palette RAM
+#define SPRITE_PIXEL_LOW_PRIORITY 0x20
+#define SPRITE_PIXEL_SPRITE_0     0x40
+
+// per-line shortcuts for sprite evaluation and compositing
+// a line's evaluation is worked out at its first dot and applied at its last; anything which could observe or change it
+// in between (OAM writes, $2000/$2001 writes, saving) flushes it by replaying the exact state machine up to the current dot
+// everything here is derived from PpuState, so it's discarded when a state is loaded
+typedef struct {
+    uint64_t line_masks[256]; // bit n is set if sprite n is on the line, assuming OAM evaluation starts at 0
+    bool masks_valid;
+    bool masks_tall; // sprite height the masks were built for
+
+    bool eval_pending;
+    unsigned int eval_overflow_tick; // dot on which the overflow flag gets set, or 0 if it doesn't
+    uint8_t eval_m;
+    uint8_t eval_n;
+    uint8_t eval_o;
+    uint8_t eval_p;
+    uint8_t eval_latch;
+    bool eval_has_latch;
+    bool eval_sprite_0;
+    Sprite eval_secondary_oam[OAM_SECONDARY_SIZE / sizeof(Sprite)];
+
+    bool line_valid;
+    uint8_t line_pixels[RESOLUTION_H];
+} SpriteCache;
+
+// enough for the banks a game flips between every frame (e.g. animated CHR) to stay decoded
+#define PATTERN_CACHE_PAGES 64
+
+// decoded copy of a 1 KB page of CHR memory, filled lazily one tile at a time
+typedef struct {
+    const uint8_t *mem; // the memory the page was decoded from, or NULL if unused
+    uint8_t plain[VRAM_PAGE_SIZE];
+    uint8_t reversed[VRAM_PAGE_SIZE]; // bit order flipped, i.e. ready to be shifted out LSB-first
+    uint32_t tile_generations[VRAM_PAGE_SIZE / PATTERN_TILE_SIZE];
+} PatternCachePage;
+
+// decoded pattern tiles, keyed by the memory they come from rather than by PPU address so that bank switches only
+// change which cached page each pattern window looks at
+// a tile is valid when its generation matches the cache's, so invalidating everything is a single increment
+typedef struct {
+    PatternCachePage pages[PATTERN_CACHE_PAGES];
+    unsigned int next_victim;
+    PatternCachePage *windows[VRAM_NAME_TABLE_PAGE]; // NULL while the window isn't plain memory
+    PatternCachePage *ciram_pages[VRAM_MAX_SIZE / VRAM_PAGE_SIZE]; // for name table memory paged into the windows
+    uint32_t generation;
+} PatternCache;
+
+// 1 KB windows which the PPU reads through directly while rendering, kept up to date by the mapper's remap function
+// pages left NULL fall back to the mapper's vram_read_func, so a mapper which needs to see every access (or which
+// can't express a page as plain memory, e.g. open bus) can opt out per page
+// these point into cartridge memory, so they aren't part of PpuState and are rebuilt after loading a state
+typedef struct {
+    const uint8_t *pages[VRAM_PAGE_COUNT];
+} VramMap;
+
 void initialize_ppu(void);
 
 void ppu_set_mirroring_mode(MirroringMode mirror_mode);
 
+void ppu_invalidate_pattern_cache(void);
+
+void ppu_note_vram_write(uint16_t addr);
+
+void ppu_invalidate_sprite_cache(void);
+
+void ppu_flush_sprite_cache(void);
+
+void ppu_map_vram_page(unsigned int page, const uint8_t *mem);
+
+const uint8_t *ppu_get_name_table_page(unsigned int index);
+
+uint8_t *ppu_get_ciram_page(unsigned int page);
+
+void ppu_map_name_table(unsigned int index, unsigned int ciram_page);
+
+void ppu_map_name_tables(void);
+
 bool ppu_is_rendering_enabled(void);
 
 uint16_t ppu_get_scanline(void);
@@ -186,6 +380,8 @@ PpuInternalRegisters *ppu_get_internal_regs(void);
 
 uint8_t ppu_read_mmio(uint8_t index);
 
+uint8_t ppu_peek_status(void);
+
 void ppu_write_mmio(uint8_t addr, uint8_t val);
 
 uint8_t ppu_name_table_read(uint16_t addr);
@@ -198,8 +394,16 @@ void ppu_palette_table_write(uint8_t index, uint8_t val);
 
 void ppu_push_dma_byte(uint8_t val);
 
+void ppu_push_dma_page(const uint8_t *page);
+
 void cycle_ppu(void);
 
+unsigned int ppu_get_idle_dots(void);
+
+unsigned int ppu_get_quiet_dots(void);
+
+void ppu_advance(unsigned int dots);
+
 RenderMode get_render_mode(void);
 
 void set_render_mode(RenderMode mode);
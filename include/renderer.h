@@ -30,6 +30,7 @@
 #include <SDL_events.h>
 #include <SDL_render.h>
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #define WINDOW_SCALE 3
@@ -48,12 +49,16 @@ void set_window_title(const char *title);
 
 void add_event_callback(EventCallback callback);
 
-void initialize_renderer(void);
+bool load_palette_file(const char *path);
 
-void set_pixel(unsigned int x, unsigned int y, const RGBValue rgb);
+void initialize_renderer(void);
 
-void submit_frame(void);
+void submit_frame(uint8_t (*framebuffer)[RESOLUTION_H], const uint8_t *emphasis);
 
 void draw_frame(void);
 
+uint64_t get_dropped_frame_count(void);
+
+uint64_t get_duplicated_frame_count(void);
+
 void close_window(void);
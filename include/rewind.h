@@ -0,0 +1,69 @@
+/*
+ * This file is a part of cNES.
+ * Copyright (c) 2019, Max Roncace <mproncace@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+    unsigned char *data;
+    uint32_t size;
+    bool base; // encoded against nothing; the history can't be rewound past this entry
+} RewindEntry;
+
+// history of save states, one per frame
+// each entry is the XOR of its state with the state before it, with runs of zero bytes collapsed, so stepping back
+// a frame is a matter of applying the newest entry to the newest state
+typedef struct {
+    RewindEntry *entries;
+    unsigned int capacity;
+    unsigned int oldest;
+    unsigned int count;
+
+    size_t state_size;
+    unsigned char *newest_state; // decoded state matching the newest entry
+    unsigned char *scratch_state;
+    unsigned char *encode_buf;
+
+    size_t memory_used;
+
+    atomic_bool active; // set by the UI thread while the rewind key is held
+} RewindState;
+
+void rewind_init(unsigned int seconds);
+
+void rewind_deinit(void);
+
+void rewind_set_active(bool active);
+
+// called by the system at the end of every frame, either to record it or to step back one frame
+void rewind_on_frame(void);
+
+unsigned int rewind_get_frame_count(void);
+
+size_t rewind_get_memory_usage(void);
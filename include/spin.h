@@ -0,0 +1,80 @@
+/*
+ * This file is a part of cNES.
+ * Copyright (c) 2019, Max Roncace <mproncace@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "c6502/cpu.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// longest loop (in CPU cycles) which is looked for
+#define SPIN_MAX_PERIOD 32
+// how long the CPU has to go without writing anything before instructions are watched for a loop
+#define SPIN_WATCH_CYCLES (SPIN_MAX_PERIOD * 2)
+
+// detection of loops which poll RAM or $2002 until something changes (e.g. waiting for vblank or sprite 0)
+// a loop is found when the CPU comes back around to an instruction with exactly the registers it had the last time,
+// having only read RAM, ROM or $2002 in between; until one of those reads returns something different (or an interrupt
+// arrives), it'll keep doing exactly the same thing, so the system can skip over whole iterations
+typedef struct {
+    bool enabled;
+    bool watching; // whether instructions are being fed to spin_on_instruction
+    uint64_t clean_since; // first CPU cycle after the last write or read with side effects
+
+    // the instruction the current iteration started at
+    bool has_head;
+    CpuRegisters head;
+    uint64_t head_cycle;
+    uint64_t head_vblanks; // the NMI line can only fall when vblank starts
+    unsigned int status_reads; // $2002 reads since the head
+    uint64_t status_cycle;
+    uint8_t status_value;
+
+    // set when an iteration has been confirmed, until the system has acted on it
+    bool found;
+    unsigned int period; // in CPU cycles
+    bool polls_status;
+    unsigned int status_offset; // CPU cycles from the start of the iteration to its $2002 read
+} SpinState;
+
+void spin_init_state(SpinState *state);
+
+void spin_set_enabled(bool enabled);
+
+// called for every CPU write
+void spin_note_write(void);
+
+// called for every CPU read which doesn't go straight to memory
+void spin_note_io_read(uint16_t addr, uint8_t val);
+
+// called once the CPU has gone SPIN_WATCH_CYCLES without a write
+void spin_start_watching(void);
+
+// called by the system for every instruction the CPU completes while watching
+void spin_on_instruction(CpuRegisters regs);
+
+// called when the system has skipped over the found loop (or decided not to), and when memory changes under the CPU
+void spin_reset(void);
@@ -0,0 +1,111 @@
+/*
+ * This file is a part of cNES.
+ * Copyright (c) 2019, Max Roncace <mproncace@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "util.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// one in this many clock edges is timed when time sampling is enabled
+// it's prime so that the samples don't line up with the CPU/PPU edge pattern
+#define STATS_SAMPLE_INTERVAL 97
+
+// sections of the emulation loop which wall time is attributed to
+// CPU, PPU and mapper time is sampled; present and idle time are measured exactly, since they're infrequent
+typedef enum {
+    STATS_SECTION_CPU,
+    STATS_SECTION_PPU,
+    STATS_SECTION_MAPPER,
+    STATS_SECTION_PRESENT,
+    STATS_SECTION_IDLE,
+    STATS_SECTION_COUNT
+} StatsSection;
+
+typedef struct {
+    uint64_t cpu_cycles;
+    uint64_t ppu_dots;
+    uint64_t ppu_idle_dots; // dots which were applied in bulk rather than stepped
+    uint64_t spin_cycles; // CPU cycles skipped while the CPU was spinning in a polling loop
+    uint64_t dma_cycles;
+    uint64_t mapper_events;
+    uint64_t frames;
+    uint64_t vblanks;
+
+    uint64_t master_clock;
+    uint64_t wall_us; // time since the counters were last reset
+
+    bool time_sampling;
+    // wall time spent in each section
+    // the time not spent presenting or idling is split between the sampled sections according to their share of the
+    // samples, so loop overhead is folded into them
+    uint64_t section_ns[STATS_SECTION_COUNT];
+} SystemStats;
+
+// counters which are updated directly by the hot loop
+// the counters and idle time are always kept; the other timings only accumulate when sampling is enabled
+typedef struct {
+    uint64_t ppu_dots;
+    uint64_t ppu_idle_dots;
+    uint64_t spin_cycles;
+    uint64_t dma_cycles;
+    uint64_t mapper_events;
+    uint64_t vblanks;
+
+    // snapshots of the system counters as of the last reset, so that the reported values start from zero
+    uint64_t base_cpu_cycles;
+    uint64_t base_frames;
+    uint64_t base_master_clock;
+    uint64_t start_us;
+
+    bool time_sampling;
+    unsigned int sample_countdown;
+    uint64_t excluded_ns; // time already attributed elsewhere during the current sample
+    uint64_t timer_overhead_ns; // cost of reading the clock, which would otherwise inflate every lap
+    uint64_t measured_ns[STATS_SECTION_COUNT];
+} StatsState;
+
+#define STATS_IS_SAMPLED_SECTION(section) ((section) <= STATS_SECTION_MAPPER)
+
+void stats_reset(void);
+
+void stats_set_time_sampling(bool enabled);
+
+bool stats_is_time_sampling(void);
+
+void stats_snapshot(SystemStats *out);
+
+void stats_dump(FILE *out);
+
+// attributes the time since the given timestamp to a section and returns the new timestamp
+static inline uint64_t stats_lap(StatsState *stats, StatsSection section, uint64_t since_ns) {
+    uint64_t now = now_ns();
+    uint64_t elapsed = now - since_ns - stats->excluded_ns;
+    stats->measured_ns[section] += elapsed > stats->timer_overhead_ns ? elapsed - stats->timer_overhead_ns : 0;
+    stats->excluded_ns = 0;
+    return now;
+}
@@ -27,20 +27,189 @@
 
 #include "cartridge.h"
 
+#include "c6502/cpu.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 #define SYSTEM_MEMORY_SIZE 0x800
 #define PRG_RAM_SIZE 0x2000
 #define CHR_RAM_SIZE 0x2000
 
+#define CPU_PAGE_SIZE 0x100
+#define CPU_PAGE_COUNT 0x100
+
 typedef enum tv_system_t {
     TV_SYSTEM_NTSC,
     TV_SYSTEM_PAL,
     TV_SYSTEM_DENDY,
 } TvSystem;
 
+// direct pointers for each 256-byte page of the CPU address space
+// internal RAM is mapped by the system and everything from $4020 up by the mapper's remap function
+// pages left NULL go through the mapper's ram_read_func/ram_write_func, which is where MMIO, open bus and bank
+// registers end up
+typedef struct {
+    const uint8_t *read_pages[CPU_PAGE_COUNT];
+    uint8_t *write_pages[CPU_PAGE_COUNT];
+} CpuMemoryMap;
+
+typedef enum {
+    STATE_REQUEST_NONE,
+    STATE_REQUEST_SAVE, // waiting for an instruction boundary to take the state at
+    STATE_REQUEST_SAVE_REGS, // taken, waiting for the CPU to report its registers as of that boundary
+    STATE_REQUEST_LOAD, // waiting for an instruction boundary to restore the state at
+} StateRequestType;
+
+// a save or load waiting to be carried out by the system loop (see system_save_state)
+typedef struct {
+    StateRequestType type;
+    void *buf;
+    size_t buf_len;
+    void (*done)(void *arg, bool ok);
+    void *done_arg;
+    uint64_t boundary_cycle; // first CPU cycle after the boundary the state was taken at
+    CpuRegisters cpu_regs;
+} StateRequest;
+
+#define REGS_PROGRAM_SIZE 13
+
+// the CPU core can't have its registers set directly, so they're restored by resetting it and having it run a short
+// program which loads them and jumps to where the state left off
+typedef struct {
+    bool active;
+    bool done;
+    unsigned int cycles;
+    uint8_t program[REGS_PROGRAM_SIZE];
+    uint16_t status_addr; // where the program pulls the status register from
+    uint8_t status;
+    // the real memory map, which is swapped for an empty one so that every access comes through the slow path
+    CpuMemoryMap memory_map;
+} CpuRegsRestore;
+
+typedef struct {
+    bool halted;
+    bool stepping;
+    bool dead;
+
+    bool headless;
+    bool throttle;
+    // let the CPU run ahead of the PPU, which is caught up only when something could observe the difference
+    bool ppu_catch_up;
+    // set by mappers while some of the PPU's pattern tables read from open bus, which holds whatever the CPU last put on
+    // it, so the PPU has to be kept in step with the CPU
+    bool chr_open_bus;
+
+    // 0 means no limit
+    uint64_t frame_limit;
+    uint64_t cycle_limit;
+
+    uint64_t frame_count;
+
+    // the picture as emitted by the PPU, row-major, as palette indices
+    // the renderer converts it to RGB once per frame
+    uint8_t framebuffer[RESOLUTION_V][RESOLUTION_H];
+    // color emphasis bits (red, green, blue from LSB) latched at the start of each row, selects the palette LUT
+    uint8_t framebuffer_emphasis[RESOLUTION_V];
+
+    unsigned char ram[SYSTEM_MEMORY_SIZE];
+    unsigned char *prg_ram;
+    size_t prg_ram_size;
+    unsigned char *chr_ram;
+    size_t chr_ram_size;
+
+    unsigned char *chip_ram;
+    size_t chip_ram_size;
+
+    Cartridge *cart;
+
+    CpuMemoryMap memory_map;
+
+    TvSystem tv_system;
+    uint64_t master_clock_speed;
+    uint64_t cpu_clock_divider;
+    uint64_t ppu_clock_divider;
+    // the instantiation of the system loop with this TV system's dividers baked in
+    void (*loop_func)(void);
+
+    // all timestamps are measured in master clock ticks since power-on
+    uint64_t master_clock; // timestamp of the edge currently being processed
+    uint64_t next_cpu_edge; // timestamp of the next CPU clock edge
+    uint64_t next_ppu_edge; // timestamp of the next PPU clock edge
+    // the PPU has run every edge before this one
+    // while it's behind next_ppu_edge, the edges in between are dots which haven't been run yet
+    uint64_t ppu_synced_edge;
+    // the mapper's event_func runs on this edge, after the CPU (UINT64_MAX if nothing is scheduled)
+    // the PPU is never left behind past it, so it's always an edge the loop stops on
+    uint64_t mapper_event_edge;
+
+    uint8_t bus_val; // the value on the data bus
+
+    uint64_t total_cpu_cycles;
+
+    bool dma_in_progress;
+    uint8_t dma_page;
+    unsigned int dma_step;
+
+    unsigned int (*nmi_line_callback)(void);
+    unsigned int (*irq_line_callback)(void);
+    unsigned int (*rst_line_callback)(void);
+
+    // the reset line is held low until the master clock reaches this timestamp
+    uint64_t rst_deadline;
+
+    StateRequest state_request;
+    // set by the CPU's log callback when the state request can be acted on, which the loop does once it's done with the
+    // current edge
+    bool at_boundary;
+    CpuRegsRestore regs_restore;
+
+    // for telling whether the CPU may have an NMI latched which it hasn't started handling
+    unsigned int nmi_line_seen; // the NMI line as the CPU last read it
+    uint64_t nmi_fall_cycle; // CPU cycle at which the CPU last saw the NMI line fall
+    uint64_t vector_read_cycle; // CPU cycle at which the CPU last read an interrupt vector
+} SystemState;
+
+// save states capture everything needed to resume the console
+// they're only ever taken between two CPU instructions, which is the only point at which the CPU's registers are known
+// (the CPU reports them through its log callback) and can be put back
+#define SAVE_STATE_MAGIC "CNESSAV"
+#define SAVE_STATE_VERSION 4
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t size; // including this header
+    uint32_t mapper_id;
+} SaveStateHeader;
+
+void system_init_state(SystemState *state);
+
 void initialize_system(Cartridge *cart);
 
 TvSystem system_get_tv_system(void);
 
+void system_set_headless(bool headless);
+
+bool system_is_headless(void);
+
+void system_set_throttle(bool throttle);
+
+void system_set_ppu_catch_up(bool catch_up);
+
+void system_set_chr_open_bus(bool open_bus);
+
+void system_set_frame_limit(uint64_t frames);
+
+void system_set_cycle_limit(uint64_t cycles);
+
+uint64_t system_get_frame_count(void);
+
+uint64_t system_get_cpu_cycles(void);
+
+uint64_t system_get_master_clock_speed(void);
+
 unsigned int system_read_nmi_line(void);
 
 unsigned int system_read_irq_line(void);
@@ -69,8 +238,17 @@ void system_ram_write(uint16_t addr, uint8_t val);
 
 uint8_t system_memory_read(uint16_t addr);
 
+// reads memory without touching the bus or any MMIO; returns 0 for addresses which can't be read that way
+uint8_t system_peek_memory(uint16_t addr);
+
 void system_memory_write(uint16_t addr, uint8_t val);
 
+void system_map_memory(uint16_t addr, size_t len, const uint8_t *read_mem, uint8_t *write_mem);
+
+void system_map_prg_ram(uint16_t addr, size_t len, bool writable);
+
+void system_remap_banks(void);
+
 uint8_t system_vram_read(uint16_t addr);
 
 void system_vram_write(uint16_t addr, uint8_t val);
@@ -81,8 +259,38 @@ void system_lower_memory_write(uint16_t addr, uint8_t val);
 
 void system_dump_ram(void);
 
+size_t system_get_state_size(void);
+
+// these only queue the request, which the system loop carries out at the next instruction boundary (usually within a
+// few cycles) and then calls done (if not NULL) on the emulation thread
+// the buffer has to stay around until then, and only one request can be pending at a time
+bool system_save_state(void *buf, size_t buf_len, void (*done)(void *arg, bool ok), void *done_arg);
+
+// the state is checked against the loaded cartridge right away, so a false return means nothing was queued
+// if the CPU's registers then can't be restored, the console is left as it was but the CPU has to be reset
+bool system_load_state(const void *buf, size_t buf_len, void (*done)(void *arg, bool ok), void *done_arg);
+
+bool system_is_state_request_pending(void);
+
+// the file is written once the state has been taken
+bool system_write_state_file(const char *file_name);
+
+bool system_read_state_file(const char *file_name);
+
 void system_start_oam_dma(uint8_t page);
 
+void system_sync_ppu(void);
+
+void system_update_cpu_log(void);
+
+uint64_t system_get_cpu_dot(void);
+
+void system_notify_a12(bool high);
+
+void system_schedule_mapper_event(uint64_t dot);
+
+void system_cancel_mapper_event(void);
+
 void do_system_loop(void);
 
 void break_execution(void);
@@ -103,6 +311,8 @@ void system_connect_rst_line(unsigned int (*irq_line_callback)(void));
 
 void system_set_rst_cycles(unsigned int cycles);
 
-void system_emit_pixel(unsigned int x, unsigned int y, const RGBValue color);
+void system_emit_pixel(unsigned int x, unsigned int y, uint8_t palette_index);
+
+void system_emit_row_emphasis(unsigned int y, uint8_t emphasis);
 
 void system_submit_frame(void);
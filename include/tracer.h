@@ -0,0 +1,69 @@
+/*
+ * This file is a part of cNES.
+ * Copyright (c) 2019, Max Roncace <mproncace@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "c6502/cpu.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TRACE_FILE_MAGIC "CNESTRC"
+#define TRACE_FILE_VERSION 1
+
+// trace files start with this header, followed by a flat array of TraceRecords
+// both are written in host byte order
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+} TraceFileHeader;
+
+// one executed instruction
+// the registers, cycle count and PPU position are as of the start of the instruction
+typedef struct {
+    uint64_t cpu_cycle;
+    uint16_t pc;
+    uint16_t ppu_scanline;
+    uint16_t ppu_scanline_tick;
+    uint8_t opcode[3]; // the opcode and the two bytes after it, regardless of the instruction's length
+    uint8_t acc;
+    uint8_t x;
+    uint8_t y;
+    uint8_t sp;
+    uint8_t status;
+} TraceRecord;
+
+// the CPU's log callback is process-wide, so only one trace can be running at a time
+// starting and stopping may be done from any thread; records are taken from whichever console is executing
+// a started trace is picked up by the emulation thread at its next frame (or immediately if it isn't running yet)
+bool tracer_start(const char *file_name);
+
+void tracer_stop(void);
+
+bool tracer_is_running(void);
+
+// called by the system for every instruction the CPU completes while tracing
+void tracer_on_instruction(char *instr_str, CpuRegisters regs);
@@ -41,6 +41,18 @@
 
 #define PACKED __attribute__((packed))
 
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
+#ifdef _MSC_VER
+#define ALWAYS_INLINE __forceinline
+#else
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#endif
+
 #define DIV_CEIL(x, y) (((x) + (y) - 1) / (y))
 
 typedef struct {
@@ -68,6 +80,18 @@ static inline uint32_t endian_swap(uint32_t x) {
            (x << 24);
 }
 
+static inline uint64_t now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+    return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static inline uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
 static inline void sleep_cp(int ms) {
     #ifdef _WIN32
     Sleep(ms);
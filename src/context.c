@@ -0,0 +1,60 @@
+/*
+ * This file is a part of cNES.
+ * Copyright (c) 2019, Max Roncace <mproncace@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "context.h"
+#include "rewind.h"
+#include "spin.h"
+#include "system.h"
+#include "input/input_device.h"
+
+#include <stdlib.h>
+
+THREAD_LOCAL NesContext *g_ctx = NULL;
+
+NesContext *create_context(void) {
+    NesContext *ctx = (NesContext*) calloc(1, sizeof(NesContext));
+
+    system_init_state(&ctx->system);
+    spin_init_state(&ctx->spin);
+
+    return ctx;
+}
+
+void destroy_context(NesContext *ctx) {
+    // controllers and rewind history are torn down through their APIs, which operate on the current context
+    NesContext *prev_ctx = g_ctx;
+    g_ctx = ctx;
+    deinit_controllers();
+    rewind_deinit();
+    g_ctx = prev_ctx == ctx ? NULL : prev_ctx;
+
+    free(ctx->system.prg_ram);
+    free(ctx->system.chr_ram);
+    free(ctx);
+}
+
+void make_context_current(NesContext *ctx) {
+    g_ctx = ctx;
+}
@@ -25,7 +25,10 @@
 
 #include "ppu.h"
 #include "renderer.h"
+#include "rewind.h"
+#include "stats.h"
 #include "system.h"
+#include "tracer.h"
 #include "input/global/hotkeys.h"
 #include "c6502/cpu.h"
 
@@ -35,13 +38,16 @@
 #define KEY_MODE_NORMAL SDLK_F1
 #define KEY_MODE_NAME_TABLE SDLK_F2
 #define KEY_MODE_PATTERN_TABLE SDLK_F3
+#define KEY_ACTION_TOGGLE_TRACE SDLK_F4
 #define KEY_ACTION_CONTINUE SDLK_F5
 #define KEY_ACTION_STEP SDLK_F6
 #define KEY_ACTION_BREAK SDLK_F7
+#define KEY_ACTION_DUMP_STATS SDLK_F8
 #define KEY_ACTION_DUMP_RAM SDLK_F9
 #define KEY_ACTION_DUMP_VRAM SDLK_F10
 #define KEY_ACTION_DUMP_OAM SDLK_F11
 #define KEY_ACTION_RESET SDLK_r
+#define KEY_ACTION_REWIND SDLK_BACKSPACE
 
 static bool g_ctrl_down = false;
 
@@ -66,6 +72,13 @@ static void _global_hotkey_callback(SDL_Event *event) {
                     set_render_mode(RM_PT);
                     printf("Showing pattern tables\n");
                     break;
+                case KEY_ACTION_TOGGLE_TRACE:
+                    if (tracer_is_running()) {
+                        tracer_stop();
+                    } else {
+                        tracer_start("trace.bin");
+                    }
+                    break;
                 case KEY_ACTION_CONTINUE:
                     if (!is_execution_halted()) {
                         printf("Can't continue during live execution\n");
@@ -93,6 +106,9 @@ static void _global_hotkey_callback(SDL_Event *event) {
                     printf("Breaking execution\n");
                     break_execution();
                     break;
+                case KEY_ACTION_DUMP_STATS:
+                    stats_dump(stdout);
+                    break;
                 case KEY_ACTION_DUMP_RAM:
                     printf("Dumping system RAM\n");
                     system_dump_ram();
@@ -110,6 +126,9 @@ static void _global_hotkey_callback(SDL_Event *event) {
                         system_set_rst_cycles(10);
                     }
                     break;
+                case KEY_ACTION_REWIND:
+                    rewind_set_active(true);
+                    break;
             }
             break;
         case SDL_KEYUP:
@@ -117,6 +136,9 @@ static void _global_hotkey_callback(SDL_Event *event) {
                 case SDLK_LCTRL:
                     g_ctrl_down = false;
                     break;
+                case KEY_ACTION_REWIND:
+                    rewind_set_active(false);
+                    break;
             }
     }
 }
@@ -23,6 +23,7 @@
  * THE SOFTWARE.
  */
 
+#include "context.h"
 #include "input/input_device.h"
 
 #include <assert.h>
@@ -32,8 +33,6 @@
 #define MIN_PORT 0
 #define MAX_PORT 1
 
-static Controller *controllers[2];
-
 uint8_t nil_poller(Controller *controller) {
     return 0;
 }
@@ -45,42 +44,50 @@ static Controller empty_controller = {0, CONTROLLER_TYPE_NONE, nil_poller, nil_p
 
 void init_controllers(void) {
     for (unsigned int i = MIN_PORT; i <= MAX_PORT; i++) {
-        controllers[i] = &empty_controller;
+        g_ctx->input.controllers[i] = &empty_controller;
     }
 }
 
 Controller *get_controller(unsigned int port) {
     assert(port >= MIN_PORT && port <= MAX_PORT);
-    return controllers[port];
+    return g_ctx->input.controllers[port];
 }
 
 void controller_connect(Controller *controller) {
     assert(controller->id >= MIN_PORT && controller->id <= MAX_PORT);
-    controllers[controller->id] = controller;
+    g_ctx->input.controllers[controller->id] = controller;
 }
 
 void controller_disconnect(unsigned int port) {
     assert(port >= MIN_PORT && port <= MAX_PORT);
 
-    if (controllers[port] != &empty_controller) {
-        if (controllers[port]->state) {
-            free(controllers[port]->state);
+    if (g_ctx->input.controllers[port] != &empty_controller) {
+        if (g_ctx->input.controllers[port]->state) {
+            free(g_ctx->input.controllers[port]->state);
         }
-        free(controllers[port]);
+        free(g_ctx->input.controllers[port]);
     }
 
-    controllers[port] = &empty_controller;
+    g_ctx->input.controllers[port] = &empty_controller;
 }
 
 uint8_t controller_poll(unsigned int port) {
     assert(port >= MIN_PORT && port <= MAX_PORT);
  
-    return controllers[port]->poller(controllers[port]);
+    return g_ctx->input.controllers[port]->poller(g_ctx->input.controllers[port]);
 }
 
 void controller_push(unsigned int port, uint8_t data) {
     // there's only one output port, which is directed to both controllers
     for (int port = MIN_PORT; port <= MAX_PORT; port++) {
-        controllers[port]->pusher(controllers[port], data);
+        g_ctx->input.controllers[port]->pusher(g_ctx->input.controllers[port], data);
+    }
+}
+
+void deinit_controllers(void) {
+    for (unsigned int i = MIN_PORT; i <= MAX_PORT; i++) {
+        if (g_ctx->input.controllers[i] != NULL) {
+            controller_disconnect(i);
+        }
     }
 }
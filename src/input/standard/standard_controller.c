@@ -23,6 +23,7 @@
  * THE SOFTWARE.
  */
 
+#include "context.h"
 #include "input/standard/standard_controller.h"
 
 #include <assert.h>
@@ -37,11 +38,9 @@ typedef struct {
     unsigned int bit;
 } ScState;
 
-static UintConsumer g_poll_callback;
-
 void sc_attach_driver(NullaryCallback init, UintConsumer callback) {
     init();
-    g_poll_callback = callback;
+    g_ctx->input.sc_poll_callback = callback;
 }
 
 uint8_t _sc_poll(Controller *controller) {
@@ -50,7 +49,7 @@ uint8_t _sc_poll(Controller *controller) {
     if (state_cast->strobe) {
         state_cast->bit = 0;
 
-        g_poll_callback(controller->id);
+        g_ctx->input.sc_poll_callback(controller->id);
     }
 
     if (state_cast->bit > 7) {
@@ -73,7 +72,7 @@ void _sc_push(Controller *controller, uint8_t data) {
 
     if (state_cast->strobe) {
         state_cast->bit = 0;
-        g_poll_callback(controller->id);
+        g_ctx->input.sc_poll_callback(controller->id);
     }
 }
 
@@ -83,7 +82,8 @@ Controller *create_standard_controller(unsigned int controller_id) {
     controller->type = CONTROLLER_TYPE_STANDARD;
     controller->poller = _sc_poll;
     controller->pusher = _sc_push;
-    controller->state = (ScState*) malloc(sizeof(ScState));
+    controller->state = (ScState*) calloc(1, sizeof(ScState));
+    controller->state_size = sizeof(ScState);
 
     return controller;
 }
@@ -269,9 +269,13 @@ Cartridge *load_rom(FILE *file, char *file_name) {
     cart->chr_nvram_size = chr_nvram_size;
     cart->timing_mode = timing_mode;
 
-    if (mapper->init_func != NULL) {
-        mapper->init_func(cart);
-    }
-
     return cart;
 }
+
+void unload_rom(Cartridge *cart) {
+    free(cart->mapper->state);
+    free(cart->mapper);
+    free(cart->chr_rom);
+    free(cart->prg_rom);
+    free(cart);
+}
@@ -24,14 +24,21 @@
  */
 
 #include "cartridge.h"
+#include "context.h"
 #include "loader.h"
 #include "renderer.h"
+#include "rewind.h"
+#include "spin.h"
+#include "stats.h"
 #include "system.h"
+#include "tracer.h"
+#include "util.h"
 #include "input/global/hotkeys.h"
 
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -41,36 +48,122 @@
 
 #define SDL_MAIN_HANDLED 1
 
+#define DEFAULT_REWIND_SECONDS 600
+
+#define USAGE_MSG "Usage: %s [--headless] [--stats] [--trace <file>] [--rewind <seconds>] [--palette <file>] [--frames <N>] [--cycles <N>] [--lockstep] [--no-spin-skip] <ROM>\n"
+
 extern bool g_close_requested;
 
+static bool g_headless = false;
+static bool g_print_stats = false;
+
 void interrupt_handler(int signum) {
     kill_execution();
-    close_window();
+    if (!g_headless) {
+        close_window();
+    }
     g_close_requested = true;
 }
 
-void *_start_system_thread(void *_) {
+void *_start_system_thread(void *ctx) {
+    make_context_current((NesContext*) ctx);
     do_system_loop();
     return NULL;
 }
 
+static bool _parse_count(const char *arg, uint64_t *out) {
+    char *end;
+    unsigned long long val = strtoull(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0') {
+        return false;
+    }
+    *out = val;
+    return true;
+}
+
+static void _print_headless_report(uint64_t elapsed_us) {
+    double elapsed_s = elapsed_us / 1000000.0;
+    uint64_t frames = system_get_frame_count();
+    uint64_t cpu_cycles = system_get_cpu_cycles();
+
+    printf("Emulated %llu frames (%llu CPU cycles) in %.3f s\n",
+            (unsigned long long) frames, (unsigned long long) cpu_cycles, elapsed_s);
+    if (elapsed_s > 0) {
+        printf("  %.1f frames/sec\n", frames / elapsed_s);
+        printf("  %.0f CPU cycles/sec\n", cpu_cycles / elapsed_s);
+    }
+}
+
 int main(int argc, char **argv) {
-    if (argc < 2) {
-        printf("Too few args!\n");
-        printf("Usage: %s <ROM>\n", argv[0]);
-        exit(1);
+    char *rom_file_name = NULL;
+    uint64_t frame_limit = 0;
+    uint64_t cycle_limit = 0;
+    char *trace_file_name = NULL;
+    char *palette_file_name = NULL;
+    uint64_t rewind_seconds = DEFAULT_REWIND_SECONDS;
+    bool rewind_seconds_set = false;
+    bool lockstep = false;
+    bool spin_skip = true;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--headless") == 0) {
+            g_headless = true;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            g_print_stats = true;
+        } else if (strcmp(argv[i], "--lockstep") == 0) {
+            lockstep = true;
+        } else if (strcmp(argv[i], "--no-spin-skip") == 0) {
+            spin_skip = false;
+        } else if (strcmp(argv[i], "--rewind") == 0) {
+            if (i + 1 >= argc || !_parse_count(argv[i + 1], &rewind_seconds)) {
+                printf("Option %s requires a numeric argument\n", argv[i]);
+                printf(USAGE_MSG, argv[0]);
+                exit(1);
+            }
+            rewind_seconds_set = true;
+            i++;
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            if (i + 1 >= argc) {
+                printf("Option %s requires a file name\n", argv[i]);
+                printf(USAGE_MSG, argv[0]);
+                exit(1);
+            }
+            trace_file_name = argv[++i];
+        } else if (strcmp(argv[i], "--palette") == 0) {
+            if (i + 1 >= argc) {
+                printf("Option %s requires a file name\n", argv[i]);
+                printf(USAGE_MSG, argv[0]);
+                exit(1);
+            }
+            palette_file_name = argv[++i];
+        } else if (strcmp(argv[i], "--frames") == 0 || strcmp(argv[i], "--cycles") == 0) {
+            if (i + 1 >= argc || !_parse_count(argv[i + 1], argv[i][2] == 'f' ? &frame_limit : &cycle_limit)) {
+                printf("Option %s requires a numeric argument\n", argv[i]);
+                printf(USAGE_MSG, argv[0]);
+                exit(1);
+            }
+            i++;
+        } else if (argv[i][0] == '-' && argv[i][1] == '-') {
+            printf("Unrecognized option %s\n", argv[i]);
+            printf(USAGE_MSG, argv[0]);
+            exit(1);
+        } else if (rom_file_name == NULL) {
+            rom_file_name = argv[i];
+        } else {
+            printf("Too many args!\n");
+            printf(USAGE_MSG, argv[0]);
+            exit(1);
+        }
     }
 
-    if (argc > 2) {
-        printf("Too many args!\n");
-        printf("Usage: %s <ROM>\n", argv[0]);
+    if (rom_file_name == NULL) {
+        printf("Too few args!\n");
+        printf(USAGE_MSG, argv[0]);
         exit(1);
     }
 
     signal(SIGINT, interrupt_handler);
 
-    char *rom_file_name = argv[1];
-
     FILE *rom_file = fopen(rom_file_name, "rb");
 
     if (!rom_file) {
@@ -103,19 +196,73 @@ int main(int argc, char **argv) {
 
     printf("Successfully loaded ROM file %s.\n", rom_file_name);
 
+    // this thread drives the window and hotkeys, so it needs to see the same console as the emulation thread
+    NesContext *ctx = create_context();
+    make_context_current(ctx);
+
+    system_set_frame_limit(frame_limit);
+    system_set_cycle_limit(cycle_limit);
+    // mainly for checking that catching up gives the same results
+    system_set_ppu_catch_up(!lockstep);
+    spin_set_enabled(spin_skip);
+
+    // the counters are always kept, but timing has a small cost so it's only done when the stats will be printed
+    stats_set_time_sampling(g_print_stats);
+
+    if (g_headless) {
+        // no window, no input, and no reason to run at real-time speed
+        system_set_headless(true);
+        system_set_throttle(false);
+
+        printf("Starting headless execution...\n");
+
+        initialize_system(cart);
+
+        // there's nobody to rewind a headless session, so only keep history if it was asked for
+        if (rewind_seconds_set) {
+            rewind_init(rewind_seconds);
+        }
+
+        if (trace_file_name != NULL && !tracer_start(trace_file_name)) {
+            return -1;
+        }
+
+        uint64_t start_us = now_us();
+        do_system_loop();
+        _print_headless_report(now_us() - start_us);
+
+        tracer_stop();
+
+        if (g_print_stats) {
+            stats_dump(stdout);
+        }
+
+        return 0;
+    }
+
     printf("Initializing global input handler...\n");
 
     init_global_hotkeys();
 
     printf("Starting execution...\n");
 
+    if (palette_file_name != NULL && !load_palette_file(palette_file_name)) {
+        return -1;
+    }
+
     initialize_window();
     initialize_renderer();
 
     initialize_system(cart);
 
+    rewind_init(rewind_seconds);
+
+    if (trace_file_name != NULL && !tracer_start(trace_file_name)) {
+        return -1;
+    }
+
     #ifdef _WIN32
-    HANDLE thread_handle = CreateThread(NULL, 0, _start_system_thread, NULL, 0, NULL);
+    HANDLE thread_handle = CreateThread(NULL, 0, _start_system_thread, ctx, 0, NULL);
     if (thread_handle == NULL) {
         fprintf(stderr, "Failed to create emulation thread (error code %d)\n", GetLastError());
         return 1;
@@ -123,7 +270,7 @@ int main(int argc, char **argv) {
     #else
     pthread_t thread_handle;
     int rc;
-    if ((rc = pthread_create(&thread_handle, NULL, &_start_system_thread, NULL)) != 0) {
+    if ((rc = pthread_create(&thread_handle, NULL, &_start_system_thread, ctx)) != 0) {
         fprintf(stderr, "Failed to create emulation thread (error code %d)\n", rc);
         return 1;
     }
@@ -131,5 +278,15 @@ int main(int argc, char **argv) {
 
     do_window_loop();
 
+    tracer_stop();
+
+    printf("Frames dropped: %llu, duplicated: %llu\n",
+            (unsigned long long) get_dropped_frame_count(),
+            (unsigned long long) get_duplicated_frame_count());
+
+    if (g_print_stats) {
+        stats_dump(stdout);
+    }
+
     return 0;
 }
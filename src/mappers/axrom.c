@@ -31,55 +31,89 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define PRG_BANK_SHIFT 15
 #define PRG_BANK_GRANULARITY (1 << PRG_BANK_SHIFT)
 
-static unsigned char g_prg_bank;
-static unsigned char g_nametable;
+typedef struct {
+    NromState nrom;
+    unsigned char prg_bank;
+    unsigned char nametable;
+} AxromState;
+
+static void _axrom_remap(Cartridge *cart) {
+    AxromState *state = (AxromState*) cart->mapper->state;
+
+    for (uint32_t addr = 0x8000; addr <= 0xFFFF; addr += CPU_PAGE_SIZE) {
+        system_map_memory(addr, CPU_PAGE_SIZE,
+                &cart->prg_rom[((state->prg_bank * PRG_BANK_GRANULARITY) | (addr % PRG_BANK_GRANULARITY)) % cart->prg_size],
+                NULL);
+    }
+
+    nrom_map_chr(cart);
+
+    // same as the address translation in _axrom_vram_read
+    for (unsigned int i = 0; i < 4; i++) {
+        ppu_map_vram_page(VRAM_NAME_TABLE_PAGE + i, ppu_get_name_table_page((i & 1) | (state->nametable ? 2 : 0)));
+    }
+}
 
 static uint8_t _axrom_ram_read(Cartridge *cart, uint16_t addr) {
+    AxromState *state = (AxromState*) cart->mapper->state;
+
     if (addr < 0x8000) {
         return system_lower_memory_read(addr);
     }
 
-    return cart->prg_rom[((g_prg_bank * PRG_BANK_GRANULARITY) | (addr % PRG_BANK_GRANULARITY)) % cart->prg_size];
+    return cart->prg_rom[((state->prg_bank * PRG_BANK_GRANULARITY) | (addr % PRG_BANK_GRANULARITY)) % cart->prg_size];
 }
 
 static void _axrom_ram_write(Cartridge *cart, uint16_t addr, uint8_t val) {
+    AxromState *state = (AxromState*) cart->mapper->state;
+
     if (addr < 0x8000) {
         system_lower_memory_write(addr, val);
         return;
     }
 
-    g_prg_bank = val & 0x7;
-    g_nametable = (val >> 4) & 0x1;
+    state->prg_bank = val & 0x7;
+    state->nametable = (val >> 4) & 0x1;
+    _axrom_remap(cart);
 }
 
 static uint8_t _axrom_vram_read(Cartridge *cart, uint16_t addr) {
+    AxromState *state = (AxromState*) cart->mapper->state;
+
     if (addr >= 0x2000 && addr <= 0x3EFF) {
-        return nrom_vram_read(cart, (addr % 0x800) + (g_nametable ? 0x2800 : 0x2000));
+        return nrom_vram_read(cart, (addr % 0x800) + (state->nametable ? 0x2800 : 0x2000));
     } else {
         return nrom_vram_read(cart, addr);
     }
 }
 
 static void _axrom_vram_write(Cartridge *cart, uint16_t addr, uint8_t val) {
+    AxromState *state = (AxromState*) cart->mapper->state;
+
     if (addr >= 0x2000 && addr <= 0x3EFF) {
-        nrom_vram_write(cart, (addr % 0x800) + (g_nametable ? 0x2800 : 0x2000), val);
+        nrom_vram_write(cart, (addr % 0x800) + (state->nametable ? 0x2800 : 0x2000), val);
     } else {
         nrom_vram_write(cart, addr, val);
     }
 }
 
 void mapper_init_axrom(Mapper *mapper, unsigned int submapper_id) {
-    mapper->id = MAPPER_ID_CNROM;
+    mapper->id = MAPPER_ID_AXROM;
     memcpy(mapper->name, "AxROM", strlen("AxROM") + 1);
     mapper->init_func       = NULL;
     mapper->ram_read_func   = *_axrom_ram_read;
     mapper->ram_write_func  = *_axrom_ram_write;
     mapper->vram_read_func  = *_axrom_vram_read;
     mapper->vram_write_func = *_axrom_vram_write;
-    mapper->tick_func       = NULL;
+    mapper->a12_func        = NULL;
+    mapper->event_func      = NULL;
+    mapper->remap_func      = *_axrom_remap;
+    mapper->state           = calloc(1, sizeof(AxromState));
+    mapper->state_size      = sizeof(AxromState);
 }
@@ -27,27 +27,32 @@
 #include "system.h"
 #include "c6502/cpu.h"
 #include "mappers/mappers.h"
+#include "mappers/cnrom.h"
 #include "mappers/nrom.h"
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define CHR_BANK_GRANULARITY 0x2000
 
-static uint8_t g_chr_bank;
-
 static uint32_t _cnrom_get_chr_offset(Cartridge *cart, uint16_t addr) {
+    CnromState *state = (CnromState*) cart->mapper->state;
+
     assert(addr < 0x2000);
 
-    return ((g_chr_bank * CHR_BANK_GRANULARITY) | (addr % CHR_BANK_GRANULARITY)) % cart->chr_size;
+    return ((state->chr_bank * CHR_BANK_GRANULARITY) | (addr % CHR_BANK_GRANULARITY)) % cart->chr_size;
 }
 
 void _cnrom_ram_write(Cartridge *cart, uint16_t addr, uint8_t val) {
+    CnromState *state = (CnromState*) cart->mapper->state;
+
     if (addr < 0x8000) {
         nrom_ram_write(cart, addr, val);
     } else {
-        g_chr_bank = val & 0x03;
+        state->chr_bank = val & 0x03;
+        _cnrom_remap(cart);
     }
 }
 
@@ -59,6 +64,16 @@ uint8_t _cnrom_vram_read(Cartridge *cart, uint16_t addr) {
     }
 }
 
+void _cnrom_remap(Cartridge *cart) {
+    nrom_map_prg(cart);
+
+    for (unsigned int page = 0; page < VRAM_NAME_TABLE_PAGE; page++) {
+        ppu_map_vram_page(page, &cart->chr_rom[_cnrom_get_chr_offset(cart, page * VRAM_PAGE_SIZE)]);
+    }
+
+    ppu_map_name_tables();
+}
+
 void mapper_init_cnrom(Mapper *mapper, unsigned int submapper_id) {
     mapper->id = MAPPER_ID_CNROM;
     memcpy(mapper->name, "CNROM", strlen("CNROM") + 1);
@@ -67,5 +82,9 @@ void mapper_init_cnrom(Mapper *mapper, unsigned int submapper_id) {
     mapper->ram_write_func  = *_cnrom_ram_write;
     mapper->vram_read_func  = *_cnrom_vram_read;
     mapper->vram_write_func = *nrom_vram_write;
-    mapper->tick_func       = NULL;
+    mapper->a12_func        = NULL;
+    mapper->event_func      = NULL;
+    mapper->remap_func      = *_cnrom_remap;
+    mapper->state           = calloc(1, sizeof(CnromState));
+    mapper->state_size      = sizeof(CnromState);
 }
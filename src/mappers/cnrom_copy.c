@@ -24,31 +24,38 @@
  */
 
 #include "cartridge.h"
+#include "context.h"
 #include "system.h"
 #include "c6502/cpu.h"
 #include "mappers/mappers.h"
+#include "mappers/cnrom.h"
 #include "mappers/nrom.h"
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
-static unsigned int garbage_reads = 2;
-
-extern uint8_t _cnrom_vram_read(Cartridge *cart, uint16_t addr);
+typedef struct {
+    CnromState cnrom;
+    unsigned int garbage_reads;
+    uint64_t last_rst_deadline; // the end of the last reset which has been accounted for
+} CnromCopyState;
 
 static uint8_t _cnrom_copy_ram_read(Cartridge *cart, uint16_t addr) {
-    if (addr == 0x2007 && garbage_reads > 0) {
-        garbage_reads--;
-        return 0x01 + garbage_reads; // arbitary garbage value not in use by any games
-    } else {
-        return nrom_ram_read(cart, addr);
+    CnromCopyState *state = (CnromCopyState*) cart->mapper->state;
+
+    // the copy protection chip starts over whenever the console is reset
+    if (g_ctx->system.rst_deadline != state->last_rst_deadline) {
+        state->last_rst_deadline = g_ctx->system.rst_deadline;
+        state->garbage_reads = 2;
     }
-}
 
-static void _cnrom_copy_tick() {
-    if (system_read_rst_line() == 0) {
-        garbage_reads = 2;
+    if (addr == 0x2007 && state->garbage_reads > 0) {
+        state->garbage_reads--;
+        return 0x01 + state->garbage_reads; // arbitary garbage value not in use by any games
+    } else {
+        return nrom_ram_read(cart, addr);
     }
 }
 
@@ -60,5 +67,11 @@ void mapper_init_cnrom_copy(Mapper *mapper, unsigned int submapper_id) {
     mapper->ram_write_func  = *nrom_ram_write;
     mapper->vram_read_func  = *_cnrom_vram_read;
     mapper->vram_write_func = *nrom_vram_write;
-    mapper->tick_func       = _cnrom_copy_tick;
+    mapper->a12_func        = NULL;
+    mapper->event_func      = NULL;
+    mapper->remap_func      = *_cnrom_remap;
+    mapper->state           = calloc(1, sizeof(CnromCopyState));
+    mapper->state_size      = sizeof(CnromCopyState);
+
+    ((CnromCopyState*) mapper->state)->garbage_reads = 2;
 }
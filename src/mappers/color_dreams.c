@@ -31,18 +31,39 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define PRG_BANK_GRANULARITY 0x4000
 
 #define CHR_RAM_SIZE 0x2000
 
-static unsigned char g_prg_bank;
-static unsigned char g_chr_bank;
+typedef struct {
+    NromState nrom;
+    unsigned char prg_bank;
+    unsigned char chr_bank;
+} ColorDreamsState;
+
+static void _color_dreams_remap(Cartridge *cart) {
+    ColorDreamsState *state = (ColorDreamsState*) cart->mapper->state;
+
+    for (uint32_t addr = 0x8000; addr <= 0xFFFF; addr += CPU_PAGE_SIZE) {
+        system_map_memory(addr, CPU_PAGE_SIZE,
+                &cart->prg_rom[((state->prg_bank << 15) | (addr - 0x8000)) % cart->prg_size], NULL);
+    }
+
+    for (unsigned int page = 0; page < VRAM_NAME_TABLE_PAGE; page++) {
+        ppu_map_vram_page(page, &cart->chr_rom[((state->chr_bank << 13) | (page * VRAM_PAGE_SIZE)) % cart->chr_size]);
+    }
+
+    ppu_map_name_tables();
+}
 
 static uint8_t _color_dreams_ram_read(Cartridge *cart, uint16_t addr) {
+    ColorDreamsState *state = (ColorDreamsState*) cart->mapper->state;
+
     if (addr >= 0x8000) {
-        return cart->prg_rom[((g_prg_bank << 15) | (addr - 0x8000)) % cart->prg_size];
+        return cart->prg_rom[((state->prg_bank << 15) | (addr - 0x8000)) % cart->prg_size];
     } else {
         return system_lower_memory_read(addr);
     }
@@ -50,17 +71,22 @@ static uint8_t _color_dreams_ram_read(Cartridge *cart, uint16_t addr) {
 }
 
 static void _color_dreams_ram_write(Cartridge *cart, uint16_t addr, uint8_t val) {
+    ColorDreamsState *state = (ColorDreamsState*) cart->mapper->state;
+
     if (addr >= 0x8000) {
-        g_prg_bank = val & 3;
-        g_chr_bank = val >> 4;
+        state->prg_bank = val & 3;
+        state->chr_bank = val >> 4;
+        _color_dreams_remap(cart);
     } else {
         system_lower_memory_write(addr, val);
     }
 }
 
 static uint8_t _color_dreams_vram_read(Cartridge *cart, uint16_t addr) {
+    ColorDreamsState *state = (ColorDreamsState*) cart->mapper->state;
+
     if (addr < 0x2000) {
-        return cart->chr_rom[((g_chr_bank << 13) | addr) % cart->chr_size];
+        return cart->chr_rom[((state->chr_bank << 13) | addr) % cart->chr_size];
     } else {
         return nrom_vram_read(cart, addr);
     }
@@ -74,5 +100,9 @@ void mapper_init_color_dreams(Mapper *mapper, unsigned int submapper_id) {
     mapper->ram_write_func  = *_color_dreams_ram_write;
     mapper->vram_read_func  = *_color_dreams_vram_read;
     mapper->vram_write_func = *nrom_vram_write;
-    mapper->tick_func       = NULL;
+    mapper->a12_func        = NULL;
+    mapper->event_func      = NULL;
+    mapper->remap_func      = *_color_dreams_remap;
+    mapper->state           = calloc(1, sizeof(ColorDreamsState));
+    mapper->state_size      = sizeof(ColorDreamsState);
 }
@@ -24,6 +24,7 @@
  */
 
 #include "cartridge.h"
+#include "context.h"
 #include "system.h"
 #include "c6502/cpu.h"
 #include "input/input_device.h"
@@ -41,36 +42,40 @@
 #define CHR_BANK_GRANULARITY 0x1000
 #define PRG_BANK_GRANULARITY 0x4000
 
-static uint8_t g_write_count = 0;
-static uint8_t g_write_val = 0;
-
-static struct {
-    unsigned int chr_bank_mode:1;
-    unsigned int prg_bank_mode:2;
-    unsigned int mirroring:2;
-} g_mmc1_control;
-static unsigned char g_chr_bank_0;
-static unsigned char g_chr_bank_1;
-static unsigned char g_prg_bank;
-static bool g_enable_prg_ram = true;
+typedef struct {
+    uint8_t write_count;
+    uint8_t write_val;
+
+    struct {
+        unsigned int chr_bank_mode:1;
+        unsigned int prg_bank_mode:2;
+        unsigned int mirroring:2;
+    } control;
+    unsigned char chr_bank_0;
+    unsigned char chr_bank_1;
+    unsigned char prg_bank;
+    bool enable_prg_ram;
+} Mmc1State;
 
 static uint32_t _mmc1_get_prg_offset(Cartridge *cart, uint16_t addr) {
+    Mmc1State *state = (Mmc1State*) cart->mapper->state;
+
     assert(addr >= 0x8000);
 
     uint8_t bank;
     
-    switch (g_mmc1_control.prg_bank_mode) {
+    switch (state->control.prg_bank_mode) {
         case 0:
         case 1:
             // switch both banks at once
             // add 1 if the address is in the upper half of PRG
-            bank = (g_prg_bank & 0x1E) + (addr & 0x4000 ? 1 : 0);
+            bank = (state->prg_bank & 0x1E) + (addr & 0x4000 ? 1 : 0);
             break;
         case 2:
             // fix lower bank to first, switch upper
             if (addr & 0x4000) {
                 // upper half
-                bank = g_prg_bank;
+                bank = state->prg_bank;
             } else {
                 // lower half
                 bank = 0;
@@ -83,7 +88,7 @@ static uint32_t _mmc1_get_prg_offset(Cartridge *cart, uint16_t addr) {
                 bank = cart->prg_size / PRG_BANK_GRANULARITY - 1;
             } else {
                 // lower half
-                bank = g_prg_bank;
+                bank = state->prg_bank;
             }
             break;
     }
@@ -92,34 +97,66 @@ static uint32_t _mmc1_get_prg_offset(Cartridge *cart, uint16_t addr) {
 }
 
 static uint32_t _mmc1_get_chr_offset(Cartridge *cart, uint16_t addr) {
+    Mmc1State *state = (Mmc1State*) cart->mapper->state;
+
     assert(addr < 0x2000);
 
     uint8_t bank;
-    if (g_mmc1_control.chr_bank_mode) {
+    if (state->control.chr_bank_mode) {
         // two single-width switchable banks
         if (addr & 0x1000) {
             // upper bank
-            bank = g_chr_bank_1;
+            bank = state->chr_bank_1;
         } else {
             // lower bank
-            bank = g_chr_bank_0;
+            bank = state->chr_bank_0;
         }
     } else {
         // one double-width switchable bank
         // add 1 if the address is in the upper half of CHR
-        bank = (g_chr_bank_0 & 0x1E) + (addr & 0x1000 ? 1 : 0);
+        bank = (state->chr_bank_0 & 0x1E) + (addr & 0x1000 ? 1 : 0);
     }
 
     return ((bank * CHR_BANK_GRANULARITY) | (addr % 0x1000)) % cart->chr_size;
 }
 
+static void _mmc1_remap(Cartridge *cart) {
+    Mmc1State *state = (Mmc1State*) cart->mapper->state;
+
+    if (state->enable_prg_ram) {
+        system_map_prg_ram(0x6000, 0x2000, true);
+    } else {
+        system_map_memory(0x6000, 0x2000, NULL, NULL); // open bus
+    }
+
+    for (uint32_t addr = 0x8000; addr <= 0xFFFF; addr += CPU_PAGE_SIZE) {
+        system_map_memory(addr, CPU_PAGE_SIZE, &cart->prg_rom[_mmc1_get_prg_offset(cart, addr)], NULL);
+    }
+
+    for (unsigned int page = 0; page < VRAM_NAME_TABLE_PAGE; page++) {
+        uint16_t addr = page * VRAM_PAGE_SIZE;
+
+        if (cart->chr_size > 0) {
+            ppu_map_vram_page(page, &cart->chr_rom[_mmc1_get_chr_offset(cart, addr)]);
+        } else if (addr < g_ctx->system.chr_ram_size) {
+            ppu_map_vram_page(page, &g_ctx->system.chr_ram[addr]);
+        } else {
+            ppu_map_vram_page(page, NULL); // open bus
+        }
+    }
+
+    ppu_map_name_tables();
+}
+
 static uint8_t _mmc1_ram_read(Cartridge *cart, uint16_t addr) {
+    Mmc1State *state = (Mmc1State*) cart->mapper->state;
+
     if (addr < 0x6000) {
         return system_lower_memory_read(addr);
     }
 
     if (addr < 0x8000) {
-        return g_enable_prg_ram ? system_prg_ram_read(addr % 0x2000) : system_bus_read();
+        return state->enable_prg_ram ? system_prg_ram_read(addr % 0x2000) : system_bus_read();
     }
 
     uint32_t prg_offset = _mmc1_get_prg_offset(cart, addr);
@@ -133,13 +170,15 @@ static uint8_t _mmc1_ram_read(Cartridge *cart, uint16_t addr) {
 }
 
 static void _mmc1_ram_write(Cartridge *cart, uint16_t addr, uint8_t val) {
+    Mmc1State *state = (Mmc1State*) cart->mapper->state;
+
     if (addr < 0x6000) {
         system_lower_memory_write(addr, val);
         return;
     }
 
     if (addr < 0x8000) {
-        if (g_enable_prg_ram) {
+        if (state->enable_prg_ram) {
             system_prg_ram_write(addr % 0x2000, val);
         } else {
             system_bus_write(addr & 0xFF);
@@ -148,23 +187,24 @@ static void _mmc1_ram_write(Cartridge *cart, uint16_t addr, uint8_t val) {
     }
 
     if (val & 0x80) {
-        g_write_count = 0;
-        g_write_val = 0;
-        g_mmc1_control.prg_bank_mode = 3;
+        state->write_count = 0;
+        state->write_val = 0;
+        state->control.prg_bank_mode = 3;
+        _mmc1_remap(cart);
         return;
     }
 
-    g_write_val |= (val & 0x01) << g_write_count;
-    g_write_count++;
+    state->write_val |= (val & 0x01) << state->write_count;
+    state->write_count++;
 
-    if (g_write_count == 5) {
+    if (state->write_count == 5) {
         switch (addr & 0xE000) {
             case 0x8000:
-                g_mmc1_control.mirroring = g_write_val & 0x03;
-                g_mmc1_control.prg_bank_mode = (g_write_val >> 2) & 0x03;
-                g_mmc1_control.chr_bank_mode = (g_write_val >> 4) & 0x01;
+                state->control.mirroring = state->write_val & 0x03;
+                state->control.prg_bank_mode = (state->write_val >> 2) & 0x03;
+                state->control.chr_bank_mode = (state->write_val >> 4) & 0x01;
 
-                switch (g_mmc1_control.mirroring) {
+                switch (state->control.mirroring) {
                     case 0:
                         ppu_set_mirroring_mode(MIRROR_SINGLE_LOWER);
                         break;
@@ -181,20 +221,22 @@ static void _mmc1_ram_write(Cartridge *cart, uint16_t addr, uint8_t val) {
 
                 break;
             case 0xA000:
-                g_chr_bank_0 = g_write_val & 0x1F;
+                state->chr_bank_0 = state->write_val & 0x1F;
                 break;
             case 0xC000:
-                g_chr_bank_1 = g_write_val & 0x1F;
+                state->chr_bank_1 = state->write_val & 0x1F;
                 break;
             case 0xE000:
                 // technically the high bit is ignored, but it doesn't matter here
-                g_prg_bank = g_write_val & 0x1F;
-                g_enable_prg_ram = !((g_write_val & 0x1F) >> 4);
+                state->prg_bank = state->write_val & 0x1F;
+                state->enable_prg_ram = !((state->write_val & 0x1F) >> 4);
                 break;
         }
 
-        g_write_val = 0;
-        g_write_count = 0;
+        state->write_val = 0;
+        state->write_count = 0;
+
+        _mmc1_remap(cart);
     }
 }
 
@@ -250,9 +292,13 @@ void mapper_init_mmc1(Mapper *mapper, unsigned int submapper_id) {
     mapper->ram_write_func  = *_mmc1_ram_write;
     mapper->vram_read_func  = *_mmc1_vram_read;
     mapper->vram_write_func = *_mmc1_vram_write;
-    mapper->tick_func       = NULL;
-
-    g_mmc1_control.prg_bank_mode = 3;
-
-    ppu_set_mirroring_mode(MIRROR_SINGLE_LOWER);
+    mapper->a12_func        = NULL;
+    mapper->event_func      = NULL;
+    mapper->remap_func      = *_mmc1_remap;
+    mapper->state           = calloc(1, sizeof(Mmc1State));
+    mapper->state_size      = sizeof(Mmc1State);
+
+    Mmc1State *state = (Mmc1State*) mapper->state;
+    state->control.prg_bank_mode = 3;
+    state->enable_prg_ram = true;
 }
@@ -24,6 +24,7 @@
  */
 
 #include "cartridge.h"
+#include "context.h"
 #include "system.h"
 #include "c6502/cpu.h"
 #include "input/input_device.h"
@@ -50,53 +51,64 @@
 #define PRG_BANK_GRANULARITY 0x2000
 
 #define A12_COOLDOWN_PERIOD 3
-
-// false -> $C000-DFFF fixed, $8000-9FFF swappable
-// true  -> $8000-9FFF fixed, $C000-DFFF swappable
-static bool g_prg_switch_ranges = false;
-// false -> 2 banks at $0000, 4 at $1000
-// true  -> 4 banks at $0000, 2 at $1000
-static bool g_chr_inversion = false;
-
-static uint8_t g_bank_select = 0;
-
-static uint8_t g_chr_big_1 = 0;
-static uint8_t g_chr_big_2 = 0;
-static uint8_t g_chr_little_1 = 0;
-static uint8_t g_chr_little_2 = 0;
-static uint8_t g_chr_little_3 = 0;
-static uint8_t g_chr_little_4 = 0;
-static uint8_t g_prg_1 = 0;
-static uint8_t g_prg_2 = 1;
-
-static uint8_t g_irq_counter;
-static uint8_t g_irq_latch;
-static bool g_irq_reload;
-static bool g_irq_enabled = false;
-static uint16_t g_a12_cooldown = 0;
-static uint16_t g_last_addr = 0;
-static bool g_staged_irq = false;
-static bool g_asserting_irq = false;
-
-// submapper configurations
-static bool g_use_counter_edge = false;
-static bool g_use_a12_fall = false;
+// an edge which clocks the counter has to be preceded by the other edge, which starts the cooldown
+#define MIN_CLOCK_SPACING (A12_COOLDOWN_PERIOD + 1)
+
+typedef struct {
+    // false -> $C000-DFFF fixed, $8000-9FFF swappable
+    // true  -> $8000-9FFF fixed, $C000-DFFF swappable
+    bool prg_switch_ranges;
+    // false -> 2 banks at $0000, 4 at $1000
+    // true  -> 4 banks at $0000, 2 at $1000
+    bool chr_inversion;
+
+    uint8_t bank_select;
+
+    uint8_t chr_big_1;
+    uint8_t chr_big_2;
+    uint8_t chr_little_1;
+    uint8_t chr_little_2;
+    uint8_t chr_little_3;
+    uint8_t chr_little_4;
+    uint8_t prg_1;
+    uint8_t prg_2;
+
+    uint8_t irq_counter;
+    uint8_t irq_latch;
+    bool irq_reload;
+    bool irq_enabled;
+    uint64_t a12_cooldown_end; // first dot on which A12 edges are noticed again
+    bool a12_high; // as of the last tick which has been processed
+    // A12 can change more than once before the tick of a dot (e.g. the PPU fetches and the CPU writes $2006 on the same
+    // edge), so only the level it ends up at is looked at
+    bool a12_pending;
+    bool a12_pending_high;
+    uint64_t a12_pending_dot;
+    bool staged_irq;
+    bool asserting_irq;
+
+    // submapper configurations
+    bool use_counter_edge;
+    bool use_a12_fall;
+} Mmc3State;
 
 static uint32_t _mmc3_get_prg_offset(Cartridge *cart, uint16_t addr) {
+    Mmc3State *state = (Mmc3State*) cart->mapper->state;
+
     assert(addr >= 0x8000);
 
     uint8_t bank = 0;
     if (addr >= 0x8000 && addr <= 0x9FFF) {
-        if (g_prg_switch_ranges) {
+        if (state->prg_switch_ranges) {
             bank = (cart->prg_size / PRG_BANK_GRANULARITY) - 2; // fixed, use second-to-last bank
         } else {
-            bank = g_prg_1;
+            bank = state->prg_1;
         }
     } else if (addr >= 0xA000 && addr <= 0xBFFF) {
-        bank = g_prg_2;
+        bank = state->prg_2;
     } else if (addr >= 0xC000 && addr <= 0xDFFF) {
-        if (g_prg_switch_ranges) {
-            bank = g_prg_1;
+        if (state->prg_switch_ranges) {
+            bank = state->prg_1;
         } else {
             bank = (cart->prg_size / PRG_BANK_GRANULARITY) - 2; // fixed, use second-to-last bank
         }
@@ -108,10 +120,12 @@ static uint32_t _mmc3_get_prg_offset(Cartridge *cart, uint16_t addr) {
 }
 
 static uint32_t _mmc3_get_chr_offset(Cartridge *cart, uint16_t addr) {
+    Mmc3State *state = (Mmc3State*) cart->mapper->state;
+
     assert(addr < 0x2000);
 
     // undo the inversion (so the 0x0000..0x0FFF and 0x1000..0x1FFF ranges are swapped back)
-    if (g_chr_inversion) {
+    if (state->chr_inversion) {
         addr ^= 0x1000;
     }
 
@@ -120,30 +134,152 @@ static uint32_t _mmc3_get_chr_offset(Cartridge *cart, uint16_t addr) {
     uint8_t bank;
 
     if (addr >= 0x0000 && addr <= 0x07FF) {
-        bank = g_chr_big_1;
+        bank = state->chr_big_1;
     } else if (addr >= 0x0800 && addr <= 0x0FFF) {
-        bank = g_chr_big_2;
+        bank = state->chr_big_2;
     } else if (addr >= 0x1000 && addr <= 0x13FF) {
-        bank = g_chr_little_1;
+        bank = state->chr_little_1;
     } else if (addr >= 0x1400 && addr <= 0x17FF) {
-        bank = g_chr_little_2;
+        bank = state->chr_little_2;
     } else if (addr >= 0x1800 && addr <= 0x1BFF) {
-        bank = g_chr_little_3;
+        bank = state->chr_little_3;
     } else if (addr >= 0x1C00 && addr <= 0x1FFF) {
-        bank = g_chr_little_4;
+        bank = state->chr_little_4;
     }
 
     return ((bank * CHR_BANK_GRANULARITY) | (addr % bank_size)) % cart->chr_size;
 }
 
+static void _mmc3_remap(Cartridge *cart) {
+    system_map_prg_ram(0x6000, 0x2000, true);
+
+    for (uint32_t addr = 0x8000; addr <= 0xFFFF; addr += CPU_PAGE_SIZE) {
+        system_map_memory(addr, CPU_PAGE_SIZE, &cart->prg_rom[_mmc3_get_prg_offset(cart, addr)], NULL);
+    }
+
+    for (unsigned int page = 0; page < VRAM_NAME_TABLE_PAGE; page++) {
+        uint16_t addr = page * VRAM_PAGE_SIZE;
+
+        if (cart->chr_size > 0) {
+            ppu_map_vram_page(page, &cart->chr_rom[_mmc3_get_chr_offset(cart, addr)]);
+        } else if (addr < g_ctx->system.chr_ram_size) {
+            ppu_map_vram_page(page, &g_ctx->system.chr_ram[addr]);
+        } else {
+            ppu_map_vram_page(page, NULL); // open bus
+        }
+    }
+
+    ppu_map_name_tables();
+}
+
 static unsigned int _mmc3_irq_connection(void) {
-    return g_asserting_irq && g_irq_enabled ? 0 : 1;
+    Mmc3State *state = (Mmc3State*) g_ctx->system.cart->mapper->state;
+
+    return state->asserting_irq && state->irq_enabled ? 0 : 1;
 }
 
 static void _mmc3_init(Cartridge *cart) {
     system_connect_irq_line(_mmc3_irq_connection);
 }
 
+// processes the tick of the dot with the pending A12 change, if it comes before the given one
+static void _mmc3_tick_a12(Mmc3State *state, uint64_t before_dot) {
+    if (!state->a12_pending || state->a12_pending_dot >= before_dot) {
+        return;
+    }
+
+    state->a12_pending = false;
+
+    uint64_t dot = state->a12_pending_dot;
+    bool rising_a12 = state->a12_pending_high;
+
+    if (rising_a12 == state->a12_high) {
+        return;
+    }
+
+    state->a12_high = rising_a12;
+
+    if (rising_a12) {
+        MMC3_DEBUG("Detected A12 rising edge\n");
+    } else {
+        MMC3_DEBUG("Detected A12 falling edge\n");
+    }
+
+    if (dot < state->a12_cooldown_end) {
+        MMC3_DEBUG("Ignoring A12 edge (wasn't low/high for long enough prior)\n");
+        return;
+    }
+
+    if (state->use_a12_fall != rising_a12) {
+        MMC3_DEBUG("MMC3 IRQ counter clocked @ (%03d, %03d)\n", ppu_get_scanline(), ppu_get_scanline_tick());
+        uint8_t counter_old = state->irq_counter;
+
+        if (state->irq_reload || state->irq_counter == 0) {
+            state->irq_counter = state->irq_latch;
+            state->irq_reload = false;
+        } else {
+            state->irq_counter--;
+        }
+
+        if ((!state->use_counter_edge || counter_old > 0) && state->irq_counter == 0 && state->irq_enabled) {
+            state->staged_irq = true;
+            system_schedule_mapper_event(dot + 1);
+            MMC3_DEBUG("Staging IRQ for assertion on next tick\n");
+        }
+    } else {
+        state->a12_cooldown_end = dot + A12_COOLDOWN_PERIOD;
+    }
+}
+
+// the counter only changes on A12 edges, which come from the PPU as it's run, so the PPU can't be left behind past the
+// first dot where the IRQ could be staged
+// from_dot is the first dot which hasn't been ticked yet
+static void _mmc3_schedule_irq(Mmc3State *state, uint64_t from_dot) {
+    if (state->staged_irq) {
+        return; // already waiting to be asserted
+    }
+
+    if (!state->irq_enabled) {
+        system_cancel_mapper_event();
+        return;
+    }
+
+    unsigned int clocks = state->irq_reload || state->irq_counter == 0
+            ? state->irq_latch + 1
+            : state->irq_counter;
+
+    system_schedule_mapper_event(from_dot + (clocks - 1) * MIN_CLOCK_SPACING);
+}
+
+static void _mmc3_a12(Cartridge *cart, bool high, uint64_t dot) {
+    Mmc3State *state = (Mmc3State*) cart->mapper->state;
+
+    _mmc3_tick_a12(state, dot);
+
+    state->a12_pending = true;
+    state->a12_pending_high = high;
+    state->a12_pending_dot = dot;
+}
+
+static void _mmc3_event(Cartridge *cart) {
+    Mmc3State *state = (Mmc3State*) cart->mapper->state;
+
+    uint64_t dot = system_get_cpu_dot();
+
+    _mmc3_tick_a12(state, dot);
+
+    if (state->staged_irq) {
+        state->asserting_irq = true;
+        state->staged_irq = false;
+
+        MMC3_DEBUG("Asserting staged IRQ\n");
+    }
+
+    _mmc3_tick_a12(state, dot + 1);
+
+    _mmc3_schedule_irq(state, dot + 1);
+}
+
 static uint8_t _mmc3_ram_read(Cartridge *cart, uint16_t addr) {
     if (addr < 0x6000) {
         return system_lower_memory_read(addr);
@@ -164,6 +300,8 @@ static uint8_t _mmc3_ram_read(Cartridge *cart, uint16_t addr) {
 }
 
 static void _mmc3_ram_write(Cartridge *cart, uint16_t addr, uint8_t val) {
+    Mmc3State *state = (Mmc3State*) cart->mapper->state;
+
     if (addr < 0x6000) {
         system_lower_memory_write(addr, val);
         return;
@@ -177,55 +315,59 @@ static void _mmc3_ram_write(Cartridge *cart, uint16_t addr, uint8_t val) {
     switch (addr & 0xE001) {
         case 0x8000:
             MMC3_DEBUG("$8000 write\n");
-            MMC3_DEBUG("  PRG range switch: %01d -> %01d\n", g_prg_switch_ranges, (val >> 6) & 1);
-            MMC3_DEBUG("  CHR inversion: %01d -> %01d\n", g_chr_inversion, (val >> 7) & 1);
+            MMC3_DEBUG("  PRG range switch: %01d -> %01d\n", state->prg_switch_ranges, (val >> 6) & 1);
+            MMC3_DEBUG("  CHR inversion: %01d -> %01d\n", state->chr_inversion, (val >> 7) & 1);
             MMC3_DEBUG("  Range select: %01d\n", val & 0x7);
 
-            g_prg_switch_ranges = (val >> 6) & 1;
-            g_chr_inversion = (val >> 7) & 1;
-            g_bank_select = val & 0x7;
+            state->prg_switch_ranges = (val >> 6) & 1;
+            state->chr_inversion = (val >> 7) & 1;
+            state->bank_select = val & 0x7;
+
+            _mmc3_remap(cart);
 
             return;
         case 0x8001: {
             uint8_t *bank;
 
-            switch (g_bank_select) {
+            switch (state->bank_select) {
                 case 0:
-                    bank = &g_chr_big_1;
+                    bank = &state->chr_big_1;
                     val &= 0xFE; // ignore last bit for double-width banks
                     break;
                 case 1:
-                    bank = &g_chr_big_2;
+                    bank = &state->chr_big_2;
                     val &= 0xFE; // ignore last bit for double-width banks
                     break;
                 case 2:
-                    bank = &g_chr_little_1;
+                    bank = &state->chr_little_1;
                     break;
                 case 3:
-                    bank = &g_chr_little_2;
+                    bank = &state->chr_little_2;
                     break;
                 case 4:
-                    bank = &g_chr_little_3;
+                    bank = &state->chr_little_3;
                     break;
                 case 5:
-                    bank = &g_chr_little_4;
+                    bank = &state->chr_little_4;
                     break;
                 case 6:
-                    bank = &g_prg_1;
+                    bank = &state->prg_1;
                     val &= 0x3F;
                     break;
                 case 7:
-                    bank = &g_prg_2;
+                    bank = &state->prg_2;
                     val &= 0x3F;
                     break;
             }
 
             MMC3_DEBUG("$8001 write\n");
-            MMC3_DEBUG("  Selected range: %01d\n", g_bank_select);
+            MMC3_DEBUG("  Selected range: %01d\n", state->bank_select);
             MMC3_DEBUG("  New bank: %02d -> %02d\n", *bank, val);
 
             *bank = val;
 
+            _mmc3_remap(cart);
+
             return;
         }
         case 0xA000:
@@ -237,23 +379,31 @@ static void _mmc3_ram_write(Cartridge *cart, uint16_t addr, uint8_t val) {
             // unimplemented for MMC3
             return;
         case 0xC000:
-            g_irq_latch = val;
+            _mmc3_tick_a12(state, system_get_cpu_dot());
+            state->irq_latch = val;
+            _mmc3_schedule_irq(state, system_get_cpu_dot());
             MMC3_DEBUG("Latch reloaded with value %02x\n", val);
             return;
         case 0xC001:
-            g_irq_counter = 0xFF;
-            g_irq_reload = true;
+            _mmc3_tick_a12(state, system_get_cpu_dot());
+            state->irq_counter = 0xFF;
+            state->irq_reload = true;
+            _mmc3_schedule_irq(state, system_get_cpu_dot());
             MMC3_DEBUG("Reload requested\n");
             return;
         case 0xE000:
-            g_irq_enabled = false;
-            g_asserting_irq = false; // acknowledge any pending interrupt
-            g_staged_irq = false;
+            _mmc3_tick_a12(state, system_get_cpu_dot());
+            state->irq_enabled = false;
+            state->asserting_irq = false; // acknowledge any pending interrupt
+            state->staged_irq = false;
+            system_cancel_mapper_event();
 
             MMC3_DEBUG("IRQ disabled\n");
             return;
         case 0xE001:
-            g_irq_enabled = true;
+            _mmc3_tick_a12(state, system_get_cpu_dot());
+            state->irq_enabled = true;
+            _mmc3_schedule_irq(state, system_get_cpu_dot());
 
             MMC3_DEBUG("IRQ enabled\n");
             return;
@@ -306,66 +456,6 @@ static void _mmc3_vram_write(Cartridge *cart, uint16_t addr, uint8_t val) {
     }
 }
 
-static void _mmc3_tick(void) {
-    MMC3_DEBUG("Counter: %d | Staged IRQ: %d | Asserting IRQ: %d \n", g_irq_counter, g_staged_irq, g_asserting_irq);
-
-    if (g_a12_cooldown > 0) {
-        g_a12_cooldown--;
-    }
-
-    if (g_staged_irq) {
-        g_asserting_irq = true;
-        g_staged_irq = false;
-
-        MMC3_DEBUG("Asserting staged IRQ\n");
-    }
-
-    uint16_t old_addr = g_last_addr;
-    uint16_t new_addr = ppu_get_internal_regs()->addr_bus;
-    g_last_addr = new_addr;
-
-    bool old_a12 = old_addr & 0x1000;
-    bool new_a12 = new_addr & 0x1000;
-
-    bool rising_a12 = false;
-
-    if (old_a12 == new_a12) {
-        return;
-    } else if (new_a12) {
-        rising_a12 = true;
-    }
-
-    if (rising_a12) {
-        MMC3_DEBUG("Detected A12 rising edge (old %04X, new %04X)\n", old_addr, new_addr);
-    } else {
-        MMC3_DEBUG("Detected A12 falling edge (old %04X, new %04X)\n", old_addr, new_addr);
-    }
-
-    if (g_a12_cooldown) {
-        MMC3_DEBUG("Ignoring A12 edge (wasn't low/high for long enough prior)\n");
-        return;
-    }
-
-    if (g_use_a12_fall != rising_a12) {
-        MMC3_DEBUG("MMC3 IRQ counter clocked @ (%03d, %03d)\n", ppu_get_scanline(), ppu_get_scanline_tick());
-        uint8_t counter_old = g_irq_counter;
-
-        if (g_irq_reload || g_irq_counter == 0) {
-            g_irq_counter = g_irq_latch;
-            g_irq_reload = false;
-        } else {
-            g_irq_counter--;
-        }
-
-        if ((!g_use_counter_edge || counter_old > 0) && g_irq_counter == 0 && g_irq_enabled) {
-            g_staged_irq = true;
-            MMC3_DEBUG("Staging IRQ for assertion on next tick\n");
-        }
-    } else {
-        g_a12_cooldown = A12_COOLDOWN_PERIOD;
-    }
-}
-
 void mapper_init_mmc3(Mapper *mapper, unsigned int submapper_id) {
     mapper->id = MAPPER_ID_MMC3;
     memcpy(mapper->name, "MMC3", strlen("MMC3") + 1);
@@ -374,11 +464,18 @@ void mapper_init_mmc3(Mapper *mapper, unsigned int submapper_id) {
     mapper->ram_write_func  = _mmc3_ram_write;
     mapper->vram_read_func  = _mmc3_vram_read;
     mapper->vram_write_func = _mmc3_vram_write;
-    mapper->tick_func       = _mmc3_tick;
+    mapper->a12_func        = _mmc3_a12;
+    mapper->event_func      = _mmc3_event;
+    mapper->remap_func      = _mmc3_remap;
+    mapper->state           = calloc(1, sizeof(Mmc3State));
+    mapper->state_size      = sizeof(Mmc3State);
+
+    Mmc3State *state = (Mmc3State*) mapper->state;
+    state->prg_2 = 1;
 
     if (submapper_id == 3) {
-        g_use_a12_fall = true;
+        state->use_a12_fall = true;
     } else if (submapper_id == 4) {
-        g_use_counter_edge = true; // trigger IRQ when counter changes to 0
+        state->use_counter_edge = true; // trigger IRQ when counter changes to 0
     }
 }
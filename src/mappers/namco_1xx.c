@@ -24,6 +24,7 @@
  */
 
 #include "cartridge.h"
+#include "context.h"
 #include "system.h"
 #include "c6502/cpu.h"
 #include "mappers/mappers.h"
@@ -31,6 +32,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define PRG_BANK_SHIFT 13
@@ -42,127 +44,233 @@
 
 #define CHR_RAM_SIZE 0x2000
 
-static unsigned char g_prg_banks[3];
-static unsigned char g_chr_banks[12];
+#define IRQ_COUNTER_MAX 0x7FFF
 
-static bool g_write_protections[4];
+typedef struct {
+    NromState nrom;
 
-static unsigned char g_chip_ram[0x80];
-static unsigned char g_chip_ram_addr;
+    unsigned char prg_banks[3];
+    unsigned char chr_banks[12];
 
-static bool g_sound_disable;
-static bool g_disable_nt_0;
-static bool g_disable_nt_1;
+    bool write_protections[4];
 
-static uint16_t g_irq_counter = 0;
-static bool g_irq_pending = false;
+    unsigned char chip_ram[0x80];
+    unsigned char chip_ram_addr;
+
+    bool sound_disable;
+    bool disable_nt_0;
+    bool disable_nt_1;
+
+    // the counter goes up on every tick until it reaches the max, and the tick after that raises the IRQ
+    // it's only brought up to date when it's accessed, so this is its value as of irq_counter_dot
+    uint16_t irq_counter;
+    uint64_t irq_counter_dot; // the first dot whose tick hasn't been applied to the counter
+    bool irq_pending;
+} Namco1xxState;
 
 static unsigned int _namco_1xx_irq_connection(void) {
-    return g_irq_pending ? 0 : 1;
+    Namco1xxState *state = (Namco1xxState*) g_ctx->system.cart->mapper->state;
+
+    return state->irq_pending ? 0 : 1;
+}
+
+// applies the ticks which have happened since the counter was last touched
+static void _namco_1xx_sync_counter(Namco1xxState *state) {
+    uint64_t dot = system_get_cpu_dot();
+
+    uint64_t ticks = dot - state->irq_counter_dot;
+    uint16_t remaining = IRQ_COUNTER_MAX - (state->irq_counter & IRQ_COUNTER_MAX);
+    state->irq_counter += ticks < remaining ? ticks : remaining;
+
+    state->irq_counter_dot = dot;
+}
+
+static void _namco_1xx_schedule_irq(Namco1xxState *state) {
+    if (state->irq_pending) {
+        return;
+    }
+
+    system_schedule_mapper_event(state->irq_counter_dot + IRQ_COUNTER_MAX - (state->irq_counter & IRQ_COUNTER_MAX));
+}
+
+static void _namco_1xx_event(Cartridge *cart) {
+    Namco1xxState *state = (Namco1xxState*) cart->mapper->state;
+
+    _namco_1xx_sync_counter(state);
+    state->irq_pending = true;
 }
 
 static void _namco_1xx_init(Cartridge *cart) {
+    Namco1xxState *state = (Namco1xxState*) cart->mapper->state;
+
     system_connect_irq_line(_namco_1xx_irq_connection);
 
-    g_prg_banks[0] = 0;
-    g_prg_banks[1] = 1;
-    g_prg_banks[2] = (cart->prg_size >> PRG_BANK_SHIFT) - 2;
+    _namco_1xx_schedule_irq(state);
+
+    state->prg_banks[0] = 0;
+    state->prg_banks[1] = 1;
+    state->prg_banks[2] = (cart->prg_size >> PRG_BANK_SHIFT) - 2;
     
     if (cart->has_nv_ram) {
-        system_register_chip_ram(cart, g_chip_ram, sizeof(g_chip_ram));
+        system_register_chip_ram(cart, state->chip_ram, sizeof(state->chip_ram));
+    }
+}
+
+static bool _does_ref_ntram(Namco1xxState *state, uint16_t addr) {
+    if (addr < 0x1000) {
+        return !state->disable_nt_0;
+    } else if (addr < 0x2000) {
+        return !state->disable_nt_1;
+    } else {
+        return true;
     }
 }
 
+static void _namco_1xx_remap(Cartridge *cart) {
+    Namco1xxState *state = (Namco1xxState*) cart->mapper->state;
+
+    for (unsigned int i = 0; i < 4; i++) {
+        system_map_prg_ram(0x6000 + i * 0x800, 0x800, !state->write_protections[i]);
+    }
+
+    for (uint32_t addr = 0x8000; addr <= 0xFFFF; addr += CPU_PAGE_SIZE) {
+        uint8_t bank = addr >= 0xE000 ? ((cart->prg_size >> PRG_BANK_SHIFT) - 1) : (state->prg_banks[(addr - 0x8000) >> PRG_BANK_SHIFT]);
+        system_map_memory(addr, CPU_PAGE_SIZE,
+                &cart->prg_rom[((bank << PRG_BANK_SHIFT) | ((addr - 0x8000) % PRG_BANK_GRANULARITY)) % cart->prg_size], NULL);
+    }
+
+    uint16_t total_banks = cart->chr_size >> CHR_BANK_SHIFT;
+    bool open_bus = false;
+
+    // same as the bank resolution in _namco_1xx_vram_read
+    for (unsigned int page = 0; page < VRAM_PAGE_COUNT; page++) {
+        unsigned char bank = state->chr_banks[page];
+
+        if (bank >= 0xE0) {
+            if (_does_ref_ntram(state, page * VRAM_PAGE_SIZE)) {
+                if (page >= VRAM_NAME_TABLE_PAGE) {
+                    ppu_map_name_table(page - VRAM_NAME_TABLE_PAGE, bank % 2);
+                } else {
+                    ppu_map_vram_page(page, ppu_get_ciram_page(bank % 2));
+                }
+                continue;
+            } else {
+                if ((bank - 0xE0) < total_banks) {
+                    bank = total_banks - 0x20 + (bank - 0xE0);
+                } else {
+                    bank = 0xFF;
+                }
+            }
+        }
+
+        if (bank >= total_banks) {
+            ppu_map_vram_page(page, NULL); // open bus
+            open_bus = true;
+            continue;
+        }
+
+        ppu_map_vram_page(page, &cart->chr_rom[(bank << CHR_BANK_SHIFT) % cart->chr_size]);
+    }
+
+    system_set_chr_open_bus(open_bus);
+}
+
 static uint8_t _namco_1xx_ram_read(Cartridge *cart, uint16_t addr) {
+    Namco1xxState *state = (Namco1xxState*) cart->mapper->state;
+
     if (addr < 0x4800) {
         return system_lower_memory_read(addr);
     }
 
     if (addr < 0x5000) {
-        unsigned char val = g_chip_ram[g_chip_ram_addr & 0x7F];
+        unsigned char val = state->chip_ram[state->chip_ram_addr & 0x7F];
         // auto-increment
-        if (g_chip_ram_addr & 0x80) {
-            g_chip_ram_addr = (g_chip_ram_addr & 80) | ((g_chip_ram_addr + 1) & 0x7F);
+        if (state->chip_ram_addr & 0x80) {
+            state->chip_ram_addr = (state->chip_ram_addr & 80) | ((state->chip_ram_addr + 1) & 0x7F);
         }
         return val;
     } else if (addr < 0x6000) {
-        return g_irq_counter >> ((addr >> REGISTER_SHIFT) & 1);
+        _namco_1xx_sync_counter(state);
+        return state->irq_counter >> ((addr >> REGISTER_SHIFT) & 1);
     } else if (addr < 0x8000) {
         return system_prg_ram_read(addr - 0x6000);
     } else {
-        uint8_t bank = addr >= 0xE000 ? ((cart->prg_size >> PRG_BANK_SHIFT) - 1) : (g_prg_banks[(addr - 0x8000) >> PRG_BANK_SHIFT]);
+        uint8_t bank = addr >= 0xE000 ? ((cart->prg_size >> PRG_BANK_SHIFT) - 1) : (state->prg_banks[(addr - 0x8000) >> PRG_BANK_SHIFT]);
         return cart->prg_rom[((bank << PRG_BANK_SHIFT) | ((addr - 0x8000) % PRG_BANK_GRANULARITY)) % cart->prg_size];
     }
 }
 
 static void _namco_1xx_ram_write(Cartridge *cart, uint16_t addr, uint8_t val) {
+    Namco1xxState *state = (Namco1xxState*) cart->mapper->state;
+
     if (addr < 0x4800) {
         system_lower_memory_write(addr, val);
         return;
     }
 
     if (addr < 0x5000) {
-        g_chip_ram[g_chip_ram_addr & 0x7F] = val;
+        state->chip_ram[state->chip_ram_addr & 0x7F] = val;
         // auto-increment
-        if (g_chip_ram_addr & 0x80) {
-            g_chip_ram_addr = (g_chip_ram_addr & 80) | ((g_chip_ram_addr + 1) & 0x7F);
+        if (state->chip_ram_addr & 0x80) {
+            state->chip_ram_addr = (state->chip_ram_addr & 80) | ((state->chip_ram_addr + 1) & 0x7F);
         }
 
         return;
     } else if (addr < 0x5800) {
-        g_irq_counter &= ~0xFF;
-        g_irq_counter |= val;
+        _namco_1xx_sync_counter(state);
+        state->irq_counter &= ~0xFF;
+        state->irq_counter |= val;
+        _namco_1xx_schedule_irq(state);
     } else if (addr < 0x6000) {
-        g_irq_counter &= 0xFF;
-        g_irq_counter |= (val << 8);
+        _namco_1xx_sync_counter(state);
+        state->irq_counter &= 0xFF;
+        state->irq_counter |= (val << 8);
+        _namco_1xx_schedule_irq(state);
     } else if (addr < 0x8000) {
-        if (g_write_protections[(addr - 0x6000) >> REGISTER_SHIFT]) {
+        if (state->write_protections[(addr - 0x6000) >> REGISTER_SHIFT]) {
             return;
         }
 
         system_prg_ram_write(addr - 0x6000, val);
     } else if (addr < 0xE000) {
-        g_chr_banks[(addr - 0x8000) >> REGISTER_SHIFT] = val;
+        state->chr_banks[(addr - 0x8000) >> REGISTER_SHIFT] = val;
+        _namco_1xx_remap(cart);
     } else if (addr < 0xE800) {
-        g_prg_banks[0] = val & 0x3F;
-        g_sound_disable = val & 0x40;
+        state->prg_banks[0] = val & 0x3F;
+        state->sound_disable = val & 0x40;
+        _namco_1xx_remap(cart);
     } else if (addr < 0xF000) {
-        g_prg_banks[1] = val & 0x3F;
-        g_disable_nt_0 = val & 0x40;
-        g_disable_nt_1 = val & 0x80;
+        state->prg_banks[1] = val & 0x3F;
+        state->disable_nt_0 = val & 0x40;
+        state->disable_nt_1 = val & 0x80;
+        _namco_1xx_remap(cart);
     } else if (addr < 0xF800) {
-        g_prg_banks[2] = val & 0x3F;
+        state->prg_banks[2] = val & 0x3F;
+        _namco_1xx_remap(cart);
     } else {
-        g_write_protections[0] = (val & ~0x40) || (val & 1);
-        g_write_protections[1] = (val & ~0x40) || (val & 2);
-        g_write_protections[2] = (val & ~0x40) || (val & 4);
-        g_write_protections[3] = (val & ~0x40) || (val & 8);
+        state->write_protections[0] = (val & ~0x40) || (val & 1);
+        state->write_protections[1] = (val & ~0x40) || (val & 2);
+        state->write_protections[2] = (val & ~0x40) || (val & 4);
+        state->write_protections[3] = (val & ~0x40) || (val & 8);
 
-        g_chip_ram_addr = val;
-    }
-}
-
-static bool _does_ref_ntram(uint16_t addr) {
-    if (addr < 0x1000) {
-        return !g_disable_nt_0;
-    } else if (addr < 0x2000) {
-        return !g_disable_nt_1;
-    } else {
-        return true;
+        state->chip_ram_addr = val;
+        _namco_1xx_remap(cart);
     }
 }
 
 static uint8_t _namco_1xx_vram_read(Cartridge *cart, uint16_t addr) {
+    Namco1xxState *state = (Namco1xxState*) cart->mapper->state;
+
     if (addr >= 0x3000) {
         return nrom_vram_read(cart, addr);
     }
 
-    unsigned char bank = g_chr_banks[addr >> CHR_BANK_SHIFT];
+    unsigned char bank = state->chr_banks[addr >> CHR_BANK_SHIFT];
 
     uint16_t total_banks = cart->chr_size >> CHR_BANK_SHIFT;
     if (bank >= 0xE0) {
-        if (_does_ref_ntram(addr)) {
-            return ppu_name_table_read(((bank % 2) * 0x0400) | (addr & 0x03FF));
+        if (_does_ref_ntram(state, addr)) {
+            return ppu_get_ciram_page(bank % 2)[addr & 0x03FF];
         } else {
             if ((bank - 0xE0) < total_banks) {
                 bank = total_banks - 0x20 + (bank - 0xE0);
@@ -180,17 +288,19 @@ static uint8_t _namco_1xx_vram_read(Cartridge *cart, uint16_t addr) {
 }
 
 static void _namco_1xx_vram_write(Cartridge *cart, uint16_t addr, uint8_t val) {
+    Namco1xxState *state = (Namco1xxState*) cart->mapper->state;
+
     if (addr >= 0x3000) {
         nrom_vram_write(cart, addr, val);
         return;
     }
 
-    unsigned char bank = g_chr_banks[addr >> CHR_BANK_SHIFT];
+    unsigned char bank = state->chr_banks[addr >> CHR_BANK_SHIFT];
 
     uint8_t total_banks = cart->chr_size >> CHR_BANK_SHIFT;
     if (bank >= 0xE0) {
-        if (_does_ref_ntram(addr)) {
-            ppu_name_table_write(((bank % 2) * 0x400) | (addr & 0x03FF), val);
+        if (_does_ref_ntram(state, addr)) {
+            ppu_get_ciram_page(bank % 2)[addr & 0x03FF] = val;
             return;
         } else {
             if ((bank - 0xE0) < total_banks) {
@@ -209,21 +319,17 @@ static void _namco_1xx_vram_write(Cartridge *cart, uint16_t addr, uint8_t val) {
     cart->chr_rom[((bank << CHR_BANK_SHIFT) | (addr & 0x3FF)) % cart->chr_size] = val;
 }
 
-static void _namco_1xx_tick(void) {
-    if ((g_irq_counter & 0x7FFF) == 0x7FFF) {
-        g_irq_pending = true;
-    } else {
-        g_irq_counter++;
-    }
-}
-
 void mapper_init_namco_1xx(Mapper *mapper, unsigned int submapper_id) {
-    mapper->id = MAPPER_ID_COLOR_DREAMS;
+    mapper->id = MAPPER_ID_NAMCO_1XX;
     memcpy(mapper->name, "Namco 1XX", strlen("Namco 1XX") + 1);
     mapper->init_func       = _namco_1xx_init;
     mapper->ram_read_func   = _namco_1xx_ram_read;
     mapper->ram_write_func  = _namco_1xx_ram_write;
     mapper->vram_read_func  = _namco_1xx_vram_read;
     mapper->vram_write_func = _namco_1xx_vram_write;
-    mapper->tick_func       = _namco_1xx_tick;
+    mapper->a12_func        = NULL;
+    mapper->event_func      = _namco_1xx_event;
+    mapper->remap_func      = _namco_1xx_remap;
+    mapper->state           = calloc(1, sizeof(Namco1xxState));
+    mapper->state_size      = sizeof(Namco1xxState);
 }
@@ -28,15 +28,12 @@
 #include "c6502/cpu.h"
 #include "input/input_device.h"
 #include "mappers/mappers.h"
+#include "mappers/nrom.h"
 #include "ppu.h"
 
+#include <stdlib.h>
 #include <string.h>
 
-#define CHR_RAM_SIZE 0x2000
-
-// pretty sure this never existed in hardware, but some of blargg's tests rely on it
-static unsigned char g_chr_ram[CHR_RAM_SIZE];
-
 uint8_t nrom_ram_read(Cartridge *cart, uint16_t addr) {
     if (addr >= 0x0000 && addr <= 0x7FFF) {
         return system_lower_memory_read(addr);
@@ -68,7 +65,7 @@ uint8_t nrom_vram_read(Cartridge *cart, uint16_t addr) {
     if (addr >= 0x0000 && addr <= 0x1FFF) {
         // pattern tables
         if (cart->chr_size == 0) {
-            return g_chr_ram[addr];
+            return ((NromState*) cart->mapper->state)->chr_ram[addr];
         }
 
         if (addr < cart->chr_size) {
@@ -93,7 +90,7 @@ void nrom_vram_write(Cartridge *cart, uint16_t addr, uint8_t val) {
     if (addr >= 0x0000 && addr <= 0x1FFF) {
         // pattern tables
         if (cart->chr_size == 0) {
-            g_chr_ram[addr] = val;
+            ((NromState*) cart->mapper->state)->chr_ram[addr] = val;
         }
 
     } else if (addr >= 0x2000 && addr <= 0x3EFF) {
@@ -108,6 +105,37 @@ void nrom_vram_write(Cartridge *cart, uint16_t addr, uint8_t val) {
     }
 }   
 
+void nrom_map_prg(Cartridge *cart) {
+    for (uint32_t addr = 0x8000; addr <= 0xFFFF; addr += CPU_PAGE_SIZE) {
+        uint16_t adj_addr = addr - 0x8000;
+        // ROM is mirrored if cartridge only has 1 bank
+        if (cart->prg_size <= 16384) {
+            adj_addr %= 0x4000;
+        }
+        system_map_memory(addr, CPU_PAGE_SIZE, &cart->prg_rom[adj_addr], NULL);
+    }
+}
+
+void nrom_map_chr(Cartridge *cart) {
+    for (unsigned int page = 0; page < VRAM_NAME_TABLE_PAGE; page++) {
+        uint16_t addr = page * VRAM_PAGE_SIZE;
+
+        if (cart->chr_size == 0) {
+            ppu_map_vram_page(page, &((NromState*) cart->mapper->state)->chr_ram[addr]);
+        } else if (addr < cart->chr_size) {
+            ppu_map_vram_page(page, &cart->chr_rom[addr]);
+        } else {
+            ppu_map_vram_page(page, NULL); // open bus
+        }
+    }
+}
+
+void nrom_remap(Cartridge *cart) {
+    nrom_map_prg(cart);
+    nrom_map_chr(cart);
+    ppu_map_name_tables();
+}
+
 void mapper_init_nrom(Mapper *mapper, unsigned int submapper_id) {
     mapper->id = MAPPER_ID_NROM;
     memcpy(mapper->name, "NROM", strlen("NROM") + 1);
@@ -116,5 +144,9 @@ void mapper_init_nrom(Mapper *mapper, unsigned int submapper_id) {
     mapper->ram_write_func  = *nrom_ram_write;
     mapper->vram_read_func  = *nrom_vram_read;
     mapper->vram_write_func = *nrom_vram_write;
-    mapper->tick_func       = NULL;
+    mapper->a12_func        = NULL;
+    mapper->event_func      = NULL;
+    mapper->remap_func      = *nrom_remap;
+    mapper->state           = calloc(1, sizeof(NromState));
+    mapper->state_size      = sizeof(NromState);
 }
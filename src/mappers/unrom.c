@@ -31,6 +31,7 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define PRG_BANK_SHIFT 14
@@ -38,45 +39,74 @@
 
 #define CHR_RAM_SIZE 0x2000
 
-static unsigned char g_prg_bank;
-
-static unsigned char chr_ram[CHR_RAM_SIZE];
+typedef struct {
+    NromState nrom;
+    unsigned char prg_bank;
+    unsigned char chr_ram[CHR_RAM_SIZE];
+} UnromState;
 
 static void _unrom_init(Cartridge *cart) {
-    memcpy(chr_ram, cart->chr_rom, cart->chr_size < CHR_RAM_SIZE ? cart->chr_size : CHR_RAM_SIZE);
+    UnromState *state = (UnromState*) cart->mapper->state;
+
+    memcpy(state->chr_ram, cart->chr_rom, cart->chr_size < CHR_RAM_SIZE ? cart->chr_size : CHR_RAM_SIZE);
+}
+
+static void _unrom_remap(Cartridge *cart) {
+    UnromState *state = (UnromState*) cart->mapper->state;
+
+    for (uint32_t addr = 0x8000; addr <= 0xFFFF; addr += CPU_PAGE_SIZE) {
+        uint8_t bank = addr < 0xC000 ? state->prg_bank : ((cart->prg_size >> PRG_BANK_SHIFT) - 1);
+        system_map_memory(addr, CPU_PAGE_SIZE,
+                &cart->prg_rom[((bank << PRG_BANK_SHIFT) | (addr % PRG_BANK_GRANULARITY)) % cart->prg_size], NULL);
+    }
+
+    for (unsigned int page = 0; page < VRAM_NAME_TABLE_PAGE; page++) {
+        ppu_map_vram_page(page, &state->chr_ram[page * VRAM_PAGE_SIZE]);
+    }
+
+    ppu_map_name_tables();
 }
 
 static uint8_t _unrom_ram_read(Cartridge *cart, uint16_t addr) {
+    UnromState *state = (UnromState*) cart->mapper->state;
+
     if (addr < 0x6000) {
         return system_lower_memory_read(addr);
     } else if (addr < 0x8000) {
         return system_bus_read();
     }
 
-    return cart->prg_rom[(((addr < 0xC000 ? g_prg_bank : ((cart->prg_size >> PRG_BANK_SHIFT) - 1)) << PRG_BANK_SHIFT)
+    return cart->prg_rom[(((addr < 0xC000 ? state->prg_bank : ((cart->prg_size >> PRG_BANK_SHIFT) - 1)) << PRG_BANK_SHIFT)
             | (addr % PRG_BANK_GRANULARITY)) % cart->prg_size];
 }
 
 static void _unrom_ram_write(Cartridge *cart, uint16_t addr, uint8_t val) {
+    UnromState *state = (UnromState*) cart->mapper->state;
+
     if (addr < 0x6000) {
         system_lower_memory_write(addr, val);
         return;
     }
 
-    g_prg_bank = val;
+    state->prg_bank = val;
+    _unrom_remap(cart);
 }
 
 static uint8_t _unrom_vram_read(Cartridge *cart, uint16_t addr) {
+    UnromState *state = (UnromState*) cart->mapper->state;
+
     if (addr < 0x2000) {
-        return chr_ram[addr];
+        return state->chr_ram[addr];
     }
 
     return nrom_vram_read(cart, addr);
 }
 
 static void _unrom_vram_write(Cartridge *cart, uint16_t addr, uint8_t val) {
+    UnromState *state = (UnromState*) cart->mapper->state;
+
     if (addr < 0x2000) {
-        chr_ram[addr] = val;
+        state->chr_ram[addr] = val;
     } else {
         nrom_vram_write(cart, addr, val);
     }
@@ -90,5 +120,9 @@ void mapper_init_unrom(Mapper *mapper, unsigned int submapper_id) {
     mapper->ram_write_func  = *_unrom_ram_write;
     mapper->vram_read_func  = *_unrom_vram_read;
     mapper->vram_write_func = *_unrom_vram_write;
-    mapper->tick_func       = NULL;
+    mapper->a12_func        = NULL;
+    mapper->event_func      = NULL;
+    mapper->remap_func      = *_unrom_remap;
+    mapper->state           = calloc(1, sizeof(UnromState));
+    mapper->state_size      = sizeof(UnromState);
 }
@@ -23,6 +23,7 @@
  * THE SOFTWARE.
  */
 
+#include "context.h"
 #include "ppu.h"
 #include "system.h"
 
@@ -48,13 +49,12 @@
 #define VBL_START_SCANLINE_DENDY 291
 #define LAST_VISIBLE_LINE_DENDY 238
 
-#define CYCLES_PER_SCANLINE 341 // same across TV systems
 #define VBL_SCANLINE_TICK 1
 
-#define VRAM_MAX_SIZE 0x1000
-#define PALETTE_RAM_SIZE 0x20
-#define OAM_PRIMARY_SIZE 0x100
-#define OAM_SECONDARY_SIZE 0x20
+#define LAST_FETCH_CYCLE 336 // fetches after this are only for timing
+#define SPRITE_EVAL_START_CYCLE 65
+#define SPRITE_FETCH_START_CYCLE 257
+#define SPRITE_FETCH_END_CYCLE 320
 
 #define NAME_TABLE_GRANULARITY 8
 #define NAME_TABLE_WIDTH (RESOLUTION_H / NAME_TABLE_GRANULARITY)
@@ -77,6 +77,15 @@
 
 #define PRINT_VRAM_WRITES 0
 
+// offset into name table memory of each quadrant of $2000-$2FFF, indexed by mirroring mode
+static const uint16_t MIRRORING_OFFSETS[][4] = {
+    [MIRROR_HORIZONTAL]   = {0x000, 0x000, 0x400, 0x400},
+    [MIRROR_VERTICAL]     = {0x000, 0x400, 0x000, 0x400},
+    [MIRROR_SINGLE_LOWER] = {0x000, 0x000, 0x000, 0x000},
+    [MIRROR_SINGLE_UPPER] = {0x400, 0x400, 0x400, 0x400},
+    [MIRROR_FOUR_SCREEN]  = {0x000, 0x400, 0x800, 0xC00},
+};
+
 #pragma pack(push,1)
 
 typedef union {
@@ -91,56 +100,132 @@ typedef union {
 
 #pragma pack(pop)
 
-static const RGBValue g_palette[] = {
-    {0x66, 0x66, 0x66}, {0x00, 0x1E, 0x9A}, {0x0E, 0x09, 0xA8}, {0x44, 0x00, 0x93},
-    {0x71, 0x00, 0x60}, {0x89, 0x01, 0x1D}, {0x86, 0x13, 0x00}, {0x69, 0x29, 0x00},
-    {0x39, 0x3E, 0x00}, {0x04, 0x4C, 0x00}, {0x00, 0x4F, 0x00}, {0x00, 0x47, 0x2B},
-    {0x00, 0x35, 0x6C}, {0x00, 0x00, 0x00}, {0x00, 0x00, 0x00}, {0x00, 0x00, 0x00},
-    {0xAD, 0xAD, 0xAD}, {0x00, 0x50, 0xF1}, {0x3B, 0x34, 0xFF}, {0x80, 0x22, 0xE8},
-    {0xBB, 0x1E, 0xA5}, {0xDB, 0x29, 0x4E}, {0xD7, 0x40, 0x00}, {0xB1, 0x5E, 0x00},
-    {0x73, 0x79, 0x00}, {0x2D, 0x8B, 0x00}, {0x00, 0x8F, 0x08}, {0x00, 0x84, 0x60},
-    {0x00, 0x6D, 0xB5}, {0x00, 0x00, 0x00}, {0x00, 0x00, 0x00}, {0x00, 0x00, 0x00},
-    {0xFF, 0xFF, 0xFF}, {0x4B, 0xA0, 0xFF}, {0x8A, 0x84, 0xFF}, {0xD1, 0x72, 0xFF},
-    {0xFF, 0x6D, 0xF7}, {0xFF, 0x79, 0x9E}, {0xFF, 0x90, 0x47}, {0xFF, 0xAE, 0x0A},
-    {0xC4, 0xCA, 0x00}, {0x7D, 0xDC, 0x13}, {0x41, 0xE1, 0x57}, {0x21, 0xD5, 0xB0},
-    {0x25, 0xBE, 0xFF}, {0x4F, 0x4F, 0x4F}, {0x00, 0x00, 0x00}, {0x00, 0x00, 0x00},
-    {0xFF, 0xFF, 0xFF}, {0xB6, 0xD8, 0xFF}, {0xD0, 0xCD, 0xFF}, {0xED, 0xC6, 0xFF},
-    {0xFF, 0xC4, 0xFC}, {0xFF, 0xC8, 0xD8}, {0xFF, 0xD2, 0xB4}, {0xFF, 0xDE, 0x9C},
-    {0xE7, 0xE9, 0x94}, {0xCA, 0xF1, 0x9F}, {0xB2, 0xF3, 0xBB}, {0xA5, 0xEE, 0xDF},
-    {0xA6, 0xE5, 0xFF}, {0xB8, 0xB8, 0xB8}, {0x00, 0x00, 0x00}, {0x00, 0x00, 0x00}
+static unsigned int _ppu_nmi_connection(void) {
+    return (g_ctx->ppu.nmi_occurred_buffer && g_ctx->ppu.control.gen_nmis) ? 0 : 1;
+}
+
+// the background and sprite fetches each repeat every 8 dots, indexed by (tick - 1) % 8
+static const uint8_t BG_FETCH_CYCLE[8] = {
+    BG_OP_NT_ADDR, BG_OP_NT_FETCH, BG_OP_AT_ADDR, BG_OP_AT_FETCH,
+    BG_OP_PT_LOW_ADDR, BG_OP_PT_LOW_FETCH, BG_OP_PT_HIGH_ADDR, BG_OP_PT_HIGH_FETCH,
+};
+
+static const uint8_t SPRITE_FETCH_CYCLE[8] = {
+    SPRITE_OP_FETCH_Y, SPRITE_OP_FETCH_TILE, SPRITE_OP_FETCH_ATTR, SPRITE_OP_FETCH_X,
+    SPRITE_OP_PT_LOW_ADDR, SPRITE_OP_PT_LOW_FETCH, SPRITE_OP_PT_HIGH_ADDR, SPRITE_OP_PT_HIGH_FETCH,
 };
 
-static unsigned int g_scanline_count;
-static unsigned int g_vbl_start_scanline;
-static unsigned int g_last_visible_scanline;
-static unsigned int g_pre_render_line;
+static void _build_dot_table(void) {
+    PpuDotTable *table = &g_ctx->ppu_dots;
 
-static MirroringMode g_mirror_mode;
+    for (unsigned int line = 0; line < SCANLINE_COUNT_MAX; line++) {
+        if (line <= g_ctx->ppu.last_visible_scanline) {
+            table->line_types[line] = LINE_VISIBLE;
+        } else if (line == g_ctx->ppu.pre_render_line) {
+            table->line_types[line] = LINE_PRE_RENDER;
+        } else if (line == g_ctx->ppu.vbl_start_scanline) {
+            table->line_types[line] = LINE_VBLANK_START;
+        } else {
+            table->line_types[line] = LINE_IDLE;
+        }
+    }
 
-static PpuControl g_ppu_control;
-static PpuMask g_ppu_mask;
-static PpuStatus g_ppu_status;
-static PpuInternalRegisters g_ppu_internal_regs;
-static bool g_nmi_occurred = false;
-static bool g_nmi_occurred_buffer = false;
+    memset(table->dots, 0, sizeof(table->dots));
 
-static unsigned char g_name_table_mem[VRAM_MAX_SIZE];
-static unsigned char g_palette_ram[PALETTE_RAM_SIZE];
-static Sprite g_oam_ram[OAM_PRIMARY_SIZE / sizeof(Sprite)];
-static Sprite g_secondary_oam_ram[OAM_SECONDARY_SIZE / sizeof(Sprite)];
+    table->dots[LINE_VBLANK_START][VBL_SCANLINE_TICK - 1].flags |= DOT_SET_VBLANK;
 
-static bool g_odd_frame;
-static uint16_t g_scanline;
-static uint16_t g_scanline_tick;
+    PpuDot *pre_render = table->dots[LINE_PRE_RENDER];
+    pre_render[0].flags |= DOT_CLEAR_NMI;
+    pre_render[1].flags |= DOT_CLEAR_STATUS;
+    for (unsigned int tick = 280; tick <= 304; tick++) {
+        pre_render[tick].flags |= DOT_COPY_VERT;
+    }
 
-static RenderMode g_render_mode;
+    // if the frame is odd and background rendering is enabled, the last cycle is skipped
+    //TODO: figure out why we need to subtract 3 instead of 2
+    if (system_get_tv_system() == TV_SYSTEM_NTSC) {
+        pre_render[CYCLES_PER_SCANLINE - 3].flags |= DOT_ODD_FRAME_SKIP;
+    }
 
-static unsigned int _ppu_nmi_connection(void) {
-    return (g_nmi_occurred_buffer && g_ppu_control.gen_nmis) ? 0 : 1;
+    table->draws_border = system_get_tv_system() == TV_SYSTEM_PAL || system_get_tv_system() == TV_SYSTEM_DENDY;
+    table->swaps_emphasis = system_get_tv_system() != TV_SYSTEM_NTSC;
+
+    // the pre-render line fetches the same as a visible line, it just doesn't output anything
+    for (unsigned int type = LINE_VISIBLE; type <= LINE_PRE_RENDER; type++) {
+        PpuDot *dots = table->dots[type];
+
+        // tick 0 is idle
+        for (unsigned int tick = 1; tick < CYCLES_PER_SCANLINE; tick++) {
+            unsigned int phase = (tick - 1) % 8;
+
+            if (tick <= LAST_VISIBLE_CYCLE || tick > SPRITE_FETCH_END_CYCLE) {
+                dots[tick].bg_op = BG_FETCH_CYCLE[phase];
+
+                // the unused fetches at the end of the line don't load the latches
+                if (tick > LAST_FETCH_CYCLE && dots[tick].bg_op == BG_OP_NT_FETCH) {
+                    dots[tick].bg_op = BG_OP_NONE;
+                } else if (tick > LAST_FETCH_CYCLE && dots[tick].bg_op == BG_OP_AT_FETCH) {
+                    dots[tick].bg_op = BG_OP_DUMMY_FETCH;
+                }
+
+                if (dots[tick].bg_op == BG_OP_PT_HIGH_FETCH) {
+                    dots[tick].flags |= DOT_INC_HORI;
+                }
+
+                if (tick <= LAST_FETCH_CYCLE) {
+                    dots[tick].flags |= DOT_SHIFT;
+                }
+            } else {
+                dots[tick].sprite_op = SPRITE_FETCH_CYCLE[phase];
+            }
+        }
+
+        dots[LAST_VISIBLE_CYCLE].flags |= DOT_INC_VERT;
+        dots[SPRITE_FETCH_START_CYCLE].flags |= DOT_COPY_HORI | DOT_SPRITE_FETCH_START;
+    }
+
+    PpuDot *visible = table->dots[LINE_VISIBLE];
+    visible[0].sprite_op = SPRITE_OP_EVAL_RESET;
+    for (unsigned int tick = 1; tick <= LAST_VISIBLE_CYCLE; tick++) {
+        visible[tick].flags |= DOT_PIXEL;
+
+        if (tick < SPRITE_EVAL_START_CYCLE) {
+            if (tick % 2 == 0) {
+                visible[tick].sprite_op = SPRITE_OP_CLEAR_SECONDARY;
+            }
+        } else {
+            visible[tick].sprite_op = tick % 2 == 1 ? SPRITE_OP_EVAL_READ : SPRITE_OP_EVAL_WRITE;
+        }
+    }
+    visible[SPRITE_EVAL_START_CYCLE].flags |= DOT_SPRITE_EVAL_START;
+
+    for (unsigned int rendering = 0; rendering < 2; rendering++) {
+        for (unsigned int type = 0; type < LINE_TYPE_COUNT; type++) {
+            unsigned int run = 0;
+            for (int tick = CYCLES_PER_SCANLINE - 1; tick >= 0; tick--) {
+                PpuDot dot = table->dots[type][tick];
+
+                bool idle = dot.bg_op == BG_OP_NONE
+                        && (dot.flags & ~DOT_RENDERING_ONLY) == 0
+                        && (!rendering || (dot.sprite_op == SPRITE_OP_NONE && dot.flags == 0));
+
+                run = idle ? run + 1 : 0;
+                table->idle_runs[rendering][type][tick] = run;
+            }
+        }
+    }
+
+    for (unsigned int type = 0; type < LINE_TYPE_COUNT; type++) {
+        unsigned int run = 0;
+        for (int tick = CYCLES_PER_SCANLINE - 1; tick >= 0; tick--) {
+            run = (table->dots[type][tick].flags & DOT_CPU_EVENTS) ? 0 : run + 1;
+            table->quiet_runs[type][tick] = run;
+        }
+    }
 }
 
 bool ppu_is_rendering_enabled(void) {
-    return g_ppu_mask.show_background || g_ppu_mask.show_sprites;
+    return g_ctx->ppu.mask.show_background || g_ctx->ppu.mask.show_sprites;
 }
 
 void initialize_ppu(void) {
@@ -148,57 +233,185 @@ void initialize_ppu(void) {
 
     switch (system_get_tv_system()) {
         case TV_SYSTEM_NTSC:
-            g_scanline_count = SCANLINE_COUNT_NTSC;
-            g_vbl_start_scanline = VBL_START_SCANLINE_NTSC;
-            g_last_visible_scanline = LAST_VISIBLE_LINE_NTSC;
+            g_ctx->ppu.scanline_count = SCANLINE_COUNT_NTSC;
+            g_ctx->ppu.vbl_start_scanline = VBL_START_SCANLINE_NTSC;
+            g_ctx->ppu.last_visible_scanline = LAST_VISIBLE_LINE_NTSC;
             break;
         case TV_SYSTEM_PAL:
-            g_scanline_count = SCANLINE_COUNT_PAL;
-            g_vbl_start_scanline = VBL_START_SCANLINE_PAL;
-            g_last_visible_scanline = LAST_VISIBLE_LINE_PAL;
+            g_ctx->ppu.scanline_count = SCANLINE_COUNT_PAL;
+            g_ctx->ppu.vbl_start_scanline = VBL_START_SCANLINE_PAL;
+            g_ctx->ppu.last_visible_scanline = LAST_VISIBLE_LINE_PAL;
             break;
         case TV_SYSTEM_DENDY:
-            g_scanline_count = SCANLINE_COUNT_DENDY;
-            g_vbl_start_scanline = VBL_START_SCANLINE_DENDY;
-            g_last_visible_scanline = LAST_VISIBLE_LINE_DENDY;
+            g_ctx->ppu.scanline_count = SCANLINE_COUNT_DENDY;
+            g_ctx->ppu.vbl_start_scanline = VBL_START_SCANLINE_DENDY;
+            g_ctx->ppu.last_visible_scanline = LAST_VISIBLE_LINE_DENDY;
             break;
         default:
             printf("Unhandled case %d\n", system_get_tv_system());
             exit(1);
     }
 
-    g_pre_render_line = g_scanline_count - 1;
+    g_ctx->ppu.pre_render_line = g_ctx->ppu.scanline_count - 1;
+
+    _build_dot_table();
+
+    ppu_invalidate_pattern_cache();
+
+    g_ctx->ppu.control = (PpuControl) {0};
+    g_ctx->ppu.mask = (PpuMask) {0};
 
-    g_ppu_control = (PpuControl) {0};
-    g_ppu_mask = (PpuMask) {0};
+    memset(g_ctx->ppu.name_table_mem, 0xFF, sizeof(g_ctx->ppu.name_table_mem));
+    memset(g_ctx->ppu.palette_ram, 0xFF, sizeof(g_ctx->ppu.palette_ram));
+    memset(g_ctx->ppu.oam_ram, 0xFF, sizeof(g_ctx->ppu.oam_ram));
 
-    memset(g_name_table_mem, 0xFF, sizeof(g_name_table_mem));
-    memset(g_palette_ram, 0xFF, sizeof(g_palette_ram));
-    memset(g_oam_ram, 0xFF, sizeof(g_oam_ram));
+    ppu_invalidate_sprite_cache();
 
-    g_odd_frame = false;
-    g_scanline = 0;
-    g_scanline_tick = 0;
+    g_ctx->ppu.odd_frame = false;
+    g_ctx->ppu.scanline = 0;
+    g_ctx->ppu.scanline_tick = 0;
 }
 
 void ppu_set_mirroring_mode(MirroringMode mirror_mode) {
-    g_mirror_mode = mirror_mode;
+    assert(mirror_mode <= MIRROR_FOUR_SCREEN);
+
+    g_ctx->ppu.mirror_mode = mirror_mode;
+    memcpy(g_ctx->ppu.name_table_offsets, MIRRORING_OFFSETS[mirror_mode], sizeof(g_ctx->ppu.name_table_offsets));
+    system_remap_banks();
+}
+
+void ppu_invalidate_pattern_cache(void) {
+    PatternCache *cache = &g_ctx->pattern_cache;
+
+    if (++cache->generation == 0) {
+        // wrapped around, so stale tiles could otherwise look current
+        for (unsigned int i = 0; i < PATTERN_CACHE_PAGES; i++) {
+            memset(cache->pages[i].tile_generations, 0, sizeof(cache->pages[i].tile_generations));
+        }
+        cache->generation = 1;
+    }
+}
+
+static bool _is_ciram(const uint8_t *mem) {
+    uintptr_t base = (uintptr_t) g_ctx->ppu.name_table_mem;
+    return (uintptr_t) mem >= base && (uintptr_t) mem < base + VRAM_MAX_SIZE;
+}
+
+static PatternCachePage *_find_pattern_page(const uint8_t *mem) {
+    PatternCache *cache = &g_ctx->pattern_cache;
+
+    for (unsigned int i = 0; i < PATTERN_CACHE_PAGES; i++) {
+        if (cache->pages[i].mem == mem) {
+            return &cache->pages[i];
+        }
+    }
+
+    return NULL;
+}
+
+static bool _is_pattern_page_in_use(const PatternCachePage *page) {
+    for (unsigned int i = 0; i < VRAM_NAME_TABLE_PAGE; i++) {
+        if (g_ctx->pattern_cache.windows[i] == page) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// gets the cached page for the given memory, recycling the oldest page which no window is looking at if there's none
+static PatternCachePage *_get_pattern_page(const uint8_t *mem) {
+    PatternCache *cache = &g_ctx->pattern_cache;
+
+    PatternCachePage *page = _find_pattern_page(mem);
+    if (page != NULL) {
+        return page;
+    }
+
+    do {
+        page = &cache->pages[cache->next_victim];
+        cache->next_victim = (cache->next_victim + 1) % PATTERN_CACHE_PAGES;
+    } while (_is_pattern_page_in_use(page));
+
+    if (page->mem != NULL && _is_ciram(page->mem)) {
+        cache->ciram_pages[(page->mem - g_ctx->ppu.name_table_mem) / VRAM_PAGE_SIZE] = NULL;
+    }
+
+    page->mem = mem;
+    memset(page->tile_generations, 0, sizeof(page->tile_generations));
+
+    if (_is_ciram(mem)) {
+        cache->ciram_pages[(mem - g_ctx->ppu.name_table_mem) / VRAM_PAGE_SIZE] = page;
+    }
+
+    return page;
+}
+
+static void _invalidate_pattern_tile(PatternCachePage *page, unsigned int offset) {
+    if (page != NULL) {
+        page->tile_generations[offset / PATTERN_TILE_SIZE] = 0;
+    }
+}
+
+static PatternCachePage *_find_name_table_pattern_page(const uint8_t *mem) {
+    // name tables are normally in CIRAM, which is looked up directly so that ordinary name table writes stay cheap
+    return _is_ciram(mem)
+            ? g_ctx->pattern_cache.ciram_pages[(mem - g_ctx->ppu.name_table_mem) / VRAM_PAGE_SIZE]
+            : _find_pattern_page(mem);
+}
+
+// drops the cached tile (if any) which a write to the given address of $0000-$3EFF lands in
+void ppu_note_vram_write(uint16_t addr) {
+    PatternCache *cache = &g_ctx->pattern_cache;
+
+    if (addr < PATTERN_TABLES_SIZE) {
+        _invalidate_pattern_tile(cache->windows[addr / VRAM_PAGE_SIZE], addr % VRAM_PAGE_SIZE);
+        return;
+    }
+
+    // name table memory only matters if a mapper has paged it into the pattern tables too (e.g. Namco 1xx)
+    // mappers disagree on whether $3000-$3EFF (or an address past $3FFF) goes through their window or the mirroring,
+    // so both are dropped
+    unsigned int index = ((addr - PATTERN_TABLES_SIZE) / VRAM_PAGE_SIZE) % 4;
+    const uint8_t *mirrored = ppu_get_name_table_page(index);
+    _invalidate_pattern_tile(_find_name_table_pattern_page(mirrored), addr % VRAM_PAGE_SIZE);
+
+    const uint8_t *window = g_ctx->vram_map.pages[VRAM_NAME_TABLE_PAGE + index];
+    if (window != NULL && window != mirrored) {
+        _invalidate_pattern_tile(_find_name_table_pattern_page(window), addr % VRAM_PAGE_SIZE);
+    }
+}
+
+void ppu_invalidate_sprite_cache(void) {
+    g_ctx->sprite_cache.masks_valid = false;
+    g_ctx->sprite_cache.eval_pending = false;
+    g_ctx->sprite_cache.line_valid = false;
+}
+
+// a pending evaluation only sets the overflow flag at the end of the line, so it has to be brought forward if the flag
+// is read before then
+static void _sync_sprite_overflow(void) {
+    SpriteCache *cache = &g_ctx->sprite_cache;
+
+    if (cache->eval_pending && cache->eval_overflow_tick && cache->eval_overflow_tick < g_ctx->ppu.scanline_tick) {
+        g_ctx->ppu.status.sprite_overflow = 1;
+    }
 }
 
 uint16_t ppu_get_scanline(void) {
-    return g_scanline;
+    return g_ctx->ppu.scanline;
 }
 
 uint16_t ppu_get_scanline_tick(void) {
-    return g_scanline_tick;
+    return g_ctx->ppu.scanline_tick;
 }
 
 bool ppu_get_swap_pattern_tables(void) {
-    return g_ppu_control.background_table;
+    return g_ctx->ppu.control.background_table;
 }
 
 PpuInternalRegisters *ppu_get_internal_regs(void) {
-    return &g_ppu_internal_regs;
+    return &g_ctx->ppu.regs;
 }
 
 static inline unsigned char _reverse_bits(unsigned char b) {
@@ -209,12 +422,17 @@ static inline unsigned char _reverse_bits(unsigned char b) {
 }
 
 void _update_addr_bus(uint16_t addr) {
-    g_ppu_internal_regs.addr_bus = addr;
+    // mappers like the MMC3 count scanlines by watching for the switches between pattern tables
+    if ((addr ^ g_ctx->ppu.regs.addr_bus) & 0x1000) {
+        system_notify_a12(addr & 0x1000);
+    }
+
+    g_ctx->ppu.regs.addr_bus = addr;
 }
 
 static void _update_ppu_bus(uint8_t val, uint8_t bitmask) {
-    g_ppu_internal_regs.ppu_bus &= ~bitmask;
-    g_ppu_internal_regs.ppu_bus |= val & bitmask;
+    g_ctx->ppu.regs.ppu_bus &= ~bitmask;
+    g_ctx->ppu.regs.ppu_bus |= val & bitmask;
 }
 
 uint8_t ppu_read_mmio(uint8_t index) {
@@ -228,25 +446,27 @@ uint8_t ppu_read_mmio(uint8_t index) {
         case 6:
             break; // just return the current bus value
         case 2: {
+            _sync_sprite_overflow();
+
             // set bit 7 to value in nmi_occurred latch and reset the latch
-            g_ppu_status.vblank = g_nmi_occurred;
-            g_nmi_occurred_buffer = false;
-            g_nmi_occurred = false;
+            g_ctx->ppu.status.vblank = g_ctx->ppu.nmi_occurred;
+            g_ctx->ppu.nmi_occurred_buffer = false;
+            g_ctx->ppu.nmi_occurred = false;
 
-            uint8_t res = g_ppu_status.serial;
+            uint8_t res = g_ctx->ppu.status.serial;
 
             // reading this register resets this latch
-            g_ppu_internal_regs.w = 0;
+            g_ctx->ppu.regs.w = 0;
 
             _update_ppu_bus(res, 0xE0);
 
             break;
         }
         case 4: {
-            uint8_t res = ((unsigned char*) g_oam_ram)[g_ppu_internal_regs.s];
+            uint8_t res = ((unsigned char*) g_ctx->ppu.oam_ram)[g_ctx->ppu.regs.s];
 
             // weird special case
-            if (g_ppu_internal_regs.s % 4 == 2) {
+            if (g_ctx->ppu.regs.s % 4 == 2) {
                 res &= 0xE3;
             }
             
@@ -256,29 +476,29 @@ uint8_t ppu_read_mmio(uint8_t index) {
         }
         case 7: {
             uint8_t res;
-            if (g_ppu_internal_regs.v.addr < 0x3F00) {
+            if (g_ctx->ppu.regs.v.addr < 0x3F00) {
                 // most VRAM goes through a read buffer
-                res = g_ppu_internal_regs.read_buf;
+                res = g_ctx->ppu.regs.read_buf;
 
-                g_ppu_internal_regs.read_buf = system_vram_read(g_ppu_internal_regs.v.addr);
+                g_ctx->ppu.regs.read_buf = system_vram_read(g_ctx->ppu.regs.v.addr);
 
-                g_ppu_internal_regs.v.addr += g_ppu_control.vertical_increment ? 32 : 1;
-                g_ppu_internal_regs.v.addr &= 0x3FFF;
+                g_ctx->ppu.regs.v.addr += g_ctx->ppu.control.vertical_increment ? 32 : 1;
+                g_ctx->ppu.regs.v.addr &= 0x3FFF;
 
                 // copy to address bus
-                _update_addr_bus(g_ppu_internal_regs.v.addr);
+                _update_addr_bus(g_ctx->ppu.regs.v.addr);
 
                 _update_ppu_bus(res, 0xFF);
             } else {
                 // palette reading bypasses buffer, but still updates it in a weird way
 
                 // address is offset since the buffer is updated with the mirrored NT data "under" the palette data
-                g_ppu_internal_regs.read_buf = system_vram_read(g_ppu_internal_regs.v.addr - 0x1000);
+                g_ctx->ppu.regs.read_buf = system_vram_read(g_ctx->ppu.regs.v.addr - 0x1000);
 
-                res = system_vram_read(g_ppu_internal_regs.v.addr);
+                res = system_vram_read(g_ctx->ppu.regs.v.addr);
 
-                g_ppu_internal_regs.v.addr += g_ppu_control.vertical_increment ? 32 : 1;
-                g_ppu_internal_regs.v.addr &= 0x3FFF;
+                g_ctx->ppu.regs.v.addr += g_ctx->ppu.control.vertical_increment ? 32 : 1;
+                g_ctx->ppu.regs.v.addr &= 0x3FFF;
 
                 _update_ppu_bus(res, 0x3F);
             }
@@ -293,7 +513,17 @@ uint8_t ppu_read_mmio(uint8_t index) {
     // we can get away with this because for registers that are readable, the bus has already been updated
     // with the appropriate value
     // doing it this way simplifies handling of registers where some bits of the read value are open bus
-    return g_ppu_internal_regs.ppu_bus;
+    return g_ctx->ppu.regs.ppu_bus;
+}
+
+// what a $2002 read would return right now, without its side effects
+uint8_t ppu_peek_status(void) {
+    _sync_sprite_overflow();
+
+    PpuStatus status = g_ctx->ppu.status;
+    status.vblank = g_ctx->ppu.nmi_occurred;
+
+    return (status.serial & 0xE0) | (g_ctx->ppu.regs.ppu_bus & 0x1F);
 }
 
 void ppu_write_mmio(uint8_t index, uint8_t val) {
@@ -301,89 +531,104 @@ void ppu_write_mmio(uint8_t index, uint8_t val) {
 
     switch (index) {
         case 0: {
-            g_ppu_control.serial = val;
+            // sprite height affects evaluation
+            if (((PpuControl) {.serial = val}).tall_sprites != g_ctx->ppu.control.tall_sprites) {
+                ppu_flush_sprite_cache();
+            }
+
+            g_ctx->ppu.control.serial = val;
 
-            g_ppu_internal_regs.t.addr &= ~(0b11 << 10); // clear bits 10-11
-            g_ppu_internal_regs.t.addr |= (val & 0b11) << 10; // set bits 10-11 to current nametable
+            g_ctx->ppu.regs.t.addr &= ~(0b11 << 10); // clear bits 10-11
+            g_ctx->ppu.regs.t.addr |= (val & 0b11) << 10; // set bits 10-11 to current nametable
 
             break;
         }
-        case 1:
-            g_ppu_mask.serial = val;
+        case 1: {
+            // evaluation only runs while rendering is enabled
+            PpuMask mask = {.serial = val};
+            if ((mask.show_background || mask.show_sprites) != ppu_is_rendering_enabled()) {
+                ppu_flush_sprite_cache();
+            }
+
+            g_ctx->ppu.mask.serial = val;
             break;
+        }
         case 2:
             // I don't think anything happens here besides the open bus update
             break;
         case 3:
-            g_ppu_internal_regs.s = val;
+            g_ctx->ppu.regs.s = val;
             break;
         case 4:
-            ((unsigned char*) g_oam_ram)[g_ppu_internal_regs.s++] = val;
+            ppu_flush_sprite_cache();
+            g_ctx->sprite_cache.masks_valid = false;
+
+            ((unsigned char*) g_ctx->ppu.oam_ram)[g_ctx->ppu.regs.s++] = val;
             break;
         case 5:
             // set either x- or y-scroll, depending on whether this is the first or second write
-            if (g_ppu_internal_regs.w) {
+            if (g_ctx->ppu.regs.w) {
                 // setting y-scroll
-                g_ppu_internal_regs.t.addr &= ~(0b11111 << 5); // clear bits 5-9
-                g_ppu_internal_regs.t.addr |= (val & 0b11111000) << 2; // set bits 5-9
+                g_ctx->ppu.regs.t.addr &= ~(0b11111 << 5); // clear bits 5-9
+                g_ctx->ppu.regs.t.addr |= (val & 0b11111000) << 2; // set bits 5-9
 
-                g_ppu_internal_regs.t.addr &= ~(0b111 << 12);  // clear bits 12-14
-                g_ppu_internal_regs.t.addr |= (val & 0b111) << 12; // set bits 12-14
+                g_ctx->ppu.regs.t.addr &= ~(0b111 << 12);  // clear bits 12-14
+                g_ctx->ppu.regs.t.addr |= (val & 0b111) << 12; // set bits 12-14
             } else {
                 // setting x-scroll
-                g_ppu_internal_regs.t.addr &= ~(0b11111); // clear bits 0-4
-                g_ppu_internal_regs.t.addr |= val >> 3; // set bits 0-4
+                g_ctx->ppu.regs.t.addr &= ~(0b11111); // clear bits 0-4
+                g_ctx->ppu.regs.t.addr |= val >> 3; // set bits 0-4
                 
-                g_ppu_internal_regs.x = val & 0x7; // copy fine x to x register
+                g_ctx->ppu.regs.x = val & 0x7; // copy fine x to x register
             }
 
             // flip w flag
-            g_ppu_internal_regs.w = !g_ppu_internal_regs.w;
+            g_ctx->ppu.regs.w = !g_ctx->ppu.regs.w;
             break;
         case 6:
             // set either the upper or lower address bits, depending on which write this is
 
             #if PRINT_VRAM_WRITES
-            printf("PPU address (%s): %02x\n", g_ppu_internal_regs.w ? "low" : "high", val);
+            printf("PPU address (%s): %02x\n", g_ctx->ppu.regs.w ? "low" : "high", val);
             #endif
 
-            if (g_ppu_internal_regs.w) {
+            if (g_ctx->ppu.regs.w) {
                 // clear lower bits
-                g_ppu_internal_regs.t.addr &= ~0x00FF;
+                g_ctx->ppu.regs.t.addr &= ~0x00FF;
                 // set lower bits
-                g_ppu_internal_regs.t.addr |= (val & 0xFF);
+                g_ctx->ppu.regs.t.addr |= (val & 0xFF);
 
                 // flush t to v
-                g_ppu_internal_regs.v.addr = g_ppu_internal_regs.t.addr;
+                g_ctx->ppu.regs.v.addr = g_ctx->ppu.regs.t.addr;
 
                 // copy to address bus
-                _update_addr_bus(g_ppu_internal_regs.v.addr);
+                _update_addr_bus(g_ctx->ppu.regs.v.addr);
             } else {
                 // clear upper bits
-                g_ppu_internal_regs.t.addr &= ~0x7F00;
+                g_ctx->ppu.regs.t.addr &= ~0x7F00;
                 // set upper bits
-                g_ppu_internal_regs.t.addr |= (val & 0b111111) << 8;
+                g_ctx->ppu.regs.t.addr |= (val & 0b111111) << 8;
                 // set MSB to 0
-                g_ppu_internal_regs.t.addr &= ~0x4000;
+                g_ctx->ppu.regs.t.addr &= ~0x4000;
             }
 
             // flip w flag
-            g_ppu_internal_regs.w = !g_ppu_internal_regs.w;
+            g_ctx->ppu.regs.w = !g_ctx->ppu.regs.w;
 
             break;
         case 7: {
             // write to the stored address
 
             #if PRINT_VRAM_WRITES
-            printf("PPU write: $%04x, %02x\n", g_ppu_internal_regs.v.addr, val);
+            printf("PPU write: $%04x, %02x\n", g_ctx->ppu.regs.v.addr, val);
             #endif
 
-            system_vram_write(g_ppu_internal_regs.v.addr, val);
+            system_vram_write(g_ctx->ppu.regs.v.addr, val);
 
-            g_ppu_internal_regs.v.addr += g_ppu_control.vertical_increment ? 32 : 1;
+            g_ctx->ppu.regs.v.addr += g_ctx->ppu.control.vertical_increment ? 32 : 1;
 
             // copy to address bus
-            _update_addr_bus(g_ppu_internal_regs.v.addr);
+            _update_addr_bus(g_ctx->ppu.regs.v.addr);
 
             break;
         }
@@ -394,63 +639,105 @@ void ppu_write_mmio(uint8_t index, uint8_t val) {
     _update_ppu_bus(val, 0xFF);
 }
 
-uint16_t _translate_name_table_address(uint16_t addr) {
-    assert(addr < 0x1000);
-
-    if (g_mirror_mode == MIRROR_FOUR_SCREEN) {
-        return addr;
-    } else if (g_mirror_mode == MIRROR_SINGLE_LOWER) {
-        return addr % 0x400;
-    } else if (g_mirror_mode == MIRROR_SINGLE_UPPER) {
-        return (addr % 0x400) + 0x400;
-    }
-
-    if (addr >= 0x000 && addr <= 0x3FF) {
-        // name table 0
-        // it's always in the first half
-        return addr;
-    } else if (addr >= 0x400 && addr <= 0x7FF) {
-        // name table 1
-        if (g_mirror_mode == MIRROR_VERTICAL) {
-            // no need for translation
-            return addr;
-        } else if (g_mirror_mode == MIRROR_HORIZONTAL) {
-            // look up the data in name table 0 since name table 1 is a mirror
-            return addr - 0x400;
-        } else {
-            printf("Got bad mirroring mode %d\n", g_mirror_mode);
-            exit(1);
-        }
-    } else if (addr >= 0x800 && addr <= 0xBFF) {
-        // name table 2
-        if (g_mirror_mode == MIRROR_HORIZONTAL) {
-            // use the second half of the memory
-            return addr - 0x400;
-        } else if (g_mirror_mode == MIRROR_VERTICAL) {
-            // use name table 0 since name table 2 is a mirror
-            return addr - 0x800;
-        } else {
-            printf("Got bad mirroring mode %d\n", g_mirror_mode);
-            exit(1);
-        }
-    } else if (addr >= 0xC00 && addr <= 0xFFF) {
-        // name table 3
-        // it's always in the second half
-        return addr - 0x800;
-    } else {
-        printf("Bad nametable address $%04X\n", addr);
-        exit(-1); // shouldn't happen
-    }
+static inline uint16_t _translate_name_table_address(uint16_t addr) {
+    return g_ctx->ppu.name_table_offsets[addr / VRAM_PAGE_SIZE] | (addr % VRAM_PAGE_SIZE);
 }
 
 uint8_t ppu_name_table_read(uint16_t addr) {
     assert(addr < 0x1000);
-    return g_name_table_mem[_translate_name_table_address(addr)];
+    return g_ctx->ppu.name_table_mem[_translate_name_table_address(addr)];
 }
 
 void ppu_name_table_write(uint16_t addr, uint8_t val) {
     assert(addr < 0x1000);
-    g_name_table_mem[_translate_name_table_address(addr)] = val;
+    g_ctx->ppu.name_table_mem[_translate_name_table_address(addr)] = val;
+}
+
+void ppu_map_vram_page(unsigned int page, const uint8_t *mem) {
+    assert(page < VRAM_PAGE_COUNT);
+
+    if (g_ctx->vram_map.pages[page] == mem) {
+        return;
+    }
+
+    g_ctx->vram_map.pages[page] = mem;
+
+    // tiles decoded from the memory before stay valid, so switching back to a bank costs nothing
+    if (page < VRAM_NAME_TABLE_PAGE) {
+        g_ctx->pattern_cache.windows[page] = mem != NULL ? _get_pattern_page(mem) : NULL;
+    }
+}
+
+// gets the name table memory which the given quadrant of $2000-$2FFF currently resolves to
+const uint8_t *ppu_get_name_table_page(unsigned int index) {
+    assert(index < 4);
+    return &g_ctx->ppu.name_table_mem[g_ctx->ppu.name_table_offsets[index]];
+}
+
+// gets a physical 1 KB page of name table memory, regardless of mirroring
+uint8_t *ppu_get_ciram_page(unsigned int page) {
+    assert(page < VRAM_MAX_SIZE / VRAM_PAGE_SIZE);
+    return &g_ctx->ppu.name_table_mem[page * VRAM_PAGE_SIZE];
+}
+
+// overrides the mirroring for a single quadrant of $2000-$2FFF, for mappers which control it directly
+void ppu_map_name_table(unsigned int index, unsigned int ciram_page) {
+    assert(index < 4);
+    assert(ciram_page < VRAM_MAX_SIZE / VRAM_PAGE_SIZE);
+
+    g_ctx->ppu.name_table_offsets[index] = ciram_page * VRAM_PAGE_SIZE;
+    ppu_map_vram_page(VRAM_NAME_TABLE_PAGE + index, ppu_get_name_table_page(index));
+}
+
+// maps $2000-$2FFF according to the current mirroring mode
+void ppu_map_name_tables(void) {
+    for (unsigned int i = 0; i < 4; i++) {
+        ppu_map_vram_page(VRAM_NAME_TABLE_PAGE + i, ppu_get_name_table_page(i));
+    }
+}
+
+// reads from the VRAM windows, only going through the mapper for unmapped pages
+static inline uint8_t _read_vram(uint16_t addr) {
+    if (addr < VRAM_PAGE_COUNT * VRAM_PAGE_SIZE) {
+        const uint8_t *page = g_ctx->vram_map.pages[addr / VRAM_PAGE_SIZE];
+        if (page != NULL) {
+            return page[addr % VRAM_PAGE_SIZE];
+        }
+    }
+
+    return system_vram_read(addr);
+}
+
+static void _decode_pattern_tile(PatternCachePage *page, unsigned int tile) {
+    unsigned int base = tile * PATTERN_TILE_SIZE;
+    for (unsigned int i = 0; i < PATTERN_TILE_SIZE; i++) {
+        uint8_t val = page->mem[base + i];
+        page->plain[base + i] = val;
+        page->reversed[base + i] = _reverse_bits(val);
+    }
+
+    page->tile_generations[tile] = g_ctx->pattern_cache.generation;
+}
+
+// reads a pattern table byte through the cache, decoding the tile first if it's stale
+static inline uint8_t _fetch_pattern(uint16_t addr, bool reversed) {
+    PatternCache *cache = &g_ctx->pattern_cache;
+
+    // the CPU can move the bus between the address and fetch cycles by poking $2006/$2007
+    // windows which aren't plain memory (e.g. open bus) go through the mapper every time
+    PatternCachePage *page = addr < PATTERN_TABLES_SIZE ? cache->windows[addr / VRAM_PAGE_SIZE] : NULL;
+    if (page == NULL) {
+        uint8_t val = _read_vram(addr);
+        return reversed ? _reverse_bits(val) : val;
+    }
+
+    unsigned int offset = addr % VRAM_PAGE_SIZE;
+    unsigned int tile = offset / PATTERN_TILE_SIZE;
+    if (page->tile_generations[tile] != cache->generation) {
+        _decode_pattern_tile(page, tile);
+    }
+
+    return reversed ? page->reversed[offset] : page->plain[offset];
 }
 
 uint8_t ppu_palette_table_read(uint8_t index) {
@@ -466,11 +753,11 @@ uint8_t ppu_palette_table_read(uint8_t index) {
             break;
     }
 
-    if (g_ppu_mask.monochrome) {
+    if (g_ctx->ppu.mask.monochrome) {
         index &= 0x30;
     }
 
-    return g_palette_ram[index];
+    return g_ctx->ppu.palette_ram[index];
 }
 
 void ppu_palette_table_write(uint8_t index, uint8_t val) {
@@ -486,18 +773,30 @@ void ppu_palette_table_write(uint8_t index, uint8_t val) {
             break;
     }
 
-    g_palette_ram[index] = val;
+    g_ctx->ppu.palette_ram[index] = val;
 }
 
 void ppu_push_dma_byte(uint8_t val) {
-    ((unsigned char*) g_oam_ram)[(uint8_t) (g_ppu_internal_regs.s++)] = val;
+    ppu_flush_sprite_cache();
+    g_ctx->sprite_cache.masks_valid = false;
+
+    ((unsigned char*) g_ctx->ppu.oam_ram)[(uint8_t) (g_ctx->ppu.regs.s++)] = val;
+}
+
+// same as a whole transfer's worth of ppu_push_dma_byte calls, which read each byte from the page at the OAM address it's
+// written to and leave the address where it started
+void ppu_push_dma_page(const uint8_t *page) {
+    ppu_flush_sprite_cache();
+    g_ctx->sprite_cache.masks_valid = false;
+
+    memcpy(g_ctx->ppu.oam_ram, page, OAM_PRIMARY_SIZE);
 }
 
 // this code was shamelessly lifted from https://wiki.nesdev.com/w/index.php/PPU_scrolling
 void _update_v_vertical(void) {
     // update vert(v)
 
-    unsigned int v = g_ppu_internal_regs.v.addr;
+    unsigned int v = g_ctx->ppu.regs.v.addr;
 
     // if fine y = 7
     if ((v & 0x7000) == 0x7000) {
@@ -521,12 +820,12 @@ void _update_v_vertical(void) {
         v += 0x1000;
     }
 
-    g_ppu_internal_regs.v.addr = v;
+    g_ctx->ppu.regs.v.addr = v;
 }
 
 // this code was shamelessly lifted from https://wiki.nesdev.com/w/index.php/PPU_scrolling
 void _update_v_horizontal(void) {
-    unsigned int v = g_ppu_internal_regs.v.addr;
+    unsigned int v = g_ctx->ppu.regs.v.addr;
 
     if ((v & 0x1F) == 0x1F) {
         // if x = 31 (last tile of nametable), skip to next name table
@@ -538,460 +837,646 @@ void _update_v_horizontal(void) {
     }
 
     // write the updated value back to the register
-    g_ppu_internal_regs.v.addr = v;
-}
-
-void _do_tile_fetching(void) {
-    g_nmi_occurred = g_nmi_occurred_buffer;
-    if (g_scanline == g_vbl_start_scanline) {
-        // set vblank flag
-        if (g_scanline_tick == VBL_SCANLINE_TICK - 1) {
-            g_nmi_occurred_buffer = true;
-        }
-    } else if ((g_scanline >= FIRST_VISIBLE_LINE && g_scanline <= g_last_visible_scanline)
-            || g_scanline == g_pre_render_line) {
-        // special case for pre-render line
-        if (g_scanline == g_pre_render_line) {
-            // clear status
-            if (g_scanline_tick == 0) {
-                g_nmi_occurred_buffer = false;
-            } else if (g_scanline_tick == 1) {
-                g_ppu_status.vblank = 0;
-                g_ppu_status.sprite_0_hit = 0;
-                g_ppu_status.sprite_overflow = 0;
+    g_ctx->ppu.regs.v.addr = v;
+}
+
+static void _do_line_events(PpuDot dot) {
+    if (dot.flags & DOT_CLEAR_NMI) {
+        g_ctx->ppu.nmi_occurred_buffer = false;
+    }
+
+    if (dot.flags & DOT_CLEAR_STATUS) {
+        g_ctx->ppu.status.vblank = 0;
+        g_ctx->ppu.status.sprite_0_hit = 0;
+        g_ctx->ppu.status.sprite_overflow = 0;
+    }
+
+    if (dot.flags & DOT_SET_VBLANK) {
+        g_ctx->ppu.nmi_occurred_buffer = true;
+        g_ctx->stats.vblanks++;
+    }
+
+    if ((dot.flags & DOT_COPY_VERT) && ppu_is_rendering_enabled()) {
+        g_ctx->ppu.regs.v.addr &= ~0x7BE0; // clear vertical bits
+        g_ctx->ppu.regs.v.addr |= g_ctx->ppu.regs.t.addr & 0x7BE0; // copy vertical bits to v from t
+    }
+
+    if ((dot.flags & DOT_COPY_HORI) && ppu_is_rendering_enabled()) {
+        g_ctx->ppu.regs.v.addr &= ~0x41F; // clear horizontal bits
+        g_ctx->ppu.regs.v.addr |= g_ctx->ppu.regs.t.addr & 0x41F; // copy horizontal bits to v from t
+    }
+}
+
+static void _do_tile_fetching(PpuDot dot) {
+    switch (dot.bg_op) {
+        case BG_OP_NONE: {
+            break;
+        }
+        // update registers/latches and compute name table address
+        case BG_OP_NT_ADDR: {
+            // copy the palette data from the secondary latch to the primary
+            g_ctx->ppu.regs.attr_table_entry_latch = g_ctx->ppu.regs.attr_table_entry_latch_secondary;
+
+            // clear upper bits
+            g_ctx->ppu.regs.pattern_shift_l &= ~0xFF00;
+            g_ctx->ppu.regs.pattern_shift_h &= ~0xFF00;
+            // set upper bits
+            g_ctx->ppu.regs.pattern_shift_l |= g_ctx->ppu.regs.pattern_bitmap_l_latch << 8;
+            g_ctx->ppu.regs.pattern_shift_h |= g_ctx->ppu.regs.pattern_bitmap_h_latch << 8;
+
+            // compute NT address
+            // address = name table base + (v except fine y)
+            _update_addr_bus(NAME_TABLE_BASE_ADDR | (g_ctx->ppu.regs.v.addr & 0x0FFF));
+
+            break;
+        }
+        // fetch NT byte
+        case BG_OP_NT_FETCH: {
+            g_ctx->ppu.regs.name_table_entry_latch = _read_vram(g_ctx->ppu.regs.addr_bus);
+            break;
+        }
+        // compute AT address
+        case BG_OP_AT_ADDR: {
+            unsigned int v = g_ctx->ppu.regs.v.addr;
+            // address = attr table base + (name table offset) + (shifted v)
+            _update_addr_bus(ATTR_TABLE_BASE_ADDR | (v & 0x0C00) | ((v >> 4) & 0x38) | ((v >> 2) & 0x07));
+
+            break;
+        }
+        // fetch AT byte
+        case BG_OP_AT_FETCH: {
+            uint8_t attr_table_byte = _read_vram(g_ctx->ppu.regs.addr_bus);
+
+            // check if it's in the bottom half of the table cell
+            if (g_ctx->ppu.regs.v.y_coarse & 0b10) {
+                attr_table_byte >>= 4;
             }
 
-            // vert(v) = vert(t)
-            if (g_scanline_tick >= 280 && g_scanline_tick <= 304 && ppu_is_rendering_enabled()) {
-                g_ppu_internal_regs.v.addr &= ~0x7BE0; // clear vertical bits
-                g_ppu_internal_regs.v.addr |= g_ppu_internal_regs.t.addr & 0x7BE0; // copy vertical bits to v from t
+            // check if it's in the right half of the table cell
+            if (g_ctx->ppu.regs.v.x_coarse & 0b10) {
+                attr_table_byte >>= 2;
             }
+
+            g_ctx->ppu.regs.attr_table_entry_latch_secondary = attr_table_byte & 0b11;
+
+            break;
+        }
+        // compute tile address
+        case BG_OP_PT_LOW_ADDR: {
+            // multiply by 16 since each plane is 8 bytes, and there are 2 planes per tile
+            // then we just add the mod of the current line to get the sub-tile offset
+            unsigned int pattern_offset = g_ctx->ppu.regs.name_table_entry_latch * 16
+                    + g_ctx->ppu.regs.v.y_fine;
+
+            _update_addr_bus((g_ctx->ppu.control.background_table ? PT_RIGHT_ADDR : PT_LEFT_ADDR) + pattern_offset);
+
+            break;
+        }
+        // fetch tile low byte
+        case BG_OP_PT_LOW_FETCH: {
+            g_ctx->ppu.regs.pattern_bitmap_l_latch = _fetch_pattern(g_ctx->ppu.regs.addr_bus, true);
+
+            break;
         }
+        // compute tile address
+        case BG_OP_PT_HIGH_ADDR: {
+            // basically the same as above, but we add 8 to get the second plane
+            unsigned int pattern_offset = g_ctx->ppu.regs.name_table_entry_latch * 16
+                    + g_ctx->ppu.regs.v.y_fine + 8;
+
+            _update_addr_bus((g_ctx->ppu.control.background_table ? PT_RIGHT_ADDR : PT_LEFT_ADDR) + pattern_offset);
+
+            break;
+        }
+        // fetch tile high byte
+        case BG_OP_PT_HIGH_FETCH: {
+            g_ctx->ppu.regs.pattern_bitmap_h_latch = _fetch_pattern(g_ctx->ppu.regs.addr_bus, true);
+
+            break;
+        }
+        // unused attribute fetch, which still goes out on the bus
+        case BG_OP_DUMMY_FETCH: {
+            _read_vram(g_ctx->ppu.regs.addr_bus);
+
+            break;
+        }
+        default: {
+            assert(false);
+            break;
+        }
+    }
+
+    // only update v if rendering is enabled
+    if ((dot.flags & (DOT_INC_VERT | DOT_INC_HORI)) && ppu_is_rendering_enabled()) {
+        // vertical v is only updated at the end of the visible part of the scanline
+        if (dot.flags & DOT_INC_VERT) {
+            _update_v_vertical();
+        }
+
+        // horizontal v is updated after every tile
+        if (dot.flags & DOT_INC_HORI) {
+            _update_v_horizontal();
+        }
+    }
+}
+
+static void _do_sprite_evaluation(PpuDot dot) {
+    switch (dot.sprite_op) {
+        // idle tick
+        case SPRITE_OP_EVAL_RESET: {
+            // reset some registers
+            g_ctx->ppu.regs.m = 0;
+            g_ctx->ppu.regs.n = 0;
+            g_ctx->ppu.regs.o = 0;
+            // copy sprite 0 flag to flag for current scanline
+            g_ctx->ppu.regs.sprite_0_scanline = g_ctx->ppu.regs.sprite_0_next_scanline;
+            g_ctx->ppu.regs.sprite_0_next_scanline = false;
 
-        // visible screen
-        if (g_scanline_tick == 0) {
-            // idle tick
             return;
-        } else if (g_scanline_tick > LAST_VISIBLE_CYCLE && g_scanline_tick <= 320) {
-            // hori(v) = hori(t)
-            if (g_scanline_tick == 257 && ppu_is_rendering_enabled()) {
-                g_ppu_internal_regs.v.addr &= ~0x41F; // clear horizontal bits
-                g_ppu_internal_regs.v.addr |= g_ppu_internal_regs.t.addr & 0x41F; // copy horizontal bits to v from t
-            }
-        } else {
-            // garbage fetches occur during sprite tile fetching
-            if (g_scanline_tick > LAST_VISIBLE_CYCLE && g_scanline_tick < 321 && (g_scanline_tick - 1) % 8 >= 4) {
-                return;
-            }
+        }
+        // clear secondary OAM byte-by-byte, but only on even ticks
+        case SPRITE_OP_CLEAR_SECONDARY: {
+            ((char*) g_ctx->ppu.secondary_oam_ram)[(uint8_t) (g_ctx->ppu.scanline_tick / 2 - 1)] = 0xFF;
+
+            return;
+        }
+        case SPRITE_OP_EVAL_READ:
+        case SPRITE_OP_EVAL_WRITE: {
+            break;
+        }
+        default: {
+            return;
+        }
+    }
+
+    if (dot.flags & DOT_SPRITE_EVAL_START) {
+        g_ctx->ppu.regs.p = g_ctx->ppu.regs.s;
+    }
 
-            switch ((g_scanline_tick - 1) % 8) {
-                // update registers/latches and compute name table address
-                case 0: {
-                    // copy the palette data from the secondary latch to the primary
-                    g_ppu_internal_regs.attr_table_entry_latch = g_ppu_internal_regs.attr_table_entry_latch_secondary;
+    if (g_ctx->ppu.regs.n >= (sizeof(g_ctx->ppu.oam_ram) - g_ctx->ppu.regs.p) / sizeof(Sprite)) {
+        // we've reached the end of OAM
+        return;
+    }
 
-                    // clear upper bits
-                    g_ppu_internal_regs.pattern_shift_l &= ~0xFF00;
-                    g_ppu_internal_regs.pattern_shift_h &= ~0xFF00;
-                    // set upper bits
-                    g_ppu_internal_regs.pattern_shift_l |= g_ppu_internal_regs.pattern_bitmap_l_latch << 8;
-                    g_ppu_internal_regs.pattern_shift_h |= g_ppu_internal_regs.pattern_bitmap_h_latch << 8;
+    if (dot.sprite_op == SPRITE_OP_EVAL_READ) {
+        // read from primary OAM on odd ticks
+        Sprite sprite = ((Sprite*) ((unsigned char*) g_ctx->ppu.oam_ram + g_ctx->ppu.regs.p))[g_ctx->ppu.regs.n];
 
-                    // compute NT address
-                    // address = name table base + (v except fine y)
-                    _update_addr_bus(NAME_TABLE_BASE_ADDR | (g_ppu_internal_regs.v.addr & 0x0FFF));
+        switch (g_ctx->ppu.regs.m) {
+            case 0: {
+                uint8_t val = sprite.y;
 
-                    break;
-                }
-                // fetch NT byte
-                case 1: {
-                    // don't load the latch for unused fetches
-                    if (g_scanline_tick <= 336) {
-                        g_ppu_internal_regs.name_table_entry_latch = system_vram_read(g_ppu_internal_regs.addr_bus);
+                // check if the sprite is on the next scanline
+                // we compare to the current line since sprites are rendered a line late
+                if (val <= g_ctx->ppu.scanline && g_ctx->ppu.scanline - val <= (g_ctx->ppu.control.tall_sprites ? 15 : 7)) {
+                    // increment m if it is
+                    g_ctx->ppu.regs.m++;
+
+                    // store the byte in a latch for writing on the next cycle
+                    g_ctx->ppu.regs.sprite_attr_latch = val;
+                    g_ctx->ppu.regs.has_latched_sprite = true;
+
+                    // if we've already hit the max sprites per line, set the overflow flag
+                    if (g_ctx->ppu.regs.o >= 8) {
+                        g_ctx->ppu.status.sprite_overflow = 1;
                     }
-                    break;
+                } else {
+                    // move to next sprite
+                    g_ctx->ppu.regs.n++;
                 }
-                // compute AT address
-                case 2: {
-                    unsigned int v = g_ppu_internal_regs.v.addr;
-                    // address = attr table base + (name table offset) + (shifted v)
-                    _update_addr_bus(ATTR_TABLE_BASE_ADDR | (v & 0x0C00) | ((v >> 4) & 0x38) | ((v >> 2) & 0x07));
 
-                    break;
-                }
-                // fetch AT byte
-                case 3: {
-                    uint8_t attr_table_byte = system_vram_read(g_ppu_internal_regs.addr_bus);
+                break;
+            }
+            case 1: {
+                uint8_t val = sprite.tile_num;
 
-                    // check if it's in the bottom half of the table cell
-                    if (g_ppu_internal_regs.v.y_coarse & 0b10) {
-                        attr_table_byte >>= 4;
-                    }
+                // store the byte in a latch for writing on the next cycle
+                g_ctx->ppu.regs.sprite_attr_latch = val;
+                g_ctx->ppu.regs.has_latched_sprite = true;
 
-                    // check if it's in the right half of the table cell
-                    if (g_ppu_internal_regs.v.x_coarse & 0b10) {
-                        attr_table_byte >>= 2;
-                    }
+                // increment m since we've already decided to copy this sprite
+                g_ctx->ppu.regs.m++;
 
-                    // don't load the latch for unused fetches
-                    if (g_scanline_tick <= 336) {
-                        g_ppu_internal_regs.attr_table_entry_latch_secondary = attr_table_byte & 0b11;
-                    }
+                break;
+            }
+            case 2: {
+                uint8_t val = sprite.attrs_serial;
 
-                    break;
-                }
-                // compute tile address
-                case 4: {
-                    // multiply by 16 since each plane is 8 bytes, and there are 2 planes per tile
-                    // then we just add the mod of the current line to get the sub-tile offset
-                    unsigned int pattern_offset = g_ppu_internal_regs.name_table_entry_latch * 16
-                            + g_ppu_internal_regs.v.y_fine;
+                // store the byte in a latch for writing on the next cycle
+                g_ctx->ppu.regs.sprite_attr_latch = val;
+                g_ctx->ppu.regs.has_latched_sprite = true;
 
-                    _update_addr_bus((g_ppu_control.background_table ? PT_RIGHT_ADDR : PT_LEFT_ADDR) + pattern_offset);
+                // increment m, same as above
+                g_ctx->ppu.regs.m++;
 
-                    break;
-                }
-                // fetch tile low byte
-                case 5: {
-                    g_ppu_internal_regs.pattern_bitmap_l_latch = _reverse_bits(system_vram_read(g_ppu_internal_regs.addr_bus));
+                break;
+            }
+            case 3: {
+                uint8_t val = sprite.x;
 
-                    break;
-                }
-                // compute tile address
-                case 6: {
-                    // basically the same as above, but we add 8 to get the second plane
-                    unsigned int pattern_offset = g_ppu_internal_regs.name_table_entry_latch * 16
-                            + g_ppu_internal_regs.v.y_fine + 8;
+                // store the byte in a latch for writing on the next cycle
+                g_ctx->ppu.regs.sprite_attr_latch = val;
+                g_ctx->ppu.regs.has_latched_sprite = true;
 
-                    _update_addr_bus((g_ppu_control.background_table ? PT_RIGHT_ADDR : PT_LEFT_ADDR) + pattern_offset);
+                // increment m, same as above
+                g_ctx->ppu.regs.m++;
 
-                    break;
-                }
-                // fetch tile high byte
-                case 7: {
-                    g_ppu_internal_regs.pattern_bitmap_h_latch = _reverse_bits(system_vram_read(g_ppu_internal_regs.addr_bus));
-
-                    // only update v if rendering is enabled
-                    if (ppu_is_rendering_enabled()) {
-                        // only update vertical v at the end of the visible part of the scanline
-                        if (g_scanline_tick == LAST_VISIBLE_CYCLE) {
-                            _update_v_vertical();
-                        }
-
-                        // update horizontal v after every tile
-                        _update_v_horizontal();
-                    }
+                break;
+            }
+        }
+    } else {
+        // write the latched byte to secondary oam, if applicable
+        if (g_ctx->ppu.regs.has_latched_sprite) {
+            if (g_ctx->ppu.regs.o < 8) {
+                assert(g_ctx->ppu.regs.m <= 4);
 
-                    break;
-                }
-                default: {
-                    //assert(false);
-                    break;
+                if (g_ctx->ppu.regs.m == 0) {
+                    return;
                 }
+
+                ((char*) &g_ctx->ppu.secondary_oam_ram[g_ctx->ppu.regs.o])[g_ctx->ppu.regs.m - 1] = g_ctx->ppu.regs.sprite_attr_latch;
+                g_ctx->ppu.regs.has_latched_sprite = false;
             }
         }
+
+        // reset our registers
+        if (g_ctx->ppu.regs.m == 4) {
+            if (g_ctx->ppu.regs.n == 0) {
+                g_ctx->ppu.regs.sprite_0_next_scanline = true;
+            }
+            // reset m and increment n/o
+            g_ctx->ppu.regs.n++;
+            g_ctx->ppu.regs.o++;
+
+            g_ctx->ppu.regs.m = 0;
+        }
     }
 }
 
-void _do_sprite_evaluation(void) {
-    if (g_scanline >= FIRST_VISIBLE_LINE && g_scanline <= g_last_visible_scanline) {
-        // idle tick
-        if (g_scanline_tick == 0) {
-            // reset some registers
-            g_ppu_internal_regs.m = 0;
-            g_ppu_internal_regs.n = 0;
-            g_ppu_internal_regs.o = 0;
-            // copy sprite 0 flag to flag for current scanline
-            g_ppu_internal_regs.sprite_0_scanline = g_ppu_internal_regs.sprite_0_next_scanline;
-            g_ppu_internal_regs.sprite_0_next_scanline = false;
-        } else if (g_scanline_tick >= 1 && g_scanline_tick <= 64) {
-            // clear secondary OAM byte-by-byte, but only on even ticks
-            if (g_scanline_tick % 2 == 0) {
-                ((char*) g_secondary_oam_ram)[(uint8_t) (g_scanline_tick / 2 - 1)] = 0xFF;
+static void _build_sprite_line_masks(void) {
+    SpriteCache *cache = &g_ctx->sprite_cache;
+
+    unsigned int height = g_ctx->ppu.control.tall_sprites ? 16 : 8;
+
+    memset(cache->line_masks, 0, sizeof(cache->line_masks));
+
+    for (unsigned int i = 0; i < sizeof(g_ctx->ppu.oam_ram) / sizeof(Sprite); i++) {
+        unsigned int y = g_ctx->ppu.oam_ram[i].y;
+        for (unsigned int line = y; line < y + height && line < 256; line++) {
+            cache->line_masks[line] |= 1ULL << i;
+        }
+    }
+
+    cache->masks_valid = true;
+    cache->masks_tall = g_ctx->ppu.control.tall_sprites;
+}
+
+// runs the whole of a line's evaluation (dots 65-256) at once and holds onto the result until the last dot
+// this steps through the same states as _do_sprite_evaluation, but skips over sprites which aren't on the line
+static void _begin_sprite_evaluation(void) {
+    SpriteCache *cache = &g_ctx->sprite_cache;
+    PpuInternalRegisters *regs = &g_ctx->ppu.regs;
+
+    if (!cache->masks_valid || cache->masks_tall != g_ctx->ppu.control.tall_sprites) {
+        _build_sprite_line_masks();
+    }
+
+    uint8_t p = regs->s;
+    unsigned int limit = (sizeof(g_ctx->ppu.oam_ram) - p) / sizeof(Sprite);
+    const Sprite *sprites = (const Sprite*) ((unsigned char*) g_ctx->ppu.oam_ram + p);
+    uint64_t on_line = cache->line_masks[g_ctx->ppu.scanline] >> (p / sizeof(Sprite));
+
+    unsigned int m = regs->m;
+    unsigned int n = regs->n;
+    unsigned int o = regs->o;
+    uint8_t latch = regs->sprite_attr_latch;
+    bool has_latch = regs->has_latched_sprite;
+    bool sprite_0 = regs->sprite_0_next_scanline;
+    unsigned int overflow_tick = 0;
+
+    memcpy(cache->eval_secondary_oam, g_ctx->ppu.secondary_oam_ram, sizeof(cache->eval_secondary_oam));
+
+    // each iteration covers a read dot and the write dot after it
+    for (unsigned int tick = SPRITE_EVAL_START_CYCLE; tick < LAST_VISIBLE_CYCLE && n < limit; tick += 2) {
+        if (m == 0 && !((on_line >> n) & 1)) {
+            // the sprite isn't on the line, so the pair of dots only moves on to the next one
+            unsigned int run = (on_line >> n) ? (unsigned int) __builtin_ctzll(on_line >> n) : limit - n;
+            unsigned int pairs = (LAST_VISIBLE_CYCLE + 1 - tick) / 2;
+            if (run > limit - n) {
+                run = limit - n;
             }
-        } else if (g_scanline_tick >= 65 && g_scanline_tick <= 256) {
-            if (g_scanline_tick == 65) {
-                g_ppu_internal_regs.p = g_ppu_internal_regs.s;
+            if (run > pairs) {
+                run = pairs;
             }
 
-            if (g_ppu_internal_regs.n >= (sizeof(g_oam_ram) - g_ppu_internal_regs.p) / sizeof(Sprite)) {
-                // we've reached the end of OAM
-                return;
+            n += run;
+            tick += (run - 1) * 2;
+            continue;
+        }
+
+        const Sprite *sprite = &sprites[n];
+        switch (m) {
+            case 0:
+                latch = sprite->y;
+                if (o >= 8 && !overflow_tick) {
+                    overflow_tick = tick;
+                }
+                break;
+            case 1:
+                latch = sprite->tile_num;
+                break;
+            case 2:
+                latch = sprite->attrs_serial;
+                break;
+            default:
+                latch = sprite->x;
+                break;
+        }
+        has_latch = true;
+        m++;
+
+        if (o < 8) {
+            ((uint8_t*) &cache->eval_secondary_oam[o])[m - 1] = latch;
+            has_latch = false;
+        }
+
+        if (m == 4) {
+            if (n == 0) {
+                sprite_0 = true;
             }
+            n++;
+            o = (o + 1) % 16;
+            m = 0;
+        }
+    }
 
-            if (g_scanline_tick % 2 == 1) {
-                // read from primary OAM on odd ticks
-                Sprite sprite = ((Sprite*) ((unsigned char*) g_oam_ram + g_ppu_internal_regs.p))[g_ppu_internal_regs.n];
-
-                switch (g_ppu_internal_regs.m) {
-                    case 0: {
-                        uint8_t val = sprite.y;
-
-                        // check if the sprite is on the next scanline
-                        // we compare to the current line since sprites are rendered a line late
-                        if (val <= g_scanline && g_scanline - val <= (g_ppu_control.tall_sprites ? 15 : 7)) {
-                            // increment m if it is
-                            g_ppu_internal_regs.m++;
-
-                            // store the byte in a latch for writing on the next cycle
-                            g_ppu_internal_regs.sprite_attr_latch = val;
-                            g_ppu_internal_regs.has_latched_sprite = true;
-
-                            // if we've already hit the max sprites per line, set the overflow flag
-                            if (g_ppu_internal_regs.o >= 8) {
-                                g_ppu_status.sprite_overflow = 1;
-                            }
-                        } else {
-                            // move to next sprite
-                            g_ppu_internal_regs.n++;
-                        }
-
-                        break;
-                    }
-                    case 1: {
-                        uint8_t val = sprite.tile_num;
+    cache->eval_m = m;
+    cache->eval_n = n;
+    cache->eval_o = o;
+    cache->eval_p = p;
+    cache->eval_latch = latch;
+    cache->eval_has_latch = has_latch;
+    cache->eval_sprite_0 = sprite_0;
+    cache->eval_overflow_tick = overflow_tick;
+    cache->eval_pending = true;
+}
 
-                        // store the byte in a latch for writing on the next cycle
-                        g_ppu_internal_regs.sprite_attr_latch = val;
-                        g_ppu_internal_regs.has_latched_sprite = true;
+static void _finish_sprite_evaluation(void) {
+    SpriteCache *cache = &g_ctx->sprite_cache;
+    PpuInternalRegisters *regs = &g_ctx->ppu.regs;
+
+    regs->m = cache->eval_m;
+    regs->n = cache->eval_n;
+    regs->o = cache->eval_o;
+    regs->p = cache->eval_p;
+    regs->sprite_attr_latch = cache->eval_latch;
+    regs->has_latched_sprite = cache->eval_has_latch;
+    regs->sprite_0_next_scanline = cache->eval_sprite_0;
+    if (cache->eval_overflow_tick) {
+        g_ctx->ppu.status.sprite_overflow = 1;
+    }
 
-                        // increment m since we've already decided to copy this sprite
-                        g_ppu_internal_regs.m++;
+    memcpy(g_ctx->ppu.secondary_oam_ram, cache->eval_secondary_oam, sizeof(g_ctx->ppu.secondary_oam_ram));
 
-                        break;
-                    }
-                    case 2: {
-                        uint8_t val = sprite.attrs_serial;
+    cache->eval_pending = false;
+}
 
-                        // store the byte in a latch for writing on the next cycle
-                        g_ppu_internal_regs.sprite_attr_latch = val;
-                        g_ppu_internal_regs.has_latched_sprite = true;
+// returns whether the dot's evaluation was taken care of
+static bool _do_sprite_evaluation_fast(PpuDot dot) {
+    if (g_ctx->sprite_cache.eval_pending) {
+        if (g_ctx->ppu.scanline_tick == LAST_VISIBLE_CYCLE) {
+            _finish_sprite_evaluation();
+        }
+        return true;
+    }
 
-                        // increment m, same as above
-                        g_ppu_internal_regs.m++;
+    // OAM evaluation is only aligned to sprites if $2003 was left at a multiple of 4, and it can only be picked up
+    // partway through a sprite if rendering was toggled before the line's reset
+    if ((dot.flags & DOT_SPRITE_EVAL_START) && g_ctx->ppu.regs.s % sizeof(Sprite) == 0 && g_ctx->ppu.regs.m == 0) {
+        _begin_sprite_evaluation();
+        return true;
+    }
 
-                        break;
-                    }
-                    case 3: {
-                        uint8_t val = sprite.x;
+    return false;
+}
 
-                        // store the byte in a latch for writing on the next cycle
-                        g_ppu_internal_regs.sprite_attr_latch = val;
-                        g_ppu_internal_regs.has_latched_sprite = true;
+// catches the sprite counters up after the given number of pixels were drawn from the line buffer
+static void _advance_sprite_counters(unsigned int pixels) {
+    PpuInternalRegisters *regs = &g_ctx->ppu.regs;
 
-                        // increment m, same as above
-                        g_ppu_internal_regs.m++;
+    for (int i = 0; i < 8; i++) {
+        unsigned int wait = regs->sprite_x_counters[i] < pixels ? regs->sprite_x_counters[i] : pixels;
+        regs->sprite_x_counters[i] -= wait;
 
-                        break;
-                    }
-                }
-            } else {
-                // write the latched byte to secondary oam, if applicable
-                if (g_ppu_internal_regs.has_latched_sprite) {
-                    if (g_ppu_internal_regs.o < 8) {
-                        assert(g_ppu_internal_regs.m <= 4);
+        unsigned int active = regs->sprite_death_counters[i] < pixels - wait
+                ? regs->sprite_death_counters[i]
+                : pixels - wait;
+        regs->sprite_death_counters[i] -= active;
+        regs->sprite_tile_shift_l[i] >>= active;
+        regs->sprite_tile_shift_h[i] >>= active;
+    }
+}
 
-                        if (g_ppu_internal_regs.m == 0) {
-                            return;
-                        }
+// composites the loaded sprites into the line buffer, lowest index on top
+static void _build_sprite_line(void) {
+    SpriteCache *cache = &g_ctx->sprite_cache;
+    PpuInternalRegisters *regs = &g_ctx->ppu.regs;
 
-                        ((char*) &g_secondary_oam_ram[g_ppu_internal_regs.o])[g_ppu_internal_regs.m - 1] = g_ppu_internal_regs.sprite_attr_latch;
-                        g_ppu_internal_regs.has_latched_sprite = false;
-                    }
-                }
+    memset(cache->line_pixels, 0, sizeof(cache->line_pixels));
 
-                // reset our registers
-                if (g_ppu_internal_regs.m == 4) {
-                    if (g_ppu_internal_regs.n == 0) {
-                        g_ppu_internal_regs.sprite_0_next_scanline = true;
-                    }
-                    // reset m and increment n/o
-                    g_ppu_internal_regs.n++;
-                    g_ppu_internal_regs.o++;
+    for (int i = regs->loaded_sprites - 1; i >= 0; i--) {
+        SpriteAttributes attrs = regs->sprite_attr_latches[i];
+        uint8_t flags = (attrs.low_priority ? SPRITE_PIXEL_LOW_PRIORITY : 0) | (i == 0 ? SPRITE_PIXEL_SPRITE_0 : 0);
 
-                    g_ppu_internal_regs.m = 0;
-                }
+        unsigned int start = regs->sprite_x_counters[i];
+        unsigned int width = regs->sprite_death_counters[i] < 8 ? regs->sprite_death_counters[i] : 8;
+
+        for (unsigned int k = 0; k < width && start + k < RESOLUTION_H; k++) {
+            unsigned int palette_low = (((regs->sprite_tile_shift_h[i] >> k) & 1) << 1)
+                    | ((regs->sprite_tile_shift_l[i] >> k) & 1);
+            if (palette_low) {
+                cache->line_pixels[start + k] = 0x10 | (attrs.palette_index << 2) | palette_low | flags;
             }
         }
     }
+
+    cache->line_valid = true;
 }
 
-void _do_sprite_fetching(void) {
-    if ((g_scanline >= FIRST_VISIBLE_LINE && g_scanline <= g_last_visible_scanline) || g_scanline == g_pre_render_line) {
-        if (g_scanline_tick >= 257 && g_scanline_tick <= 320) {
-            // sprite tile fetching
+void ppu_flush_sprite_cache(void) {
+    SpriteCache *cache = &g_ctx->sprite_cache;
 
-            g_ppu_internal_regs.s = 0;
+    if (cache->eval_pending) {
+        cache->eval_pending = false;
 
-            if (g_scanline_tick == 257) {
-                g_ppu_internal_regs.loaded_sprites = g_ppu_internal_regs.o;
-            }
+        // replay the line's evaluation up to the current dot
+        const PpuDot *dots = g_ctx->ppu_dots.dots[g_ctx->ppu_dots.line_types[g_ctx->ppu.scanline]];
+        for (unsigned int tick = SPRITE_EVAL_START_CYCLE; tick < g_ctx->ppu.scanline_tick; tick++) {
+            _do_sprite_evaluation(dots[tick]);
+        }
+    }
 
-            if (g_scanline_tick == 257) {
-                // reset secondary oam index
-                g_ppu_internal_regs.o = 0;
-            }
+    if (cache->line_valid) {
+        _advance_sprite_counters(g_ctx->ppu.scanline_tick - 1);
+        cache->line_valid = false;
+    }
+}
 
-            unsigned int index = g_ppu_internal_regs.o;
-            switch ((g_scanline_tick - 1) % 8) {
-                case 0: {
-                    g_ppu_internal_regs.sprite_y_latch = g_secondary_oam_ram[index].y;
+// plane is 0 for the low byte and 8 for the high byte
+static uint16_t _sprite_pattern_addr(unsigned int index, unsigned int plane) {
+    SpriteAttributes attrs = g_ctx->ppu.regs.sprite_attr_latches[index];
 
-                    break;
-                }
-                case 1: {
-                    g_ppu_internal_regs.sprite_tile_index_latch = g_secondary_oam_ram[index].tile_num;
+    uint16_t tile_index = g_ctx->ppu.regs.sprite_tile_index_latch;
 
-                    break;
-                }
-                case 2: {
-                    g_ppu_internal_regs.sprite_attr_latches[index] = g_secondary_oam_ram[index].attrs;
+    uint8_t cur_y = (g_ctx->ppu.scanline - g_ctx->ppu.regs.sprite_y_latch) % 16;
+    bool bottom_tile = false;
+    if (g_ctx->ppu.control.tall_sprites) {
+        bottom_tile = (cur_y > 7) ^ attrs.flip_ver;
+        if (cur_y > 7) {
+            cur_y -= 8;
+        }
+    } else {
+        cur_y %= 8;
+    }
 
-                    break;
-                }
-                case 3: {
-                    g_ppu_internal_regs.sprite_x_counters[index] = g_secondary_oam_ram[index].x;
-                    // set the death counter latch to the sprite width
-                    g_ppu_internal_regs.sprite_death_counters[index] = 8;
+    if (attrs.flip_ver) {
+        cur_y = 7 - cur_y;
+    }
 
-                    break;
-                }
-                // compute tile address
-                case 4:{
-                    SpriteAttributes attrs = g_ppu_internal_regs.sprite_attr_latches[index];
-
-                    uint16_t tile_index = g_ppu_internal_regs.sprite_tile_index_latch;
-
-                    uint8_t cur_y = (g_scanline - g_ppu_internal_regs.sprite_y_latch) % 16;
-                    bool bottom_tile = false;
-                    if (g_ppu_control.tall_sprites) {
-                        bottom_tile = (cur_y > 7) ^ attrs.flip_ver;
-                        if (cur_y > 7) {
-                            cur_y -= 8;
-                        }
-                    } else {
-                        cur_y %= 8;
-                    }
+    if (g_ctx->ppu.control.tall_sprites) {
+        uint16_t adj_tile_index = (tile_index & 0xFE) | (bottom_tile ? 1 : 0);
+        return ((tile_index & 1) * 0x1000) | (adj_tile_index * 16 + cur_y + plane);
+    } else {
+        return (g_ctx->ppu.control.sprite_table ? PT_RIGHT_ADDR : PT_LEFT_ADDR) | (tile_index * 16 + cur_y + plane);
+    }
+}
 
-                    if (attrs.flip_ver) {
-                        cur_y = 7 - cur_y;
-                    }
+static void _do_sprite_fetching(PpuDot dot) {
+    if (dot.sprite_op < SPRITE_OP_FETCH_Y) {
+        return;
+    }
 
-                    if (g_ppu_control.tall_sprites) {
-                        uint16_t adj_tile_index = (tile_index & 0xFE) | (bottom_tile ? 1 : 0);
-                        _update_addr_bus(((tile_index & 1) * 0x1000) | (adj_tile_index * 16 + cur_y));
-                    } else {
-                        _update_addr_bus((g_ppu_control.sprite_table ? PT_RIGHT_ADDR : PT_LEFT_ADDR)
-                                | (tile_index * 16 + cur_y));
-                    }
+    // sprite tile fetching
 
-                    break;
-                }
-                // fetch tile lower byte
-                case 5: {
-                    SpriteAttributes attrs = g_ppu_internal_regs.sprite_attr_latches[index];
+    g_ctx->ppu.regs.s = 0;
 
-                    if (index < g_ppu_internal_regs.loaded_sprites) {
-                        uint8_t res = system_vram_read(g_ppu_internal_regs.addr_bus);
+    if (dot.flags & DOT_SPRITE_FETCH_START) {
+        g_ctx->ppu.regs.loaded_sprites = g_ctx->ppu.regs.o;
+        // reset secondary oam index
+        g_ctx->ppu.regs.o = 0;
+    }
 
-                        if (!attrs.flip_hor) {
-                            res = _reverse_bits(res);
-                        }
+    // each sprite gets an 8-dot fetch slot, so the slot is derived from the dot rather than the OAM index
+    // (the index isn't reset if rendering is enabled partway through the fetch window)
+    unsigned int index = (g_ctx->ppu.scanline_tick - 257) / 8;
+    switch (dot.sprite_op) {
+        case SPRITE_OP_FETCH_Y: {
+            g_ctx->ppu.regs.sprite_y_latch = g_ctx->ppu.secondary_oam_ram[index].y;
 
-                        g_ppu_internal_regs.sprite_tile_shift_l[index] = res;
-                    } else {
-                        // load transparent bitmap
-                        g_ppu_internal_regs.sprite_tile_shift_l[index] = 0;
-                    }
+            break;
+        }
+        case SPRITE_OP_FETCH_TILE: {
+            g_ctx->ppu.regs.sprite_tile_index_latch = g_ctx->ppu.secondary_oam_ram[index].tile_num;
 
-                    break;
-                }
-                // compute tile address
-                // same as above, but we add 8 to the address
-                case 6: {
-                    SpriteAttributes attrs = g_ppu_internal_regs.sprite_attr_latches[index];
-
-                    uint16_t tile_index = g_ppu_internal_regs.sprite_tile_index_latch;
-
-                    uint8_t cur_y = (g_scanline - g_ppu_internal_regs.sprite_y_latch) % 16;
-                    bool bottom_tile = false;
-                    if (g_ppu_control.tall_sprites) {
-                        bottom_tile = (cur_y > 7) ^ attrs.flip_ver;
-                        if (cur_y > 7) {
-                            cur_y -= 8;
-                        }
-                    } else {
-                        cur_y %= 8;
-                    }
+            break;
+        }
+        case SPRITE_OP_FETCH_ATTR: {
+            g_ctx->ppu.regs.sprite_attr_latches[index] = g_ctx->ppu.secondary_oam_ram[index].attrs;
 
-                    if (attrs.flip_ver) {
-                        cur_y = 7 - cur_y;
-                    }
+            break;
+        }
+        case SPRITE_OP_FETCH_X: {
+            g_ctx->ppu.regs.sprite_x_counters[index] = g_ctx->ppu.secondary_oam_ram[index].x;
+            // set the death counter latch to the sprite width
+            g_ctx->ppu.regs.sprite_death_counters[index] = 8;
 
-                    if (g_ppu_control.tall_sprites) {
-                        uint16_t adj_tile_index = (tile_index & 0xFE) | (bottom_tile ? 1 : 0);
-                        _update_addr_bus(((tile_index & 1) * 0x1000) | (adj_tile_index * 16 + cur_y + 8));
-                    } else {
-                        _update_addr_bus((g_ppu_control.sprite_table ? PT_RIGHT_ADDR : PT_LEFT_ADDR)
-                                | (tile_index * 16 + cur_y + 8));
-                    }
+            break;
+        }
+        // compute tile address
+        case SPRITE_OP_PT_LOW_ADDR: {
+            _update_addr_bus(_sprite_pattern_addr(index, 0));
 
-                    break;
-                }
-                // fetch tile upper byte
-                case 7: {
-                    SpriteAttributes attrs = g_ppu_internal_regs.sprite_attr_latches[index];
+            break;
+        }
+        // fetch tile lower byte
+        case SPRITE_OP_PT_LOW_FETCH: {
+            SpriteAttributes attrs = g_ctx->ppu.regs.sprite_attr_latches[index];
 
-                    if (index < g_ppu_internal_regs.loaded_sprites) {
-                        uint8_t res = system_vram_read(g_ppu_internal_regs.addr_bus);
+            if (index < g_ctx->ppu.regs.loaded_sprites) {
+                uint8_t res = _fetch_pattern(g_ctx->ppu.regs.addr_bus, !attrs.flip_hor);
 
-                        if (!attrs.flip_hor) {
-                            res = _reverse_bits(res);
-                        }
+                g_ctx->ppu.regs.sprite_tile_shift_l[index] = res;
+            } else {
+                // load transparent bitmap
+                g_ctx->ppu.regs.sprite_tile_shift_l[index] = 0;
+            }
 
-                        g_ppu_internal_regs.sprite_tile_shift_h[index] = res;
-                    } else {
-                        // load transparent bitmap
-                        g_ppu_internal_regs.sprite_tile_shift_h[index] = 0;
-                    }
+            break;
+        }
+        // compute tile address
+        // same as above, but we add 8 to the address
+        case SPRITE_OP_PT_HIGH_ADDR: {
+            _update_addr_bus(_sprite_pattern_addr(index, 8));
 
-                    g_ppu_internal_regs.o++;
+            break;
+        }
+        // fetch tile upper byte
+        case SPRITE_OP_PT_HIGH_FETCH: {
+            SpriteAttributes attrs = g_ctx->ppu.regs.sprite_attr_latches[index];
 
-                    break;
-                }
-                default: {
-                    assert(false);
-                    break;
-                }
+            if (index < g_ctx->ppu.regs.loaded_sprites) {
+                uint8_t res = _fetch_pattern(g_ctx->ppu.regs.addr_bus, !attrs.flip_hor);
+
+                g_ctx->ppu.regs.sprite_tile_shift_h[index] = res;
+            } else {
+                // load transparent bitmap
+                g_ctx->ppu.regs.sprite_tile_shift_h[index] = 0;
             }
+
+            g_ctx->ppu.regs.o++;
+
+            break;
+        }
+        default: {
+            assert(false);
+            break;
         }
     }
 }
 
 RenderMode get_render_mode(void) {
-    return g_render_mode;
+    return g_ctx->ppu.render_mode;
 }
 
 void set_render_mode(RenderMode mode) {
-    g_render_mode = mode;
+    g_ctx->ppu.render_mode = mode;
+}
+
+// emphasis bits in NTSC order (red, green, blue from LSB), PAL and Dendy PPUs have red and green swapped
+static uint8_t _get_emphasis(void) {
+    uint8_t emphasis = g_ctx->ppu.mask.serial >> 5;
+    if (g_ctx->ppu_dots.swaps_emphasis) {
+        emphasis = (emphasis & 0b100) | ((emphasis & 0b001) << 1) | ((emphasis & 0b010) >> 1);
+    }
+    return emphasis;
 }
 
-void render_pixel(uint8_t x, uint8_t y, RGBValue rgb) {
+void render_pixel(uint8_t x, uint8_t y, uint8_t palette_index) {
     bool use_nt = false;
     uint8_t pt_tile = 0;
     uint8_t palette_num = 0;
 
-    switch (g_render_mode) {
+    switch (g_ctx->ppu.render_mode) {
         case RM_NORMAL:
         default:
-            system_emit_pixel(x, y, rgb);
+            system_emit_pixel(x, y, palette_index);
             break;
         case RM_NT0:
         case RM_NT1:
         case RM_NT2:
         case RM_NT3: {
             use_nt = true;
-            uint8_t nt_index = g_render_mode - RM_NT0;
+            uint8_t nt_index = g_ctx->ppu.render_mode - RM_NT0;
             uint16_t nt_base = NAME_TABLE_BASE_ADDR | (nt_index * NAME_TABLE_INTERVAL);
             pt_tile = system_vram_read(nt_base | ((y / NAME_TABLE_GRANULARITY) * NAME_TABLE_WIDTH + (x / NAME_TABLE_GRANULARITY)));
             palette_num = system_vram_read(nt_base | ((y / ATTR_TABLE_GRANULARITY) * ATTR_TABLE_WIDTH + (x / ATTR_TABLE_GRANULARITY)));
@@ -1011,17 +1496,16 @@ void render_pixel(uint8_t x, uint8_t y, RGBValue rgb) {
 
             uint16_t pattern_offset = pt_tile * 16 + (y % NAME_TABLE_GRANULARITY);
 
-            uint16_t pattern_addr = ((use_nt ? g_ppu_control.background_table : x >= 128)
+            uint16_t pattern_addr = ((use_nt ? g_ctx->ppu.control.background_table : x >= 128)
                     ? PT_RIGHT_ADDR
                     : PT_LEFT_ADDR)
                     + pattern_offset;
 
             uint8_t pattern_pixel = ((system_vram_read(pattern_addr) >> (7 - (x % 8))) & 1) | (((system_vram_read(pattern_addr + 8) >> (7 - (x % 8))) & 1) << 1);
 
-            int8_t palette_index = system_vram_read(PALETTE_DATA_BASE_ADDR | (pattern_pixel ? (palette_num << 2) : 0) | pattern_pixel);
-            RGBValue pixel_rgb = g_palette[palette_index];
+            uint8_t debug_index = system_vram_read(PALETTE_DATA_BASE_ADDR | (pattern_pixel ? (palette_num << 2) : 0) | pattern_pixel);
 
-            system_emit_pixel(x, y, pixel_rgb);
+            system_emit_pixel(x, y, debug_index & PALETTE_INDEX_MASK);
             
             break;
         }
@@ -1029,28 +1513,46 @@ void render_pixel(uint8_t x, uint8_t y, RGBValue rgb) {
 }
 
 void cycle_ppu(void) {
-    _do_tile_fetching();
+    PpuDot dot = g_ctx->ppu_dots.dots[g_ctx->ppu_dots.line_types[g_ctx->ppu.scanline]][g_ctx->ppu.scanline_tick];
 
-    if (ppu_is_rendering_enabled()) {
-        _do_sprite_evaluation();
-        _do_sprite_fetching();
+    g_ctx->ppu.nmi_occurred = g_ctx->ppu.nmi_occurred_buffer;
+
+    // these only happen on a handful of dots per frame
+    if (dot.flags & DOT_LINE_EVENTS) {
+        _do_line_events(dot);
     }
 
-    unsigned int draw_pixel_x = g_scanline_tick - 1;
-    unsigned int draw_pixel_y = g_scanline;
+    _do_tile_fetching(dot);
 
-    if (g_scanline <= g_last_visible_scanline && g_scanline_tick > 0 && g_scanline_tick <= RESOLUTION_H) {
-        unsigned int palette_low = (((g_ppu_internal_regs.pattern_shift_h >> g_ppu_internal_regs.x) & 1) << 1)
-                | ((g_ppu_internal_regs.pattern_shift_l >> g_ppu_internal_regs.x) & 1);
+    if (dot.sprite_op != SPRITE_OP_NONE && ppu_is_rendering_enabled()) {
+        if (!_do_sprite_evaluation_fast(dot)) {
+            _do_sprite_evaluation(dot);
+        }
+        _do_sprite_fetching(dot);
+    }
+
+    unsigned int draw_pixel_x = g_ctx->ppu.scanline_tick - 1;
+    unsigned int draw_pixel_y = g_ctx->ppu.scanline;
+
+    if (dot.flags & DOT_PIXEL) {
+        SpriteCache *sprite_cache = &g_ctx->sprite_cache;
+
+        // the counters are only sane if at most 8 sprites were loaded
+        if (g_ctx->ppu.scanline_tick == 1 && g_ctx->ppu.regs.loaded_sprites <= 8) {
+            _build_sprite_line();
+        }
+
+        unsigned int palette_low = (((g_ctx->ppu.regs.pattern_shift_h >> g_ctx->ppu.regs.x) & 1) << 1)
+                | ((g_ctx->ppu.regs.pattern_shift_l >> g_ctx->ppu.regs.x) & 1);
 
         unsigned int bg_palette_offset;
 
         bool transparent_background = false;
 
-        if (palette_low && !(!g_ppu_mask.show_background_left && g_scanline_tick <= 8)) {
+        if (palette_low && !(!g_ctx->ppu.mask.show_background_left && g_ctx->ppu.scanline_tick <= 8)) {
             // if the palette low bits are not zero, we select the color normally
-            unsigned int palette_high = (((g_ppu_internal_regs.palette_shift_h >> g_ppu_internal_regs.x) & 1) << 1)
-                    | ((g_ppu_internal_regs.palette_shift_l >> g_ppu_internal_regs.x) & 1);
+            unsigned int palette_high = (((g_ctx->ppu.regs.palette_shift_h >> g_ctx->ppu.regs.x) & 1) << 1)
+                    | ((g_ctx->ppu.regs.palette_shift_l >> g_ctx->ppu.regs.x) & 1);
             bg_palette_offset = (palette_high << 2) | palette_low;
         } else {
             // otherwise, we use the default background color
@@ -1059,7 +1561,7 @@ void cycle_ppu(void) {
         }
 
         uint8_t final_palette_offset;
-        if (g_ppu_mask.show_background) {
+        if (g_ctx->ppu.mask.show_background) {
             final_palette_offset = bg_palette_offset;
         } else {
             final_palette_offset = 0xFF;
@@ -1068,50 +1570,69 @@ void cycle_ppu(void) {
         // time to read sprite data
 
         // don't render sprites if sprite rendering is disabled, or if they should be clipped
-        if (g_ppu_mask.show_sprites && !(!g_ppu_mask.show_sprites_left && g_scanline_tick <= 8)) {
-            // iterate all sprites for the current scanline
-            for (unsigned int i = 0; i < g_ppu_internal_regs.loaded_sprites; i++) {
-                // if the x counter hasn't run down to zero, skip it
-                if (g_ppu_internal_regs.sprite_x_counters[i]) {
-                    continue;
-                }
+        if (g_ctx->ppu.mask.show_sprites && !(!g_ctx->ppu.mask.show_sprites_left && g_ctx->ppu.scanline_tick <= 8)) {
+            if (sprite_cache->line_valid) {
+                // the line's sprites were composited up front
+                uint8_t sprite_pixel = sprite_cache->line_pixels[draw_pixel_x];
+
+                if (sprite_pixel) {
+                    if (g_ctx->ppu.regs.sprite_0_scanline
+                            && (sprite_pixel & SPRITE_PIXEL_SPRITE_0)
+                            && g_ctx->ppu.mask.show_background
+                            && !transparent_background
+                            && g_ctx->ppu.scanline_tick != 256) {
+                        g_ctx->ppu.status.sprite_0_hit = 1; // set the hit flag
+                    }
 
-                // if the death counter went to zero, this sprite is done rendering
-                if (!g_ppu_internal_regs.sprite_death_counters[i]) {
-                    continue;
+                    if (!(sprite_pixel & SPRITE_PIXEL_LOW_PRIORITY) || transparent_background) {
+                        final_palette_offset = sprite_pixel & SPRITE_PIXEL_PALETTE_MASK;
+                    }
                 }
+            } else {
+                // iterate all sprites for the current scanline
+                for (unsigned int i = 0; i < g_ctx->ppu.regs.loaded_sprites; i++) {
+                    // if the x counter hasn't run down to zero, skip it
+                    if (g_ctx->ppu.regs.sprite_x_counters[i]) {
+                        continue;
+                    }
 
-                unsigned int palette_low = ((g_ppu_internal_regs.sprite_tile_shift_h[i] & 1) << 1)
-                                            | (g_ppu_internal_regs.sprite_tile_shift_l[i] & 1);
-                // if the pixel is transparent, just continue
-                if (!palette_low) {
-                    continue;
-                }
+                    // if the death counter went to zero, this sprite is done rendering
+                    if (!g_ctx->ppu.regs.sprite_death_counters[i]) {
+                        continue;
+                    }
 
-                if (g_ppu_internal_regs.sprite_0_scanline
-                        && i == 0
-                        && g_ppu_mask.show_background
-                        && !transparent_background
-                        && g_scanline_tick != 256) {
-                    g_ppu_status.sprite_0_hit = 1; // set the hit flag
-                }
+                    unsigned int palette_low = ((g_ctx->ppu.regs.sprite_tile_shift_h[i] & 1) << 1)
+                                                | (g_ctx->ppu.regs.sprite_tile_shift_l[i] & 1);
+                    // if the pixel is transparent, just continue
+                    if (!palette_low) {
+                        continue;
+                    }
 
-                SpriteAttributes attrs = g_ppu_internal_regs.sprite_attr_latches[i];
+                    if (g_ctx->ppu.regs.sprite_0_scanline
+                            && i == 0
+                            && g_ctx->ppu.mask.show_background
+                            && !transparent_background
+                            && g_ctx->ppu.scanline_tick != 256) {
+                        g_ctx->ppu.status.sprite_0_hit = 1; // set the hit flag
+                    }
+
+                    SpriteAttributes attrs = g_ctx->ppu.regs.sprite_attr_latches[i];
 
-                uint8_t palette_high = 0x4 | attrs.palette_index;
-                uint8_t sprite_palette_offset = (palette_high << 2) | palette_low;
+                    uint8_t palette_high = 0x4 | attrs.palette_index;
+                    uint8_t sprite_palette_offset = (palette_high << 2) | palette_low;
 
-                if (!attrs.low_priority || transparent_background) {
-                    final_palette_offset = sprite_palette_offset;
+                    if (!attrs.low_priority || transparent_background) {
+                        final_palette_offset = sprite_palette_offset;
+                    }
+                    break;
                 }
-                break;
             }
         }
 
         uint8_t palette_index;
         if (final_palette_offset == 0xFF) {
             palette_index = 0x0F;
-        } else if ((system_get_tv_system() == TV_SYSTEM_PAL || system_get_tv_system() == TV_SYSTEM_DENDY)
+        } else if (g_ctx->ppu_dots.draws_border
                 && (draw_pixel_y == 0
                 || draw_pixel_x == 0 || draw_pixel_x == 1
                 || draw_pixel_x == 254 || draw_pixel_x == 255)) {
@@ -1122,57 +1643,134 @@ void cycle_ppu(void) {
             palette_index = system_vram_read(palette_entry_addr);
         }
 
-        RGBValue rgb = g_palette[palette_index % (sizeof(g_palette) / sizeof(RGBValue))];
+        // emphasis is applied by the renderer's palette LUT, so it only needs latching once per row
+        if (draw_pixel_x == 0) {
+            system_emit_row_emphasis(draw_pixel_y, _get_emphasis());
+        }
 
-        render_pixel(draw_pixel_x, draw_pixel_y, rgb);
+        render_pixel(draw_pixel_x, draw_pixel_y, palette_index & PALETTE_INDEX_MASK);
 
-        for (int i = 0; i < 8; i++) {
-            if (g_ppu_internal_regs.sprite_x_counters[i]) {
-                g_ppu_internal_regs.sprite_x_counters[i]--;
-            } else {
-                if (g_ppu_internal_regs.sprite_death_counters[i]) {
-                    g_ppu_internal_regs.sprite_death_counters[i]--;
-                    g_ppu_internal_regs.sprite_tile_shift_l[i] >>= 1;
-                    g_ppu_internal_regs.sprite_tile_shift_h[i] >>= 1;
+        if (sprite_cache->line_valid) {
+            // the counters are settled all at once at the end of the line
+            if (g_ctx->ppu.scanline_tick == LAST_VISIBLE_CYCLE) {
+                _advance_sprite_counters(RESOLUTION_H);
+                sprite_cache->line_valid = false;
+            }
+        } else {
+            for (int i = 0; i < 8; i++) {
+                if (g_ctx->ppu.regs.sprite_x_counters[i]) {
+                    g_ctx->ppu.regs.sprite_x_counters[i]--;
+                } else {
+                    if (g_ctx->ppu.regs.sprite_death_counters[i]) {
+                        g_ctx->ppu.regs.sprite_death_counters[i]--;
+                        g_ctx->ppu.regs.sprite_tile_shift_l[i] >>= 1;
+                        g_ctx->ppu.regs.sprite_tile_shift_h[i] >>= 1;
+                    }
                 }
             }
         }
     }
 
-    if ((g_scanline <= g_last_visible_scanline || g_scanline == g_pre_render_line)
-            && ((g_scanline_tick >= 1 && g_scanline_tick <= RESOLUTION_H)
-                    || (g_scanline_tick >= 321 && g_scanline_tick <= 336))) {
+    if (dot.flags & DOT_SHIFT) {
         // shift the internal registers
-        g_ppu_internal_regs.pattern_shift_h >>= 1;
-        g_ppu_internal_regs.pattern_shift_l >>= 1;
-        g_ppu_internal_regs.palette_shift_h >>= 1;
-        g_ppu_internal_regs.palette_shift_l >>= 1;
+        g_ctx->ppu.regs.pattern_shift_h >>= 1;
+        g_ctx->ppu.regs.pattern_shift_l >>= 1;
+        g_ctx->ppu.regs.palette_shift_h >>= 1;
+        g_ctx->ppu.regs.palette_shift_l >>= 1;
         // feed the attribute registers from the latch(es)
-        g_ppu_internal_regs.palette_shift_h |= (g_ppu_internal_regs.attr_table_entry_latch & 0b10) << 6;
-        g_ppu_internal_regs.palette_shift_l |= (g_ppu_internal_regs.attr_table_entry_latch & 0b01) << 7;
+        g_ctx->ppu.regs.palette_shift_h |= (g_ctx->ppu.regs.attr_table_entry_latch & 0b10) << 6;
+        g_ctx->ppu.regs.palette_shift_l |= (g_ctx->ppu.regs.attr_table_entry_latch & 0b01) << 7;
     }
 
     // if the frame is odd and background rendering is enabled, skip the last cycle
     // we do this in an indirect way so the next block (which advances the internal counters) can execute normally
-    //TODO: figure out why we need to subtract 3 instead of 2
-    if (g_scanline == g_pre_render_line && g_scanline_tick == CYCLES_PER_SCANLINE - 3
-            && g_odd_frame && g_ppu_mask.show_background && system_get_tv_system() == TV_SYSTEM_NTSC) {
-        g_scanline_tick++;
+    if ((dot.flags & DOT_ODD_FRAME_SKIP) && g_ctx->ppu.odd_frame && g_ctx->ppu.mask.show_background) {
+        g_ctx->ppu.scanline_tick++;
     }
 
-    if (++g_scanline_tick >= CYCLES_PER_SCANLINE) {
-        g_scanline_tick = 0;
+    if (++g_ctx->ppu.scanline_tick >= CYCLES_PER_SCANLINE) {
+        g_ctx->ppu.scanline_tick = 0;
 
-        if (++g_scanline >= g_scanline_count) {
-            g_scanline = 0;
+        if (++g_ctx->ppu.scanline >= g_ctx->ppu.scanline_count) {
+            g_ctx->ppu.scanline = 0;
 
-            g_odd_frame = !g_odd_frame;
+            g_ctx->ppu.odd_frame = !g_ctx->ppu.odd_frame;
 
             system_submit_frame();
         }
     }
 }
 
+unsigned int ppu_get_idle_dots(void) {
+    const PpuDotTable *table = &g_ctx->ppu_dots;
+    bool rendering = ppu_is_rendering_enabled();
+
+    unsigned int line = g_ctx->ppu.scanline;
+    unsigned int tick = g_ctx->ppu.scanline_tick;
+    unsigned int dots = 0;
+
+    while (true) {
+        unsigned int run = table->idle_runs[rendering][table->line_types[line]][tick];
+        dots += run;
+
+        // runs continue onto the next line, but not into the next frame (the last dot of a frame is never idle anyway)
+        if (tick + run < CYCLES_PER_SCANLINE || line + 1 >= g_ctx->ppu.scanline_count) {
+            break;
+        }
+
+        line++;
+        tick = 0;
+    }
+
+    return dots;
+}
+
+// number of dots from the current one which can be run at any later point without the CPU being able to tell, as long as
+// it doesn't touch the PPU in the meantime
+// this stops short of the next dot which changes the NMI line, and of the last dot of the frame (which submits it)
+unsigned int ppu_get_quiet_dots(void) {
+    const PpuDotTable *table = &g_ctx->ppu_dots;
+
+    unsigned int line = g_ctx->ppu.scanline;
+    unsigned int tick = g_ctx->ppu.scanline_tick;
+    unsigned int dots = 0;
+
+    while (true) {
+        unsigned int run = table->quiet_runs[table->line_types[line]][tick];
+        dots += run;
+
+        if (tick + run < CYCLES_PER_SCANLINE) {
+            break;
+        }
+
+        if (line + 1 >= g_ctx->ppu.scanline_count) {
+            // leave out the last dot
+            dots--;
+            break;
+        }
+
+        line++;
+        tick = 0;
+    }
+
+    return dots;
+}
+
+// equivalent to calling cycle_ppu for each of the given dots, as long as ppu_get_idle_dots said they were idle
+void ppu_advance(unsigned int dots) {
+    if (dots == 0) {
+        return;
+    }
+
+    g_ctx->ppu.nmi_occurred = g_ctx->ppu.nmi_occurred_buffer;
+
+    unsigned int tick = g_ctx->ppu.scanline_tick + dots;
+    g_ctx->ppu.scanline += tick / CYCLES_PER_SCANLINE;
+    g_ctx->ppu.scanline_tick = tick % CYCLES_PER_SCANLINE;
+
+    assert(g_ctx->ppu.scanline < g_ctx->ppu.scanline_count);
+}
+
 void dump_vram(void) {
     FILE *out_file = fopen("vram.bin", "w+");
 
@@ -1181,8 +1779,8 @@ void dump_vram(void) {
         return;
     }
 
-    fwrite(g_name_table_mem, VRAM_MAX_SIZE, 1, out_file);
-    fwrite(g_palette_ram, PALETTE_RAM_SIZE, 1, out_file);
+    fwrite(g_ctx->ppu.name_table_mem, VRAM_MAX_SIZE, 1, out_file);
+    fwrite(g_ctx->ppu.palette_ram, PALETTE_RAM_SIZE, 1, out_file);
 
     fclose(out_file);
 }
@@ -1195,7 +1793,7 @@ void dump_oam(void) {
         return;
     }
 
-    fwrite(g_oam_ram, OAM_PRIMARY_SIZE, 1, out_file);
+    fwrite(g_ctx->ppu.oam_ram, OAM_PRIMARY_SIZE, 1, out_file);
 
     fclose(out_file);
 }
@@ -28,11 +28,20 @@
 #include "ppu.h"
 #include "util.h"
 
+#include <errno.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 #include <SDL.h>
 
-#define RGB_CHANNELS 3
-#define BPP 8
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RENDERER_X86_SIMD 1
+#include <immintrin.h>
+#else
+#define RENDERER_X86_SIMD 0
+#endif
 
 #define VIEWPORT_TOP 8
 #define VIEWPORT_BOTTOM 231
@@ -40,23 +49,66 @@
 #define VIEWPORT_H RESOLUTION_H
 #define VIEWPORT_V (VIEWPORT_BOTTOM - VIEWPORT_TOP + 1)
 
-typedef unsigned char pixel_buffer_t[VIEWPORT_V][VIEWPORT_H][RGB_CHANNELS];
+#define FRAME_SLOT_COUNT 3
+// flag set on the ready slot index while it holds a frame the presenter hasn't picked up yet
+#define FRAME_SLOT_FRESH 0x4
+
+typedef uint32_t pixel_buffer_t[VIEWPORT_V][VIEWPORT_H];
+
+// how much an emphasis bit dims the other two channels when the palette doesn't define emphasis itself
+#define EMPHASIS_ATTENUATION 0.816
+
+typedef void (*PixelConverter)(const uint8_t *src, uint32_t *dst, size_t count, const uint32_t *lut);
+
+static const RGBValue g_default_palette[PALETTE_SIZE] = {
+    {0x66, 0x66, 0x66}, {0x00, 0x1E, 0x9A}, {0x0E, 0x09, 0xA8}, {0x44, 0x00, 0x93},
+    {0x71, 0x00, 0x60}, {0x89, 0x01, 0x1D}, {0x86, 0x13, 0x00}, {0x69, 0x29, 0x00},
+    {0x39, 0x3E, 0x00}, {0x04, 0x4C, 0x00}, {0x00, 0x4F, 0x00}, {0x00, 0x47, 0x2B},
+    {0x00, 0x35, 0x6C}, {0x00, 0x00, 0x00}, {0x00, 0x00, 0x00}, {0x00, 0x00, 0x00},
+    {0xAD, 0xAD, 0xAD}, {0x00, 0x50, 0xF1}, {0x3B, 0x34, 0xFF}, {0x80, 0x22, 0xE8},
+    {0xBB, 0x1E, 0xA5}, {0xDB, 0x29, 0x4E}, {0xD7, 0x40, 0x00}, {0xB1, 0x5E, 0x00},
+    {0x73, 0x79, 0x00}, {0x2D, 0x8B, 0x00}, {0x00, 0x8F, 0x08}, {0x00, 0x84, 0x60},
+    {0x00, 0x6D, 0xB5}, {0x00, 0x00, 0x00}, {0x00, 0x00, 0x00}, {0x00, 0x00, 0x00},
+    {0xFF, 0xFF, 0xFF}, {0x4B, 0xA0, 0xFF}, {0x8A, 0x84, 0xFF}, {0xD1, 0x72, 0xFF},
+    {0xFF, 0x6D, 0xF7}, {0xFF, 0x79, 0x9E}, {0xFF, 0x90, 0x47}, {0xFF, 0xAE, 0x0A},
+    {0xC4, 0xCA, 0x00}, {0x7D, 0xDC, 0x13}, {0x41, 0xE1, 0x57}, {0x21, 0xD5, 0xB0},
+    {0x25, 0xBE, 0xFF}, {0x4F, 0x4F, 0x4F}, {0x00, 0x00, 0x00}, {0x00, 0x00, 0x00},
+    {0xFF, 0xFF, 0xFF}, {0xB6, 0xD8, 0xFF}, {0xD0, 0xCD, 0xFF}, {0xED, 0xC6, 0xFF},
+    {0xFF, 0xC4, 0xFC}, {0xFF, 0xC8, 0xD8}, {0xFF, 0xD2, 0xB4}, {0xFF, 0xDE, 0x9C},
+    {0xE7, 0xE9, 0x94}, {0xCA, 0xF1, 0x9F}, {0xB2, 0xF3, 0xBB}, {0xA5, 0xEE, 0xDF},
+    {0xA6, 0xE5, 0xFF}, {0xB8, 0xB8, 0xB8}, {0x00, 0x00, 0x00}, {0x00, 0x00, 0x00}
+};
+
+// palette loaded with --palette, either the base 64 colors or all 512 emphasis variants
+static RGBValue g_custom_palette[EMPHASIS_COUNT][PALETTE_SIZE];
+static unsigned int g_custom_palette_len = 0;
+
+// one ARGB8888 table per emphasis setting, so converting a pixel is a single load whatever $2001 says
+static uint32_t g_palette_luts[EMPHASIS_COUNT][PALETTE_SIZE];
 
 static SDL_Window *g_window;
 static SDL_Renderer *g_renderer;
 
 static LinkedList g_callbacks = {0};
 
-static RGBValue g_pixel_buffer[RESOLUTION_H][RESOLUTION_V];
+// triple buffer shared between the emulation thread (producer) and the window thread (consumer)
+// each thread exclusively owns one slot, and the third is swapped between them atomically,
+// so neither side ever blocks or copies a frame
+static pixel_buffer_t g_frame_slots[FRAME_SLOT_COUNT];
+static unsigned int g_write_slot = 0; // owned by the emulation thread
+static atomic_uint g_ready_slot = 1; // most recently completed frame, possibly tagged with FRAME_SLOT_FRESH
+static unsigned int g_present_slot = 2; // owned by the window thread
 
-static pixel_buffer_t g_pixel_rgb_data_1;
-static pixel_buffer_t g_pixel_rgb_data_2;
-
-static pixel_buffer_t *g_pixel_buffer_front = &g_pixel_rgb_data_1;
-static pixel_buffer_t *g_pixel_buffer_back = &g_pixel_rgb_data_2;
+// frames overwritten before the presenter picked them up
+static atomic_uint_fast64_t g_dropped_frames = 0;
+// presents which had no new frame to show
+static atomic_uint_fast64_t g_duplicated_frames = 0;
 
 static SDL_Texture *g_texture;
 
+static void _convert_pixels(const uint8_t *src, uint32_t *dst, size_t count, const uint32_t *lut);
+static PixelConverter g_convert_pixels = _convert_pixels;
+
 bool g_close_requested = false;
 
 void _close_listener(SDL_Event *event) {
@@ -94,7 +146,7 @@ void do_window_loop(void) {
     while (true) {
         SDL_Event event;
 
-        if (SDL_PollEvent(&event)) {
+        while (SDL_PollEvent(&event)) {
             LinkedList *item = &g_callbacks;
             do {
                 if (item->value != NULL) {
@@ -130,49 +182,148 @@ void add_event_callback(EventCallback callback) {
     add_to_linked_list(&g_callbacks, (void*) callback);
 }
 
+static void _convert_pixels(const uint8_t *src, uint32_t *dst, size_t count, const uint32_t *lut) {
+    for (size_t i = 0; i < count; i++) {
+        dst[i] = lut[src[i]];
+    }
+}
+
+#if RENDERER_X86_SIMD
+// SSE2 has no gather, so only AVX2 gets its own path
+__attribute__((target("avx2")))
+static void _convert_pixels_avx2(const uint8_t *src, uint32_t *dst, size_t count, const uint32_t *lut) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i indices = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*) &src[i]));
+        __m256i pixels = _mm256_i32gather_epi32((const int*) lut, indices, sizeof(uint32_t));
+        _mm256_storeu_si256((__m256i*) &dst[i], pixels);
+    }
+
+    _convert_pixels(&src[i], &dst[i], count - i, lut);
+}
+#endif
+
+bool load_palette_file(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        printf("Could not open palette file %s (%s)\n", path, strerror(errno));
+        return false;
+    }
+
+    // read one byte past the largest valid size so oversized files are caught
+    uint8_t buf[sizeof(g_custom_palette) + 1];
+    size_t len = fread(buf, 1, sizeof(buf), file);
+    fclose(file);
+
+    if (len != PALETTE_SIZE * sizeof(RGBValue) && len != sizeof(g_custom_palette)) {
+        printf("Palette file %s must contain either %d or %d colors\n", path,
+                PALETTE_SIZE, EMPHASIS_COUNT * PALETTE_SIZE);
+        return false;
+    }
+
+    memcpy(g_custom_palette, buf, len);
+    g_custom_palette_len = len / sizeof(RGBValue);
+
+    return true;
+}
+
+// dims the value once for every emphasis bit set in the given mask
+static uint8_t _attenuate(uint8_t val, unsigned int other_bits) {
+    double res = val;
+    for (; other_bits != 0; other_bits &= other_bits - 1) {
+        res *= EMPHASIS_ATTENUATION;
+    }
+    return (uint8_t) (res + 0.5);
+}
+
+static void _build_palette_luts(void) {
+    const RGBValue *base = g_custom_palette_len > 0 ? g_custom_palette[0] : g_default_palette;
+
+    for (unsigned int emphasis = 0; emphasis < EMPHASIS_COUNT; emphasis++) {
+        for (unsigned int i = 0; i < PALETTE_SIZE; i++) {
+            RGBValue color;
+            if (g_custom_palette_len == EMPHASIS_COUNT * PALETTE_SIZE) {
+                color = g_custom_palette[emphasis][i];
+            } else {
+                // a channel is dimmed by each emphasis bit other than its own, so setting all three darkens everything
+                color.r = _attenuate(base[i].r, emphasis & ~0b001);
+                color.g = _attenuate(base[i].g, emphasis & ~0b010);
+                color.b = _attenuate(base[i].b, emphasis & ~0b100);
+            }
+
+            g_palette_luts[emphasis][i] = 0xFF000000 | (color.r << 16) | (color.g << 8) | color.b;
+        }
+    }
+}
+
 void initialize_renderer(void) {
     printf("Initializing renderer with base resolution %dx%d\n", VIEWPORT_H, VIEWPORT_V);
 
-    g_renderer = SDL_CreateRenderer(get_window(), -1, 0);
+    // present on vsync so the window thread doesn't spin and frame duplication is measured against the display
+    g_renderer = SDL_CreateRenderer(get_window(), -1, SDL_RENDERER_PRESENTVSYNC);
 
     if (!g_renderer) {
         printf("Failed to initialize renderer: %s\n", SDL_GetError());
         exit(-1);
     }
 
-    g_texture = SDL_CreateTexture(g_renderer, SDL_PIXELFORMAT_RGB24, SDL_TEXTUREACCESS_STREAMING,
+    g_texture = SDL_CreateTexture(g_renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
             VIEWPORT_H, VIEWPORT_V);
-}
 
-void set_pixel(unsigned int x, unsigned int y, const RGBValue rgb) {
-    g_pixel_buffer[x][y] = rgb;
+    _build_palette_luts();
+
+    #if RENDERER_X86_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        g_convert_pixels = _convert_pixels_avx2;
+    }
+    #endif
 }
 
-void submit_frame(void) {
-    for (unsigned int x = 0; x < RESOLUTION_H; x++) {
-        for (unsigned int y = 0; y < RESOLUTION_V; y++) {
-            if (y < VIEWPORT_TOP || y > VIEWPORT_BOTTOM) {
-                continue;
-            }
+void submit_frame(uint8_t (*framebuffer)[RESOLUTION_H], const uint8_t *emphasis) {
+    // emphasis is latched per row, so convert runs of rows which share it in one go
+    unsigned int run_start = VIEWPORT_TOP;
+    for (unsigned int y = VIEWPORT_TOP + 1; y <= VIEWPORT_BOTTOM + 1; y++) {
+        if (y <= VIEWPORT_BOTTOM && emphasis[y] == emphasis[run_start]) {
+            continue;
+        }
 
-            const RGBValue rgb = g_pixel_buffer[x][y];
+        g_convert_pixels(framebuffer[run_start], g_frame_slots[g_write_slot][run_start - VIEWPORT_TOP],
+                (y - run_start) * VIEWPORT_H, g_palette_luts[emphasis[run_start]]);
+        run_start = y;
+    }
 
-            (*g_pixel_buffer_back)[y - VIEWPORT_TOP][x][0] = rgb.r;
-            (*g_pixel_buffer_back)[y - VIEWPORT_TOP][x][1] = rgb.g;
-            (*g_pixel_buffer_back)[y - VIEWPORT_TOP][x][2] = rgb.b;
-        }
+    // publish the finished frame and take back whichever slot was waiting
+    unsigned int prev = atomic_exchange_explicit(&g_ready_slot, g_write_slot | FRAME_SLOT_FRESH,
+            memory_order_acq_rel);
+
+    if (prev & FRAME_SLOT_FRESH) {
+        // the presenter never saw the previous frame
+        atomic_fetch_add_explicit(&g_dropped_frames, 1, memory_order_relaxed);
     }
 
-    pixel_buffer_t *new_front = g_pixel_buffer_back;
-    g_pixel_buffer_back = g_pixel_buffer_front;
-    g_pixel_buffer_front = new_front;
-    memcpy(*g_pixel_buffer_back, *g_pixel_buffer_front, sizeof(pixel_buffer_t));
+    g_write_slot = prev & ~FRAME_SLOT_FRESH;
 }
 
 void draw_frame(void) {
-    SDL_UpdateTexture(g_texture, NULL, g_pixel_buffer_front, VIEWPORT_H * RGB_CHANNELS);
+    if (atomic_load_explicit(&g_ready_slot, memory_order_acquire) & FRAME_SLOT_FRESH) {
+        // only the presenter clears the fresh flag, so the slot is guaranteed to still hold a new frame
+        unsigned int prev = atomic_exchange_explicit(&g_ready_slot, g_present_slot, memory_order_acq_rel);
+        g_present_slot = prev & ~FRAME_SLOT_FRESH;
+
+        SDL_UpdateTexture(g_texture, NULL, g_frame_slots[g_present_slot], VIEWPORT_H * sizeof(uint32_t));
+    } else {
+        atomic_fetch_add_explicit(&g_duplicated_frames, 1, memory_order_relaxed);
+    }
 
     SDL_RenderCopy(g_renderer, g_texture, NULL, NULL);
 
     SDL_RenderPresent(g_renderer);
 }
+
+uint64_t get_dropped_frame_count(void) {
+    return atomic_load_explicit(&g_dropped_frames, memory_order_relaxed);
+}
+
+uint64_t get_duplicated_frame_count(void) {
+    return atomic_load_explicit(&g_duplicated_frames, memory_order_relaxed);
+}
@@ -0,0 +1,278 @@
+/*
+ * This file is a part of cNES.
+ * Copyright (c) 2019, Max Roncace <mproncace@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "context.h"
+#include "rewind.h"
+#include "system.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FRAMES_PER_SECOND 60
+
+// the history must cover at least this many frames for rewinding to be of any use
+#define MIN_CAPACITY 2
+
+static size_t _write_varint(unsigned char *out, size_t val) {
+    size_t len = 0;
+    while (val >= 0x80) {
+        out[len++] = (val & 0x7F) | 0x80;
+        val >>= 7;
+    }
+    out[len++] = (unsigned char) val;
+    return len;
+}
+
+static size_t _read_varint(const unsigned char **in) {
+    size_t val = 0;
+    unsigned int shift = 0;
+    unsigned char b;
+    do {
+        b = *(*in)++;
+        val |= (size_t) (b & 0x7F) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    return val;
+}
+
+// encodes cur XOR base as alternating (zero run, literal run) pairs
+// base may be NULL, in which case cur is encoded on its own
+static size_t _encode_delta(const unsigned char *cur, const unsigned char *base, size_t len, unsigned char *out) {
+    unsigned char *out_start = out;
+    size_t i = 0;
+
+    while (i < len) {
+        size_t zero_start = i;
+
+        // most of the state is unchanged from frame to frame, so skip over it a word at a time
+        if (base != NULL) {
+            while (i + sizeof(uint64_t) <= len) {
+                uint64_t a, b;
+                memcpy(&a, cur + i, sizeof(a));
+                memcpy(&b, base + i, sizeof(b));
+                if (a != b) {
+                    break;
+                }
+                i += sizeof(uint64_t);
+            }
+        }
+        while (i < len && (cur[i] ^ (base != NULL ? base[i] : 0)) == 0) {
+            i++;
+        }
+
+        // a literal run only ends at a run of at least two zeros, since a lone zero is cheaper to copy than to encode
+        size_t lit_start = i;
+        while (i < len) {
+            bool zero = (cur[i] ^ (base != NULL ? base[i] : 0)) == 0;
+            bool next_zero = i + 1 >= len || (cur[i + 1] ^ (base != NULL ? base[i + 1] : 0)) == 0;
+            if (zero && next_zero) {
+                break;
+            }
+            i++;
+        }
+
+        out += _write_varint(out, lit_start - zero_start);
+        out += _write_varint(out, i - lit_start);
+        for (size_t j = lit_start; j < i; j++) {
+            *out++ = cur[j] ^ (base != NULL ? base[j] : 0);
+        }
+    }
+
+    return out - out_start;
+}
+
+// applies a delta produced by _encode_delta to base (or to nothing, if base is NULL), writing the result to out
+static void _decode_delta(const unsigned char *in, size_t in_len, const unsigned char *base, size_t len,
+        unsigned char *out) {
+    const unsigned char *in_end = in + in_len;
+    size_t pos = 0;
+
+    while (in < in_end) {
+        size_t zeros = _read_varint(&in);
+        if (base != NULL) {
+            memcpy(out + pos, base + pos, zeros);
+        } else {
+            memset(out + pos, 0, zeros);
+        }
+        pos += zeros;
+
+        size_t lits = _read_varint(&in);
+        for (size_t j = 0; j < lits; j++, pos++) {
+            out[pos] = *in++ ^ (base != NULL ? base[pos] : 0);
+        }
+    }
+
+    if (pos < len) {
+        if (base != NULL) {
+            memcpy(out + pos, base + pos, len - pos);
+        } else {
+            memset(out + pos, 0, len - pos);
+        }
+    }
+}
+
+static void _free_entry(RewindState *rewind, RewindEntry *entry) {
+    rewind->memory_used -= entry->size;
+    free(entry->data);
+    entry->data = NULL;
+}
+
+void rewind_init(unsigned int seconds) {
+    RewindState *rewind = &g_ctx->rewind;
+
+    rewind_deinit();
+
+    if (seconds == 0) {
+        return;
+    }
+
+    rewind->capacity = seconds * FRAMES_PER_SECOND;
+    if (rewind->capacity < MIN_CAPACITY) {
+        rewind->capacity = MIN_CAPACITY;
+    }
+    rewind->entries = (RewindEntry*) calloc(rewind->capacity, sizeof(RewindEntry));
+
+    rewind->state_size = system_get_state_size();
+    rewind->newest_state = (unsigned char*) malloc(rewind->state_size);
+    rewind->scratch_state = (unsigned char*) malloc(rewind->state_size);
+    // worst case is alternating single changed and unchanged bytes, which costs three bytes per pair
+    rewind->encode_buf = (unsigned char*) malloc(rewind->state_size * 2 + 16);
+
+    printf("Keeping %u seconds of rewind history\n", seconds);
+}
+
+void rewind_deinit(void) {
+    RewindState *rewind = &g_ctx->rewind;
+
+    if (rewind->entries == NULL) {
+        return;
+    }
+
+    for (unsigned int i = 0; i < rewind->count; i++) {
+        _free_entry(rewind, &rewind->entries[(rewind->oldest + i) % rewind->capacity]);
+    }
+
+    free(rewind->entries);
+    free(rewind->newest_state);
+    free(rewind->scratch_state);
+    free(rewind->encode_buf);
+
+    rewind->entries = NULL;
+    rewind->count = 0;
+    rewind->oldest = 0;
+}
+
+void rewind_set_active(bool active) {
+    atomic_store(&g_ctx->rewind.active, active);
+}
+
+// the state is taken at the first instruction boundary after the frame ends
+static void _on_frame_saved(void *arg, bool ok) {
+    RewindState *rewind = (RewindState*) arg;
+
+    if (!ok) {
+        return;
+    }
+
+    bool base = rewind->count == 0;
+    size_t size = _encode_delta(rewind->scratch_state, base ? NULL : rewind->newest_state, rewind->state_size,
+            rewind->encode_buf);
+
+    if (rewind->count == rewind->capacity) {
+        // the oldest entry is only needed to step back past it, so it can simply be forgotten
+        _free_entry(rewind, &rewind->entries[rewind->oldest]);
+        rewind->oldest = (rewind->oldest + 1) % rewind->capacity;
+        rewind->count--;
+    }
+
+    RewindEntry *entry = &rewind->entries[(rewind->oldest + rewind->count) % rewind->capacity];
+    entry->data = (unsigned char*) malloc(size);
+    memcpy(entry->data, rewind->encode_buf, size);
+    entry->size = size;
+    entry->base = base;
+
+    rewind->count++;
+    rewind->memory_used += size;
+
+    // swap rather than copy; the scratch buffer's old contents aren't needed
+    unsigned char *tmp = rewind->newest_state;
+    rewind->newest_state = rewind->scratch_state;
+    rewind->scratch_state = tmp;
+}
+
+static void _record_frame(RewindState *rewind) {
+    system_save_state(rewind->scratch_state, rewind->state_size, _on_frame_saved, rewind);
+}
+
+static void _step_back(RewindState *rewind) {
+    if (rewind->count == 0) {
+        return;
+    }
+
+    unsigned int newest_index = (rewind->oldest + rewind->count - 1) % rewind->capacity;
+    RewindEntry *entry = &rewind->entries[newest_index];
+
+    if (entry->base || rewind->count == 1) {
+        // nothing earlier to go back to (or nothing to resume recording from), so hold on the oldest frame
+        system_load_state(rewind->newest_state, rewind->state_size, NULL, NULL);
+        return;
+    }
+
+    // newest XOR (newest XOR previous) = previous
+    _decode_delta(entry->data, entry->size, rewind->newest_state, rewind->state_size, rewind->scratch_state);
+
+    _free_entry(rewind, entry);
+    rewind->count--;
+
+    unsigned char *tmp = rewind->newest_state;
+    rewind->newest_state = rewind->scratch_state;
+    rewind->scratch_state = tmp;
+
+    system_load_state(rewind->newest_state, rewind->state_size, NULL, NULL);
+}
+
+void rewind_on_frame(void) {
+    RewindState *rewind = &g_ctx->rewind;
+
+    // a save or load still waiting for an instruction boundary may be using the buffers, so this frame is skipped
+    if (rewind->entries == NULL || system_is_state_request_pending()) {
+        return;
+    }
+
+    if (atomic_load_explicit(&rewind->active, memory_order_relaxed)) {
+        _step_back(rewind);
+    } else {
+        _record_frame(rewind);
+    }
+}
+
+unsigned int rewind_get_frame_count(void) {
+    return g_ctx->rewind.count;
+}
+
+size_t rewind_get_memory_usage(void) {
+    return g_ctx->rewind.memory_used;
+}
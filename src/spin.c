@@ -0,0 +1,147 @@
+/*
+ * This file is a part of cNES.
+ * Copyright (c) 2019, Max Roncace <mproncace@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "context.h"
+#include "spin.h"
+#include "system.h"
+
+#include "c6502/cpu.h"
+
+#include <string.h>
+
+static bool _regs_equal(const CpuRegisters *a, const CpuRegisters *b) {
+    return a->pc == b->pc
+            && a->sp == b->sp
+            && a->acc == b->acc
+            && a->x == b->x
+            && a->y == b->y
+            && a->status.serial == b->status.serial;
+}
+
+static void _set_head(SpinState *spin, const CpuRegisters *regs) {
+    spin->has_head = true;
+    spin->head = *regs;
+    spin->head_cycle = system_get_cpu_cycles();
+    spin->head_vblanks = g_ctx->stats.vblanks;
+    spin->status_reads = 0;
+}
+
+void spin_on_instruction(CpuRegisters regs) {
+    SpinState *spin = &g_ctx->spin;
+
+    if (!spin->watching || spin->found) {
+        return;
+    }
+
+    if (!spin->has_head) {
+        _set_head(spin, &regs);
+        return;
+    }
+
+    uint64_t period = system_get_cpu_cycles() - spin->head_cycle;
+
+    if (period > SPIN_MAX_PERIOD) {
+        // whatever this is, it's not a short loop starting at the head, so try again from here
+        _set_head(spin, &regs);
+        return;
+    }
+
+    if (period == 0 || !_regs_equal(&regs, &spin->head)) {
+        return;
+    }
+
+    // an NMI edge or a pending IRQ would take the CPU somewhere else, even with the same registers
+    // one $2002 read per iteration is all the system follows
+    if (g_ctx->stats.vblanks != spin->head_vblanks || !system_read_irq_line() || spin->status_reads > 1) {
+        _set_head(spin, &regs);
+        return;
+    }
+
+    spin->found = true;
+    spin->period = (unsigned int) period;
+    spin->polls_status = spin->status_reads != 0;
+    spin->status_offset = (unsigned int) (spin->status_cycle - spin->head_cycle);
+}
+
+static void _stop_watching(SpinState *spin) {
+    spin->watching = false;
+    spin->has_head = false;
+}
+
+void spin_init_state(SpinState *state) {
+    state->enabled = true;
+}
+
+void spin_set_enabled(bool enabled) {
+    SpinState *spin = &g_ctx->spin;
+
+    if (!enabled && spin->watching) {
+        _stop_watching(spin);
+    }
+
+    spin->enabled = enabled;
+    spin->found = false;
+}
+
+void spin_note_write(void) {
+    SpinState *spin = &g_ctx->spin;
+
+    spin->clean_since = system_get_cpu_cycles() + 1;
+    spin->found = false;
+
+    if (spin->watching) {
+        _stop_watching(spin);
+    }
+}
+
+void spin_note_io_read(uint16_t addr, uint8_t val) {
+    SpinState *spin = &g_ctx->spin;
+
+    if (addr >= 0x2000 && addr <= 0x3FFF && addr % 8 == 2) {
+        // the only register which can be read repeatedly without changing anything
+        if (spin->has_head) {
+            spin->status_reads++;
+            spin->status_cycle = system_get_cpu_cycles();
+            spin->status_value = val;
+        }
+        return;
+    }
+
+    spin_note_write();
+}
+
+void spin_start_watching(void) {
+    SpinState *spin = &g_ctx->spin;
+
+    spin->watching = true;
+    spin->has_head = false;
+    system_update_cpu_log();
+}
+
+void spin_reset(void) {
+    g_ctx->spin.clean_since = system_get_cpu_cycles() + 1;
+    g_ctx->spin.found = false;
+    g_ctx->spin.has_head = false;
+}
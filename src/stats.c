@@ -0,0 +1,138 @@
+/*
+ * This file is a part of cNES.
+ * Copyright (c) 2019, Max Roncace <mproncace@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "context.h"
+#include "stats.h"
+#include "system.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define TIMER_CALIBRATION_ROUNDS 64
+
+static const char *g_section_names[STATS_SECTION_COUNT] = {"CPU", "PPU", "Mapper", "Present", "Idle"};
+
+static uint64_t _measure_timer_overhead(void) {
+    uint64_t min_ns = UINT64_MAX;
+    for (int i = 0; i < TIMER_CALIBRATION_ROUNDS; i++) {
+        uint64_t start = now_ns();
+        uint64_t delta = now_ns() - start;
+        if (delta < min_ns) {
+            min_ns = delta;
+        }
+    }
+    return min_ns;
+}
+
+void stats_reset(void) {
+    StatsState *stats = &g_ctx->stats;
+    bool time_sampling = stats->time_sampling;
+
+    memset(stats, 0, sizeof(StatsState));
+
+    stats->time_sampling = time_sampling;
+    stats->sample_countdown = STATS_SAMPLE_INTERVAL;
+    stats->timer_overhead_ns = _measure_timer_overhead();
+    stats->base_cpu_cycles = g_ctx->system.total_cpu_cycles;
+    stats->base_frames = g_ctx->system.frame_count;
+    stats->base_master_clock = g_ctx->system.master_clock;
+    stats->start_us = now_us();
+}
+
+void stats_set_time_sampling(bool enabled) {
+    g_ctx->stats.time_sampling = enabled;
+}
+
+bool stats_is_time_sampling(void) {
+    return g_ctx->stats.time_sampling;
+}
+
+void stats_snapshot(SystemStats *out) {
+    StatsState *stats = &g_ctx->stats;
+
+    out->cpu_cycles = g_ctx->system.total_cpu_cycles - stats->base_cpu_cycles;
+    out->ppu_dots = stats->ppu_dots;
+    out->ppu_idle_dots = stats->ppu_idle_dots;
+    out->spin_cycles = stats->spin_cycles;
+    out->dma_cycles = stats->dma_cycles;
+    out->mapper_events = stats->mapper_events;
+    out->frames = g_ctx->system.frame_count - stats->base_frames;
+    out->vblanks = stats->vblanks;
+    out->master_clock = g_ctx->system.master_clock - stats->base_master_clock;
+    out->wall_us = now_us() - stats->start_us;
+
+    out->time_sampling = stats->time_sampling;
+
+    uint64_t wall_ns = out->wall_us * 1000;
+    uint64_t busy_ns = wall_ns;
+    uint64_t sampled_total_ns = 0;
+    for (int i = 0; i < STATS_SECTION_COUNT; i++) {
+        if (STATS_IS_SAMPLED_SECTION(i)) {
+            sampled_total_ns += stats->measured_ns[i];
+        } else {
+            out->section_ns[i] = stats->measured_ns[i];
+            busy_ns = busy_ns > stats->measured_ns[i] ? busy_ns - stats->measured_ns[i] : 0;
+        }
+    }
+
+    for (int i = 0; i < STATS_SECTION_COUNT; i++) {
+        if (STATS_IS_SAMPLED_SECTION(i)) {
+            out->section_ns[i] = sampled_total_ns > 0
+                    ? (uint64_t) ((double) busy_ns * stats->measured_ns[i] / sampled_total_ns)
+                    : 0;
+        }
+    }
+}
+
+void stats_dump(FILE *out) {
+    SystemStats stats;
+    stats_snapshot(&stats);
+
+    double wall_s = stats.wall_us / 1000000.0;
+    double emulated_s = (double) stats.master_clock / system_get_master_clock_speed();
+
+    fprintf(out, "Emulation stats over %.3f s:\n", wall_s);
+    fprintf(out, "  Speed:        %.1f%% of full speed\n", wall_s > 0 ? emulated_s / wall_s * 100 : 0);
+    fprintf(out, "  Frames:       %llu (%llu vblanks)\n",
+            (unsigned long long) stats.frames, (unsigned long long) stats.vblanks);
+    fprintf(out, "  CPU cycles:   %llu (%llu skipped while spinning)\n",
+            (unsigned long long) stats.cpu_cycles, (unsigned long long) stats.spin_cycles);
+    fprintf(out, "  DMA cycles:   %llu\n", (unsigned long long) stats.dma_cycles);
+    fprintf(out, "  PPU dots:     %llu (%llu skipped while idle)\n",
+            (unsigned long long) stats.ppu_dots, (unsigned long long) stats.ppu_idle_dots);
+    fprintf(out, "  Mapper:       %llu scheduled events\n", (unsigned long long) stats.mapper_events);
+
+    if (!stats.time_sampling) {
+        return;
+    }
+
+    fprintf(out, "  Wall time (sampled 1 in %d clock edges):\n", STATS_SAMPLE_INTERVAL);
+
+    for (int i = 0; i < STATS_SECTION_COUNT; i++) {
+        fprintf(out, "    %-8s %9.3f s  %5.1f%%\n", g_section_names[i], stats.section_ns[i] / 1e9,
+                stats.wall_us > 0 ? stats.section_ns[i] / (stats.wall_us * 10.0) : 0);
+    }
+}
@@ -24,10 +24,15 @@
  */
 
 #include "cartridge.h"
+#include "context.h"
 #include "fs.h"
 #include "ppu.h"
 #include "renderer.h"
+#include "rewind.h"
+#include "spin.h"
+#include "stats.h"
 #include "system.h"
+#include "tracer.h"
 #include "util.h"
 #include "input/input_device.h"
 #include "input/standard/sc_driver.h"
@@ -39,17 +44,18 @@
 #include <assert.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
 #define MAX(a, b) (a > b ? a : b)
+#define MIN(a, b) (a < b ? a : b)
 
-#define LOG_PERFORMANCE 0
 #define PRINT_SYS_MEMORY_ACCESS 0
 #define PRINT_PPU_MEMORY_ACCESS 0
-#define PRINT_INSTRS 0
 
 #define FRAMES_PER_SECOND_NTSC 60.0988
 #define MASTER_CLOCK_SPEED_NTSC 21477272
@@ -70,51 +76,36 @@
 #define SLEEP_INTERVAL 1000 // microseconds
 #define SLEEP_OVERHEAD 70 // microseconds
 
+// where the program which restores the CPU's registers is fed from, anywhere outside the stack page and the vectors
+#define REGS_PROGRAM_ADDR 0x0200
+// how long the reset line is held to start the program, and how long it gets to finish
+#define REGS_RESTORE_RST_CYCLES 4
+#define REGS_RESTORE_MAX_CYCLES 64
+
 #define SRAM_FILE_NAME "sram.bin"
 #define CHIPRAM_FILE_NAME "chipram.bin"
 
-static bool g_halted = false;
-static bool g_stepping = false;
-static bool g_dead = false;
-
-static unsigned char g_system_ram[SYSTEM_MEMORY_SIZE];
-static unsigned char *g_prg_ram;
-static size_t g_prg_ram_size;
-static unsigned char *g_chr_ram;
-static size_t g_chr_ram_size;
-
-static unsigned char *g_chip_ram = NULL;
-static size_t g_chip_ram_size = 0;
-
-static Cartridge *g_cart;
-
-static TvSystem g_tv_system;
-static uint64_t g_master_clock_speed;
-static uint64_t g_cpu_clock_divider;
-static uint64_t g_ppu_clock_divider;
-static uint64_t g_clock_divider_cd;
-
-static uint8_t g_bus_val; // the value on the data bus
+static void _do_system_loop_ntsc(void);
+static void _do_system_loop_pal(void);
+static void _do_system_loop_dendy(void);
 
-static uint8_t g_cycle_index = 0;
-static uint64_t g_total_cpu_cycles = 7; // the initial reset's cycles aren't counted automatically
+static uint8_t _regs_restore_read(uint16_t addr);
 
-static bool g_dma_in_progress;
-static uint8_t g_dma_page;
-static unsigned int g_dma_step;
-
-static unsigned int (*g_nmi_line_callback)(void);
-static unsigned int (*g_irq_line_callback)(void);
-static unsigned int (*g_rst_line_callback)(void);
+void system_init_state(SystemState *state) {
+    state->throttle = THROTTLE_SPEED;
+    state->ppu_catch_up = true;
+    state->mapper_event_edge = UINT64_MAX;
+    state->total_cpu_cycles = 7; // the initial reset's cycles aren't counted automatically
+    state->nmi_line_seen = 1;
+    state->vector_read_cycle = state->total_cpu_cycles;
+}
 
-static int g_rst_cycles = 0;
+static void _headless_sc_init(void) {
+}
 
-#if PRINT_INSTRS
-// snapshots for logging
-static unsigned int g_total_cycles_snapshot;
-static uint16_t g_ppu_scanline_snapshot;
-static uint16_t g_ppu_scanline_tick_snapshot;
-#endif
+static void _headless_sc_poll(unsigned int controller_id) {
+    // no input source, so the buttons just stay released
+}
 
 static void _init_controllers() {
     init_controllers();
@@ -122,82 +113,97 @@ static void _init_controllers() {
     controller_connect(create_standard_controller(0));
     controller_connect(create_standard_controller(1));
 
-    sc_attach_driver(sc_init, sc_poll_input);
+    if (g_ctx->system.headless) {
+        sc_attach_driver(_headless_sc_init, _headless_sc_poll);
+    } else {
+        sc_attach_driver(sc_init, sc_poll_input);
+    }
 }
 
 static void _write_prg_nvram(Cartridge *cart) {
     printf("Saving SRAM to disk\n");
-    write_game_data(g_cart->title, SRAM_FILE_NAME, g_prg_ram, cart->prg_nvram_size);
-    if (g_chip_ram_size != 0) {
-        write_game_data(g_cart->title, CHIPRAM_FILE_NAME, g_chip_ram, g_chip_ram_size);
+    write_game_data(g_ctx->system.cart->title, SRAM_FILE_NAME, g_ctx->system.prg_ram, cart->prg_nvram_size);
+    if (g_ctx->system.chip_ram_size != 0) {
+        write_game_data(g_ctx->system.cart->title, CHIPRAM_FILE_NAME, g_ctx->system.chip_ram, g_ctx->system.chip_ram_size);
     }
 }
 
-#if PRINT_INSTRS
-static void _print_last_instr(char *instr_str, CpuRegisters *regs_snapshot) {
-    printf("%04X  %s  (a=%02X,x=%02X,y=%02X,sp=%02X,p=%02X,cyc=%d,ppu=%03d,%03d)\n",
-            regs_snapshot->pc,
-            instr_str,
-            regs_snapshot->acc,
-            regs_snapshot->x,
-            regs_snapshot->y,
-            regs_snapshot->sp,
-            regs_snapshot->status.serial,
-            g_total_cycles_snapshot,
-            g_ppu_scanline_snapshot,
-            g_ppu_scanline_tick_snapshot);
-}
+// does a whole transfer at once and stalls the CPU for as long as it would have taken, if nothing could tell the
+// difference (i.e. reading the page has no side effects and the PPU won't look at OAM until the CPU is back)
+static bool _try_bulk_dma(void) {
+    const uint8_t *page = g_ctx->system.memory_map.read_pages[g_ctx->system.dma_page];
+    if (page == NULL || g_ctx->system.stepping) {
+        return false;
+    }
 
-static void _log_callback(char *instr_str, CpuRegisters regs_snapshot) {
-    _print_last_instr(instr_str, &regs_snapshot);
-    
-    // store snapshots for logging
-    g_total_cycles_snapshot = g_total_cpu_cycles;
-    g_ppu_scanline_snapshot = ppu_get_scanline();
-    g_ppu_scanline_tick_snapshot = ppu_get_scanline_tick();
-}
-#endif
+    // a dummy cycle, another one if the transfer would otherwise start on a write cycle, then 256 reads and writes
+    uint64_t cycles = 513 + (g_ctx->system.total_cpu_cycles + 1) % 2;
 
-static uint64_t now_us() {
-    struct timespec now;
-    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
-    return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+    if (g_ctx->system.cycle_limit != 0 && g_ctx->system.total_cpu_cycles + cycles > g_ctx->system.cycle_limit) {
+        return false;
+    }
+
+    // the PPU goes first on the edge the CPU comes back on, so that dot has to be idle too
+    uint64_t end_edge = g_ctx->system.master_clock + cycles * g_ctx->system.cpu_clock_divider;
+    uint64_t dots = (end_edge - g_ctx->system.ppu_synced_edge) / g_ctx->system.ppu_clock_divider + 1;
+    if (ppu_get_idle_dots() < dots) {
+        return false;
+    }
+
+    ppu_push_dma_page(page);
+    g_ctx->system.bus_val = page[(uint8_t) (ppu_get_internal_regs()->s - 1)];
+    g_ctx->system.dma_in_progress = false;
+
+    // the loop accounts for the current cycle as usual
+    g_ctx->system.next_cpu_edge += (cycles - 1) * g_ctx->system.cpu_clock_divider;
+    g_ctx->system.total_cpu_cycles += cycles - 1;
+    g_ctx->stats.dma_cycles += cycles - 1;
+
+    return true;
 }
 
 static void _handle_dma(void) {
+    // sprite fetching resets the OAM address, and the PPU has to see each byte land at the right time
+    system_sync_ppu();
+
+    if (g_ctx->system.dma_step == 0 && _try_bulk_dma()) {
+        return;
+    }
+
     uint8_t index = ppu_get_internal_regs()->s;
-    if (g_dma_step == 0) {
+    if (g_ctx->system.dma_step == 0) {
         // dummy read
-        system_memory_read((g_dma_page << 8) | index);
+        system_memory_read((g_ctx->system.dma_page << 8) | index);
     } else {
-        if (g_dma_step == 1) {
-            g_dma_step++; // advance cycle count regardless of whether we skip or not
+        if (g_ctx->system.dma_step == 1) {
+            g_ctx->system.dma_step++; // advance cycle count regardless of whether we skip or not
             // skip cycle if cycle count is odd
-            if (g_total_cpu_cycles % 2) {
+            if (g_ctx->system.total_cpu_cycles % 2) {
                 return;
             }
         }
 
-        if (g_dma_step % 2) {
+        if (g_ctx->system.dma_step % 2) {
             // write
-            ppu_push_dma_byte(g_bus_val);
+            ppu_push_dma_byte(g_ctx->system.bus_val);
         } else {
             // read
-            g_bus_val = system_memory_read((g_dma_page << 8) | index);
+            g_ctx->system.bus_val = system_memory_read((g_ctx->system.dma_page << 8) | index);
         }
     }
 
-    if (++g_dma_step > 514) {
-        g_dma_in_progress = false;
+    // the last cycle is the final write
+    if (++g_ctx->system.dma_step > 513) {
+        g_ctx->system.dma_in_progress = false;
     }
 }
 
 static unsigned int _internal_rst_connection(void) {
-    return g_rst_cycles > 0 ? 0 : 1;
+    return g_ctx->system.master_clock < g_ctx->system.rst_deadline ? 0 : 1;
 }
 
 void initialize_system(Cartridge *cart) {
-    g_cart = cart;
+    g_ctx->system.cart = cart;
 
     system_connect_rst_line(_internal_rst_connection);
 
@@ -205,60 +211,62 @@ void initialize_system(Cartridge *cart) {
         case TIMING_MODE_NTSC:
         case TIMING_MODE_MULTI:
             printf("Using NTSC system timing\n");
-            g_tv_system = TV_SYSTEM_NTSC;
-            g_master_clock_speed = MASTER_CLOCK_SPEED_NTSC;
-            g_cpu_clock_divider = CPU_CLOCK_DIVIDER_NTSC;
-            g_ppu_clock_divider = PPU_CLOCK_DIVIDER_NTSC;
+            g_ctx->system.tv_system = TV_SYSTEM_NTSC;
+            g_ctx->system.master_clock_speed = MASTER_CLOCK_SPEED_NTSC;
+            g_ctx->system.cpu_clock_divider = CPU_CLOCK_DIVIDER_NTSC;
+            g_ctx->system.ppu_clock_divider = PPU_CLOCK_DIVIDER_NTSC;
+            g_ctx->system.loop_func = _do_system_loop_ntsc;
             break;
         case TIMING_MODE_PAL:
             printf("Using PAL system timing\n");
-            g_tv_system = TV_SYSTEM_PAL;
-            g_master_clock_speed = MASTER_CLOCK_SPEED_PAL;
-            g_cpu_clock_divider = CPU_CLOCK_DIVIDER_PAL;
-            g_ppu_clock_divider = PPU_CLOCK_DIVIDER_PAL;
+            g_ctx->system.tv_system = TV_SYSTEM_PAL;
+            g_ctx->system.master_clock_speed = MASTER_CLOCK_SPEED_PAL;
+            g_ctx->system.cpu_clock_divider = CPU_CLOCK_DIVIDER_PAL;
+            g_ctx->system.ppu_clock_divider = PPU_CLOCK_DIVIDER_PAL;
+            g_ctx->system.loop_func = _do_system_loop_pal;
             break;
         case TIMING_MODE_DENDY:
             printf("Using Dendy system timing\n");
-            g_tv_system = TV_SYSTEM_DENDY;
-            g_master_clock_speed = MASTER_CLOCK_SPEED_DENDY;
-            g_cpu_clock_divider = CPU_CLOCK_DIVIDER_DENDY;
-            g_ppu_clock_divider = PPU_CLOCK_DIVIDER_DENDY;
+            g_ctx->system.tv_system = TV_SYSTEM_DENDY;
+            g_ctx->system.master_clock_speed = MASTER_CLOCK_SPEED_DENDY;
+            g_ctx->system.cpu_clock_divider = CPU_CLOCK_DIVIDER_DENDY;
+            g_ctx->system.ppu_clock_divider = PPU_CLOCK_DIVIDER_DENDY;
+            g_ctx->system.loop_func = _do_system_loop_dendy;
             break;
         default:
             printf("Unhandled case %d\n", cart->timing_mode);
             exit(1);
     }
 
-    g_clock_divider_cd = g_cpu_clock_divider * g_ppu_clock_divider;
-
     if (cart->prg_ram_size > 0) {
-        g_prg_ram_size = cart->prg_ram_size;
+        g_ctx->system.prg_ram_size = cart->prg_ram_size;
     } else if (cart->prg_nvram_size > 0) {
-        g_prg_ram_size = cart->prg_nvram_size;
+        g_ctx->system.prg_ram_size = cart->prg_nvram_size;
     }
-    if (g_prg_ram_size > 0) {
-        g_prg_ram = (unsigned char*) malloc(g_prg_ram_size);
+    if (g_ctx->system.prg_ram_size > 0) {
+        g_ctx->system.prg_ram = (unsigned char*) calloc(1, g_ctx->system.prg_ram_size);
     }
 
     if (cart->chr_ram_size > 0) {
-        g_chr_ram_size = cart->chr_ram_size;
+        g_ctx->system.chr_ram_size = cart->chr_ram_size;
     } else if (cart->chr_nvram_size > 0) {
-        g_chr_ram_size = cart->chr_nvram_size;
+        g_ctx->system.chr_ram_size = cart->chr_nvram_size;
     }
-    if (g_chr_ram_size > 0) {
-        g_chr_ram = (unsigned char*) malloc(g_chr_ram_size);
+    if (g_ctx->system.chr_ram_size > 0) {
+        g_ctx->system.chr_ram = (unsigned char*) calloc(1, g_ctx->system.chr_ram_size);
     }
 
-    if (g_cart->has_nv_ram && g_cart->prg_nvram_size > 0) {
-        unsigned char *prg_ram_tmp = malloc(g_prg_ram_size);
-        if (read_game_data(cart->title, SRAM_FILE_NAME, prg_ram_tmp, g_prg_ram_size, true)) {
+    // headless runs neither load nor persist save data so that their results are reproducible
+    if (!g_ctx->system.headless && g_ctx->system.cart->has_nv_ram && g_ctx->system.cart->prg_nvram_size > 0) {
+        unsigned char *prg_ram_tmp = malloc(g_ctx->system.prg_ram_size);
+        if (read_game_data(cart->title, SRAM_FILE_NAME, prg_ram_tmp, g_ctx->system.prg_ram_size, true)) {
             printf("Loading SRAM from disk\n");
-            memcpy(g_prg_ram, prg_ram_tmp, g_prg_ram_size);
+            memcpy(g_ctx->system.prg_ram, prg_ram_tmp, g_ctx->system.prg_ram_size);
         }
         free(prg_ram_tmp);
     }
 
-    memset(g_system_ram, 0x00, SYSTEM_MEMORY_SIZE);
+    memset(g_ctx->system.ram, 0x00, SYSTEM_MEMORY_SIZE);
 
     initialize_cpu((CpuSystemInterface){
             system_memory_read,
@@ -269,77 +277,142 @@ void initialize_system(Cartridge *cart) {
             system_read_irq_line,
             system_read_rst_line
     });
+    // internal RAM is mirrored up to $1FFF
+    for (uint16_t addr = 0x0000; addr < 0x2000; addr += SYSTEM_MEMORY_SIZE) {
+        system_map_memory(addr, SYSTEM_MEMORY_SIZE, g_ctx->system.ram, g_ctx->system.ram);
+    }
+
     initialize_ppu();
-    ppu_set_mirroring_mode(g_cart->four_screen_mode
+    ppu_set_mirroring_mode(g_ctx->system.cart->four_screen_mode
             ? MIRROR_FOUR_SCREEN
-            : g_cart->mirror_mode
+            : g_ctx->system.cart->mirror_mode
                 ? MIRROR_VERTICAL
                 : MIRROR_HORIZONTAL);
 
+    // the mapper may connect interrupt lines or register RAM, so it can only be set up once the system is
+    if (cart->mapper->init_func != NULL) {
+        cart->mapper->init_func(cart);
+    }
+
+    system_remap_banks();
+
     _init_controllers();
 
-    g_dma_page = 0xFF;
+    g_ctx->system.dma_page = 0xFF;
 
-    #if PRINT_INSTRS
-    cpu_set_log_callback(_log_callback);
-    #endif
+    stats_reset();
 }
 
 TvSystem system_get_tv_system(void) {
-    return g_tv_system;
+    return g_ctx->system.tv_system;
+}
+
+void system_set_headless(bool headless) {
+    g_ctx->system.headless = headless;
+}
+
+bool system_is_headless(void) {
+    return g_ctx->system.headless;
+}
+
+void system_set_throttle(bool throttle) {
+    g_ctx->system.throttle = throttle;
+}
+
+void system_set_ppu_catch_up(bool catch_up) {
+    g_ctx->system.ppu_catch_up = catch_up;
+}
+
+void system_set_chr_open_bus(bool open_bus) {
+    g_ctx->system.chr_open_bus = open_bus;
+}
+
+void system_set_frame_limit(uint64_t frames) {
+    g_ctx->system.frame_limit = frames;
+}
+
+void system_set_cycle_limit(uint64_t cycles) {
+    g_ctx->system.cycle_limit = cycles;
+}
+
+uint64_t system_get_frame_count(void) {
+    return g_ctx->system.frame_count;
+}
+
+uint64_t system_get_cpu_cycles(void) {
+    return g_ctx->system.total_cpu_cycles;
+}
+
+uint64_t system_get_master_clock_speed(void) {
+    return g_ctx->system.master_clock_speed;
 }
 
 unsigned int system_read_nmi_line(void) {
-    return g_nmi_line_callback != NULL ? g_nmi_line_callback() : 1;
+    unsigned int line = g_ctx->system.nmi_line_callback != NULL ? g_ctx->system.nmi_line_callback() : 1;
+
+    if (line < g_ctx->system.nmi_line_seen) {
+        g_ctx->system.nmi_fall_cycle = g_ctx->system.total_cpu_cycles;
+    }
+    g_ctx->system.nmi_line_seen = line;
+
+    return line;
 }
 
 unsigned int system_read_irq_line(void) {
-    return g_irq_line_callback != NULL ? g_irq_line_callback() : 1;
+    return g_ctx->system.irq_line_callback != NULL ? g_ctx->system.irq_line_callback() : 1;
 }
 
 unsigned int system_read_rst_line(void) {
-    return g_rst_line_callback != NULL ? g_rst_line_callback() : 1;
+    return g_ctx->system.rst_line_callback != NULL ? g_ctx->system.rst_line_callback() : 1;
 }
 
 uint8_t system_bus_read(void) {
-    return g_bus_val;
+    return g_ctx->system.bus_val;
 }
 
 void system_bus_write(uint8_t val) {
-    g_bus_val = val;
+    g_ctx->system.bus_val = val;
 }
 
 uint8_t system_prg_ram_read(uint16_t addr) {
-    return addr < g_prg_ram_size ? g_prg_ram[addr] : g_bus_val;
+    return addr < g_ctx->system.prg_ram_size ? g_ctx->system.prg_ram[addr] : g_ctx->system.bus_val;
 }
 
 void system_prg_ram_write(uint16_t addr, uint8_t val) {
-    if (addr < g_prg_ram_size) {
-        g_prg_ram[addr] = val;
+    if (addr < g_ctx->system.prg_ram_size) {
+        g_ctx->system.prg_ram[addr] = val;
     }
-    g_bus_val = val;
+    g_ctx->system.bus_val = val;
 }
 
 uint8_t system_chr_ram_read(uint16_t addr) {
-    return addr < g_chr_ram_size ? g_chr_ram[addr] : g_bus_val;
+    if (addr >= g_ctx->system.chr_ram_size) {
+        return g_ctx->system.bus_val;
+    }
+
+    return g_ctx->system.chr_ram[addr];
 }
 
 void system_chr_ram_write(uint16_t addr, uint8_t val) {
-    if (addr < g_chr_ram_size) {
-        g_chr_ram[addr] = val;
+    if (addr < g_ctx->system.chr_ram_size) {
+        g_ctx->system.chr_ram[addr] = val;
     }
-    g_bus_val = val;
+    g_ctx->system.bus_val = val;
 }
 
 void system_register_chip_ram(Cartridge *cart, unsigned char *ram, size_t size) {
     printf("Registering chip RAM for cartridge\n");
-    g_chip_ram = ram;
-    g_chip_ram_size = size;
+    g_ctx->system.chip_ram = ram;
+    g_ctx->system.chip_ram_size = size;
 
-    unsigned char *chip_ram_tmp = malloc(g_chip_ram_size);
-    if (read_game_data(cart->title, CHIPRAM_FILE_NAME, chip_ram_tmp, g_chip_ram_size, true)) {
+    if (g_ctx->system.headless) {
+        return;
+    }
+
+    unsigned char *chip_ram_tmp = malloc(g_ctx->system.chip_ram_size);
+    if (read_game_data(cart->title, CHIPRAM_FILE_NAME, chip_ram_tmp, g_ctx->system.chip_ram_size, true)) {
         printf("Loading chip RAM from disk\n");
-        memcpy(g_chip_ram, chip_ram_tmp, g_chip_ram_size);
+        memcpy(g_ctx->system.chip_ram, chip_ram_tmp, g_ctx->system.chip_ram_size);
     }
     free(chip_ram_tmp);
 }
@@ -347,44 +420,131 @@ void system_register_chip_ram(Cartridge *cart, unsigned char *ram, size_t size)
 void system_ram_init(void) {
     srand(time(0));
     for (size_t i = 0; i < SYSTEM_MEMORY_SIZE; i++) {
-        g_system_ram[i] = rand();
+        g_ctx->system.ram[i] = rand();
     }
 }
 
 uint8_t system_ram_read(uint16_t addr) {
     assert(addr < SYSTEM_MEMORY_SIZE);
-    return g_system_ram[addr];
+    return g_ctx->system.ram[addr];
 }
 
 void system_ram_write(uint16_t addr, uint8_t val) {
     assert(addr < SYSTEM_MEMORY_SIZE);
-    g_system_ram[addr] = val;
+    g_ctx->system.ram[addr] = val;
 }
 
 uint8_t system_memory_read(uint16_t addr) {
-    uint8_t res = g_cart->mapper->ram_read_func(g_cart, addr);
+    const uint8_t *page = g_ctx->system.memory_map.read_pages[addr / CPU_PAGE_SIZE];
+
+    // the CPU only reads the vectors when it takes an interrupt (or runs BRK)
+    if (addr >= 0xFFFA) {
+        g_ctx->system.vector_read_cycle = g_ctx->system.total_cpu_cycles;
+    }
+
+    uint8_t res;
+    if (page != NULL) {
+        res = page[addr % CPU_PAGE_SIZE];
+    } else {
+        if (g_ctx->system.regs_restore.active) {
+            return _regs_restore_read(addr);
+        }
+
+        res = g_ctx->system.cart->mapper->ram_read_func(g_ctx->system.cart, addr);
+        spin_note_io_read(addr, res);
+    }
 
     #if PRINT_SYS_MEMORY_ACCESS
     printf("$%04X -> %02X\n", addr, res);
     #endif
 
-    g_bus_val = res;
+    g_ctx->system.bus_val = res;
 
     return res;
 }
 
+uint8_t system_peek_memory(uint16_t addr) {
+    // only RAM and cartridge space can be read without side effects
+    const uint8_t *page = g_ctx->system.memory_map.read_pages[addr / CPU_PAGE_SIZE];
+
+    if (page != NULL) {
+        return page[addr % CPU_PAGE_SIZE];
+    } else if (addr < 0x2000) {
+        return g_ctx->system.ram[addr % SYSTEM_MEMORY_SIZE];
+    } else if (addr >= 0x6000) {
+        return g_ctx->system.cart->mapper->ram_read_func(g_ctx->system.cart, addr);
+    } else {
+        return 0;
+    }
+}
+
 void system_memory_write(uint16_t addr, uint8_t val) {
     #if PRINT_SYS_MEMORY_ACCESS
     printf("$%04X <- %02X\n", addr, val);
     #endif
 
-    g_cart->mapper->ram_write_func(g_cart, addr, val);
+    uint8_t *page = g_ctx->system.memory_map.write_pages[addr / CPU_PAGE_SIZE];
+
+    spin_note_write();
+
+    if (page != NULL) {
+        page[addr % CPU_PAGE_SIZE] = val;
+    } else {
+        if (g_ctx->system.regs_restore.active) {
+            return;
+        }
+
+        // mapper registers can switch CHR banks or mirroring out from under the PPU
+        if (addr >= 0x4020) {
+            system_sync_ppu();
+        }
+
+        g_ctx->system.cart->mapper->ram_write_func(g_ctx->system.cart, addr, val);
+    }
 
-    g_bus_val = val;
+    g_ctx->system.bus_val = val;
+}
+
+// maps len bytes (a multiple of CPU_PAGE_SIZE) starting at addr; either pointer may be NULL to leave it to the mapper
+void system_map_memory(uint16_t addr, size_t len, const uint8_t *read_mem, uint8_t *write_mem) {
+    assert(addr % CPU_PAGE_SIZE == 0 && len % CPU_PAGE_SIZE == 0);
+    assert(addr + len <= CPU_PAGE_SIZE * CPU_PAGE_COUNT);
+
+    CpuMemoryMap *map = &g_ctx->system.memory_map;
+
+    for (size_t offset = 0; offset < len; offset += CPU_PAGE_SIZE) {
+        unsigned int page = (addr + offset) / CPU_PAGE_SIZE;
+        map->read_pages[page] = read_mem != NULL ? read_mem + offset : NULL;
+        map->write_pages[page] = write_mem != NULL ? write_mem + offset : NULL;
+    }
+}
+
+// maps PRG RAM into $6000-$7FFF, leaving any part beyond the cartridge's RAM as open bus
+void system_map_prg_ram(uint16_t addr, size_t len, bool writable) {
+    assert(addr >= 0x6000 && addr + len <= 0x8000);
+
+    for (size_t offset = 0; offset < len; offset += CPU_PAGE_SIZE) {
+        size_t ram_offset = addr + offset - 0x6000;
+
+        if (ram_offset < g_ctx->system.prg_ram_size) {
+            unsigned char *mem = &g_ctx->system.prg_ram[ram_offset];
+            system_map_memory(addr + offset, CPU_PAGE_SIZE, mem, writable ? mem : NULL);
+        } else {
+            system_map_memory(addr + offset, CPU_PAGE_SIZE, NULL, NULL);
+        }
+    }
+}
+
+void system_remap_banks(void) {
+    Mapper *mapper = g_ctx->system.cart->mapper;
+
+    if (mapper->remap_func != NULL) {
+        mapper->remap_func(g_ctx->system.cart);
+    }
 }
 
 uint8_t system_vram_read(uint16_t addr) {
-    uint8_t res = g_cart->mapper->vram_read_func(g_cart, addr);
+    uint8_t res = g_ctx->system.cart->mapper->vram_read_func(g_ctx->system.cart, addr);
 
     #if PRINT_PPU_MEMORY_ACCESS
     printf("$%04X -> %02X\n", addr, res);
@@ -398,7 +558,12 @@ void system_vram_write(uint16_t addr, uint8_t val) {
     printf("$%04X <- %02X\n", addr, val);
     #endif
 
-    g_cart->mapper->vram_write_func(g_cart, addr, val);
+    g_ctx->system.cart->mapper->vram_write_func(g_ctx->system.cart, addr, val);
+
+    // covers CHR-RAM as well as nametable RAM, which some mappers can page into the pattern tables
+    if ((addr & 0x3FFF) < 0x3F00) {
+        ppu_note_vram_write(addr & 0x3FFF);
+    }
 }
 
 uint8_t system_lower_memory_read(uint16_t addr) {
@@ -407,6 +572,7 @@ uint8_t system_lower_memory_read(uint16_t addr) {
     if (addr >= 0x0000 && addr <= 0x1FFF) {
         return system_ram_read(addr % SYSTEM_MEMORY_SIZE);
     } else if (addr >= 0x2000 && addr <= 0x3FFF) {
+        system_sync_ppu();
         return ppu_read_mmio((uint8_t) (addr % 8));
         } else if (addr == 0x4014) {
         //TODO: DMA register
@@ -429,6 +595,7 @@ void system_lower_memory_write(uint16_t addr, uint8_t val) {
         return;
     }
     else if (addr >= 0x2000 && addr <= 0x3FFF) {
+        system_sync_ppu();
         ppu_write_mmio((uint8_t) (addr % 8), val);
         return;
     } else if (addr == 0x4014) {
@@ -455,158 +622,933 @@ void system_dump_ram(void) {
         return;
     }
 
-    fwrite(g_system_ram, SYSTEM_MEMORY_SIZE, 1, out_file);
+    fwrite(g_ctx->system.ram, SYSTEM_MEMORY_SIZE, 1, out_file);
 
     fclose(out_file);
 }
 
+// the subset of SystemState which changes as the console runs
+// the rest is either configuration, derived from the cartridge, or a pointer
+// the frame count isn't included since it tracks how long the session has run (e.g. for frame limits)
+typedef struct {
+    uint64_t master_clock;
+    uint64_t next_cpu_edge;
+    uint64_t next_ppu_edge;
+    uint64_t mapper_event_edge;
+    uint64_t rst_deadline;
+    uint64_t total_cpu_cycles;
+    uint32_t dma_step;
+    uint8_t dma_page;
+    uint8_t dma_in_progress;
+    uint8_t bus_val;
+    // as of the start of the next instruction
+    CpuRegisters cpu_regs;
+} SavedSystemRegs;
+
+static void _state_put(unsigned char **cursor, const void *src, size_t len) {
+    memcpy(*cursor, src, len);
+    *cursor += len;
+}
+
+static void _state_get(const unsigned char **cursor, void *dst, size_t len) {
+    memcpy(dst, *cursor, len);
+    *cursor += len;
+}
+
+size_t system_get_state_size(void) {
+    size_t size = sizeof(SaveStateHeader)
+            + sizeof(SavedSystemRegs)
+            + SYSTEM_MEMORY_SIZE
+            + g_ctx->system.prg_ram_size
+            + g_ctx->system.chr_ram_size
+            + sizeof(PpuState)
+            + g_ctx->system.cart->mapper->state_size;
+
+    for (unsigned int i = 0; i < 2; i++) {
+        Controller *controller = get_controller(i);
+        size += sizeof(uint32_t) + (controller != NULL ? controller->state_size : 0);
+    }
+
+    return size;
+}
+
+// the CPU's registers are left out, since they're only known once the CPU has run the next instruction
+static void _write_state(void *buf) {
+    // the saved PPU has to match the saved clock
+    system_sync_ppu();
+    ppu_flush_sprite_cache();
+
+    unsigned char *cursor = (unsigned char*) buf;
+
+    SaveStateHeader header = {0};
+    memcpy(header.magic, SAVE_STATE_MAGIC, sizeof(SAVE_STATE_MAGIC));
+    header.version = SAVE_STATE_VERSION;
+    header.size = system_get_state_size();
+    header.mapper_id = g_ctx->system.cart->mapper->id;
+    _state_put(&cursor, &header, sizeof(header));
+
+    SavedSystemRegs regs = {0};
+    regs.master_clock = g_ctx->system.master_clock;
+    regs.next_cpu_edge = g_ctx->system.next_cpu_edge;
+    regs.next_ppu_edge = g_ctx->system.next_ppu_edge;
+    regs.mapper_event_edge = g_ctx->system.mapper_event_edge;
+    regs.rst_deadline = g_ctx->system.rst_deadline;
+    regs.total_cpu_cycles = g_ctx->system.total_cpu_cycles;
+    regs.dma_step = g_ctx->system.dma_step;
+    regs.dma_page = g_ctx->system.dma_page;
+    regs.dma_in_progress = g_ctx->system.dma_in_progress;
+    regs.bus_val = g_ctx->system.bus_val;
+    _state_put(&cursor, &regs, sizeof(regs));
+
+    _state_put(&cursor, g_ctx->system.ram, SYSTEM_MEMORY_SIZE);
+    _state_put(&cursor, g_ctx->system.prg_ram, g_ctx->system.prg_ram_size);
+    _state_put(&cursor, g_ctx->system.chr_ram, g_ctx->system.chr_ram_size);
+
+    _state_put(&cursor, &g_ctx->ppu, sizeof(PpuState));
+
+    for (unsigned int i = 0; i < 2; i++) {
+        Controller *controller = get_controller(i);
+        uint32_t type = controller != NULL ? controller->type : CONTROLLER_TYPE_NONE;
+        _state_put(&cursor, &type, sizeof(type));
+        if (controller != NULL) {
+            _state_put(&cursor, controller->state, controller->state_size);
+        }
+    }
+
+    Mapper *mapper = g_ctx->system.cart->mapper;
+    _state_put(&cursor, mapper->state, mapper->state_size);
+}
+
+static bool _check_state(const void *buf, size_t buf_len) {
+    if (buf_len < sizeof(SaveStateHeader)) {
+        return false;
+    }
+
+    const unsigned char *cursor = (const unsigned char*) buf;
+
+    SaveStateHeader header;
+    _state_get(&cursor, &header, sizeof(header));
+
+    if (memcmp(header.magic, SAVE_STATE_MAGIC, sizeof(SAVE_STATE_MAGIC)) != 0) {
+        printf("Not a save state\n");
+        return false;
+    }
+
+    if (header.version != SAVE_STATE_VERSION) {
+        printf("Unsupported save state version %u\n", header.version);
+        return false;
+    }
+
+    // the layout depends on the cartridge, so a matching size is a good indicator that the state is for this game
+    if (header.mapper_id != g_ctx->system.cart->mapper->id
+            || header.size != system_get_state_size()
+            || buf_len < header.size) {
+        printf("Save state does not match the loaded cartridge\n");
+        return false;
+    }
+
+    cursor += sizeof(SavedSystemRegs) + SYSTEM_MEMORY_SIZE
+            + g_ctx->system.prg_ram_size + g_ctx->system.chr_ram_size + sizeof(PpuState);
+    for (unsigned int i = 0; i < 2; i++) {
+        Controller *controller = get_controller(i);
+        uint32_t type;
+        _state_get(&cursor, &type, sizeof(type));
+        if (type != (controller != NULL ? controller->type : CONTROLLER_TYPE_NONE)) {
+            printf("Save state was made with different controllers connected\n");
+            return false;
+        }
+        cursor += controller != NULL ? controller->state_size : 0;
+    }
+
+    return true;
+}
+
+static unsigned int _regs_restore_irq_line(void) {
+    return 1;
+}
+
+// held low throughout so the CPU doesn't see an edge once the real line is back, whichever way it was restored
+static unsigned int _regs_restore_nmi_line(void) {
+    return 0;
+}
+
+static unsigned int _regs_restore_rst_line(void) {
+    return g_ctx->system.regs_restore.cycles < REGS_RESTORE_RST_CYCLES ? 0 : 1;
+}
+
+// every read the CPU makes while its registers are being restored ends up here
+static uint8_t _regs_restore_read(uint16_t addr) {
+    CpuRegsRestore *restore = &g_ctx->system.regs_restore;
+
+    if (addr >= REGS_PROGRAM_ADDR && addr < REGS_PROGRAM_ADDR + REGS_PROGRAM_SIZE) {
+        // the last byte is the operand of the final jump, after which the CPU is exactly where the state left it
+        if (addr == REGS_PROGRAM_ADDR + REGS_PROGRAM_SIZE - 1) {
+            restore->done = true;
+        }
+        return restore->program[addr - REGS_PROGRAM_ADDR];
+    } else if (addr == restore->status_addr) {
+        return restore->status;
+    } else if (addr >= 0xFFFA) {
+        // the reset, and any NMI the CPU had latched, both lead to the start of the program
+        // an NMI partway through only makes it start over
+        return addr % 2 == 0 ? REGS_PROGRAM_ADDR & 0xFF : REGS_PROGRAM_ADDR >> 8;
+    }
+
+    // whatever else is read is a dummy read, which mustn't have any side effects
+    const uint8_t *page = restore->memory_map.read_pages[addr / CPU_PAGE_SIZE];
+    return page != NULL ? page[addr % CPU_PAGE_SIZE] : 0;
+}
+
+static bool _restore_cpu_regs(const CpuRegisters *regs) {
+    CpuRegsRestore *restore = &g_ctx->system.regs_restore;
+
+    // PLP is the only way to set every flag, so the stack pointer starts one lower and the status is pulled into place
+    // it goes last since the loads change the flags
+    const uint8_t program[REGS_PROGRAM_SIZE] = {
+        0xA2, (uint8_t) (regs->sp - 1), // LDX #sp-1
+        0x9A, // TXS
+        0xA9, regs->acc, // LDA #acc
+        0xA0, regs->y, // LDY #y
+        0xA2, regs->x, // LDX #x
+        0x28, // PLP
+        0x4C, regs->pc & 0xFF, regs->pc >> 8, // JMP pc
+    };
+    memcpy(restore->program, program, sizeof(program));
+    restore->status_addr = 0x100 | regs->sp;
+    restore->status = regs->status.serial;
+    restore->cycles = 0;
+    restore->done = false;
+
+    // nothing the CPU does along the way may touch the console, so every access is sent down the slow path
+    restore->memory_map = g_ctx->system.memory_map;
+    memset(&g_ctx->system.memory_map, 0, sizeof(CpuMemoryMap));
+
+    unsigned int (*nmi_line_callback)(void) = g_ctx->system.nmi_line_callback;
+    unsigned int (*irq_line_callback)(void) = g_ctx->system.irq_line_callback;
+    unsigned int (*rst_line_callback)(void) = g_ctx->system.rst_line_callback;
+    g_ctx->system.nmi_line_callback = _regs_restore_nmi_line;
+    // an IRQ taken right after the jump would come an instruction too early
+    g_ctx->system.irq_line_callback = _regs_restore_irq_line;
+    g_ctx->system.rst_line_callback = _regs_restore_rst_line;
+    uint8_t bus_val = g_ctx->system.bus_val;
+
+    restore->active = true;
+    while (!restore->done && restore->cycles < REGS_RESTORE_MAX_CYCLES) {
+        cycle_cpu();
+        restore->cycles++;
+    }
+    restore->active = false;
+
+    g_ctx->system.memory_map = restore->memory_map;
+    g_ctx->system.nmi_line_callback = nmi_line_callback;
+    g_ctx->system.irq_line_callback = irq_line_callback;
+    g_ctx->system.rst_line_callback = rst_line_callback;
+    g_ctx->system.bus_val = bus_val;
+
+    if (!restore->done) {
+        // there's no telling where the CPU was left, so it's reset the same way as with the hotkey
+        printf("Failed to restore the CPU's registers, resetting the console\n");
+        system_set_rst_cycles(10);
+        return false;
+    }
+
+    return true;
+}
+
+static bool _read_state(const void *buf) {
+    const unsigned char *cursor = (const unsigned char*) buf + sizeof(SaveStateHeader);
+
+    SavedSystemRegs regs;
+    _state_get(&cursor, &regs, sizeof(regs));
+
+    // the program which restores the registers never touches the console, so it runs first and a failure leaves the
+    // console as it was instead of half loaded
+    if (!_restore_cpu_regs(&regs.cpu_regs)) {
+        return false;
+    }
+
+    g_ctx->system.master_clock = regs.master_clock;
+    g_ctx->system.next_cpu_edge = regs.next_cpu_edge;
+    g_ctx->system.next_ppu_edge = regs.next_ppu_edge;
+    g_ctx->system.ppu_synced_edge = regs.next_ppu_edge;
+    g_ctx->system.mapper_event_edge = regs.mapper_event_edge;
+    g_ctx->system.rst_deadline = regs.rst_deadline;
+    g_ctx->system.total_cpu_cycles = regs.total_cpu_cycles;
+    g_ctx->system.dma_step = regs.dma_step;
+    g_ctx->system.dma_page = regs.dma_page;
+    g_ctx->system.dma_in_progress = regs.dma_in_progress;
+    g_ctx->system.bus_val = regs.bus_val;
+
+    _state_get(&cursor, g_ctx->system.ram, SYSTEM_MEMORY_SIZE);
+    _state_get(&cursor, g_ctx->system.prg_ram, g_ctx->system.prg_ram_size);
+    _state_get(&cursor, g_ctx->system.chr_ram, g_ctx->system.chr_ram_size);
+
+    // the debug view isn't part of the console
+    RenderMode render_mode = g_ctx->ppu.render_mode;
+    _state_get(&cursor, &g_ctx->ppu, sizeof(PpuState));
+    g_ctx->ppu.render_mode = render_mode;
+
+    ppu_invalidate_pattern_cache();
+    ppu_invalidate_sprite_cache();
+    spin_reset();
+
+    for (unsigned int i = 0; i < 2; i++) {
+        Controller *controller = get_controller(i);
+        uint32_t type;
+        _state_get(&cursor, &type, sizeof(type));
+        if (controller != NULL) {
+            _state_get(&cursor, controller->state, controller->state_size);
+        }
+    }
+
+    Mapper *mapper = g_ctx->system.cart->mapper;
+    _state_get(&cursor, mapper->state, mapper->state_size);
+
+    system_remap_banks();
+
+    // anything the CPU had latched was spent on the program
+    g_ctx->system.nmi_line_seen = 0;
+    g_ctx->system.nmi_fall_cycle = 0;
+    g_ctx->system.vector_read_cycle = g_ctx->system.total_cpu_cycles;
+
+    return true;
+}
+
+static void _finish_state_request(bool ok) {
+    StateRequest *req = &g_ctx->system.state_request;
+
+    req->type = STATE_REQUEST_NONE;
+
+    if (req->done != NULL) {
+        req->done(req->done_arg, ok);
+    }
+}
+
+// carries out the pending request now that the CPU is between two instructions
+static void _handle_state_request(void) {
+    StateRequest *req = &g_ctx->system.state_request;
+
+    switch (req->type) {
+        case STATE_REQUEST_SAVE:
+            _write_state(req->buf);
+            req->boundary_cycle = g_ctx->system.total_cpu_cycles;
+            req->type = STATE_REQUEST_SAVE_REGS;
+            break;
+        case STATE_REQUEST_SAVE_REGS:
+            memcpy((unsigned char*) req->buf + sizeof(SaveStateHeader) + offsetof(SavedSystemRegs, cpu_regs),
+                    &req->cpu_regs, sizeof(CpuRegisters));
+            _finish_state_request(true);
+            break;
+        case STATE_REQUEST_LOAD:
+            _finish_state_request(_read_state(req->buf));
+            break;
+        default:
+            break;
+    }
+}
+
+static bool _queue_state_request(StateRequestType type, void *buf, size_t buf_len,
+        void (*done)(void *arg, bool ok), void *done_arg) {
+    StateRequest *req = &g_ctx->system.state_request;
+
+    if (req->type != STATE_REQUEST_NONE) {
+        printf("A save state is already being taken or loaded\n");
+        return false;
+    }
+
+    req->type = type;
+    req->buf = buf;
+    req->buf_len = buf_len;
+    req->done = done;
+    req->done_arg = done_arg;
+
+    system_update_cpu_log();
+
+    return true;
+}
+
+bool system_save_state(void *buf, size_t buf_len, void (*done)(void *arg, bool ok), void *done_arg) {
+    if (buf_len < system_get_state_size()) {
+        return false;
+    }
+
+    return _queue_state_request(STATE_REQUEST_SAVE, buf, buf_len, done, done_arg);
+}
+
+bool system_load_state(const void *buf, size_t buf_len, void (*done)(void *arg, bool ok), void *done_arg) {
+    if (!_check_state(buf, buf_len)) {
+        return false;
+    }
+
+    return _queue_state_request(STATE_REQUEST_LOAD, (void*) buf, buf_len, done, done_arg);
+}
+
+bool system_is_state_request_pending(void) {
+    return g_ctx->system.state_request.type != STATE_REQUEST_NONE;
+}
+
+typedef struct {
+    char *file_name;
+    void *buf;
+} StateFile;
+
+static void _free_state_file(StateFile *file) {
+    free(file->file_name);
+    free(file->buf);
+    free(file);
+}
+
+static void _on_state_file_saved(void *arg, bool ok) {
+    StateFile *file = (StateFile*) arg;
+
+    if (ok) {
+        FILE *out_file = fopen(file->file_name, "wb");
+        if (!out_file) {
+            printf("Failed to write save state (couldn't open file: %s)\n", strerror(errno));
+        } else {
+            if (fwrite(file->buf, system_get_state_size(), 1, out_file) != 1) {
+                printf("Failed to write save state\n");
+            }
+            fclose(out_file);
+        }
+    }
+
+    _free_state_file(file);
+}
+
+bool system_write_state_file(const char *file_name) {
+    size_t size = system_get_state_size();
+
+    StateFile *file = (StateFile*) calloc(1, sizeof(StateFile));
+    file->file_name = (char*) malloc(strlen(file_name) + 1);
+    strcpy(file->file_name, file_name);
+    file->buf = malloc(size);
+
+    if (!system_save_state(file->buf, size, _on_state_file_saved, file)) {
+        _free_state_file(file);
+        return false;
+    }
+
+    return true;
+}
+
+static void _on_state_file_loaded(void *arg, bool ok) {
+    (void) ok;
+    free(arg);
+}
+
+bool system_read_state_file(const char *file_name) {
+    FILE *in_file = fopen(file_name, "rb");
+    if (!in_file) {
+        printf("Failed to read save state (couldn't open file: %s)\n", strerror(errno));
+        return false;
+    }
+
+    size_t size = system_get_state_size();
+    void *buf = malloc(size);
+    size_t read = fread(buf, 1, size, in_file);
+    fclose(in_file);
+
+    if (!system_load_state(buf, read, _on_state_file_loaded, buf)) {
+        free(buf);
+        return false;
+    }
+
+    return true;
+}
+
 void system_start_oam_dma(uint8_t page) {
-    g_dma_in_progress = true;
-    g_dma_page = page;
-    g_dma_step = 0;
+    g_ctx->system.dma_in_progress = true;
+    g_ctx->system.dma_page = page;
+    g_ctx->system.dma_step = 0;
 }
 
-void do_system_loop(void) {
-    unsigned int cycles_per_interval = g_master_clock_speed * SLEEP_INTERVAL / 1000000;
+static void _sleep_until_next_interval(uint64_t *last_sleep) {
+    uint64_t start_us = now_us();
+    uint64_t delta_us = start_us - *last_sleep;
+
+    if (delta_us < SLEEP_INTERVAL) {
+        uint64_t sleep_for_us = SLEEP_INTERVAL - delta_us;
+
+        if (sleep_for_us > SLEEP_OVERHEAD) {
+            sleep_for_us -= SLEEP_OVERHEAD;
+            struct timespec sleep_for;
+            sleep_for.tv_sec = sleep_for_us / 1000000;
+            sleep_for.tv_nsec = (sleep_for_us % 1000000) * 1000;
+
+            nanosleep(&sleep_for, &sleep_for);
+        }
+    }
+
+    *last_sleep = now_us();
+
+    g_ctx->stats.measured_ns[STATS_SECTION_IDLE] += (*last_sleep - start_us) * 1000;
+}
+
+// idle dots are only skipped when nothing needs to see each one
+static bool _can_skip_ppu_dots(void) {
+    return !g_ctx->system.stepping;
+}
+
+// runs the dots on edges before the given timestamp which the loop went past without running
+static ALWAYS_INLINE void _catch_up_ppu_with(uint64_t until, uint64_t divider) {
+    bool skip_idle = _can_skip_ppu_dots();
+
+    while (g_ctx->system.ppu_synced_edge < until) {
+        uint64_t dots = (until - g_ctx->system.ppu_synced_edge + divider - 1) / divider;
+
+        unsigned int idle_dots = skip_idle ? ppu_get_idle_dots() : 0;
+        if (idle_dots > 0) {
+            dots = MIN(dots, idle_dots);
+
+            ppu_advance((unsigned int) dots);
+            g_ctx->stats.ppu_idle_dots += dots;
+        } else {
+            dots = 1;
+
+            cycle_ppu();
+        }
+
+        g_ctx->stats.ppu_dots += dots;
+        g_ctx->system.ppu_synced_edge += dots * divider;
+    }
+}
+
+static void _catch_up_ppu(uint64_t until) {
+    _catch_up_ppu_with(until, g_ctx->system.ppu_clock_divider);
+}
+
+// brings the PPU up to date with the current edge, for anything which is about to look at or poke it
+void system_sync_ppu(void) {
+    if (g_ctx->system.ppu_synced_edge == g_ctx->system.next_ppu_edge) {
+        return;
+    }
+
+    // the PPU goes before the CPU on a shared edge, so the current edge counts too
+    _catch_up_ppu(g_ctx->system.master_clock + 1);
+
+    // the caller might end the idle or quiet stretch early (e.g. by enabling rendering or NMIs), so go back to stepping
+    // dot by dot until the loop works out a new one
+    g_ctx->system.next_ppu_edge = g_ctx->system.ppu_synced_edge;
+}
+
+// the first dot whose tick comes after the current CPU cycle
+// the PPU goes first on a shared edge, but its tick comes after the CPU, so that's the dot on or after the current edge
+uint64_t system_get_cpu_dot(void) {
+    return (g_ctx->system.master_clock + g_ctx->system.ppu_clock_divider - 1) / g_ctx->system.ppu_clock_divider;
+}
+
+// called by the PPU whenever A12 of its address bus changes
+void system_notify_a12(bool high) {
+    Mapper *mapper = g_ctx->system.cart->mapper;
+    if (mapper->a12_func == NULL) {
+        return;
+    }
+
+    // while a dot is being run (possibly well behind the clock), the change belongs to that dot
+    // otherwise it's the CPU poking the PPU, which always syncs it first and so leaves it ahead of the clock
+    uint64_t dot = g_ctx->system.ppu_synced_edge <= g_ctx->system.master_clock
+            ? g_ctx->system.ppu_synced_edge / g_ctx->system.ppu_clock_divider
+            : system_get_cpu_dot();
+
+    mapper->a12_func(g_ctx->system.cart, high, dot);
+}
+
+// replaces whatever event was scheduled before
+// the dot mustn't have been ticked yet
+void system_schedule_mapper_event(uint64_t dot) {
+    uint64_t edge = dot * g_ctx->system.ppu_clock_divider;
+
+    assert(edge >= g_ctx->system.master_clock);
+
+    g_ctx->system.mapper_event_edge = edge;
+
+    // stop there even if the PPU could otherwise be left behind for longer
+    g_ctx->system.next_ppu_edge = MIN(g_ctx->system.next_ppu_edge, MAX(edge, g_ctx->system.ppu_synced_edge));
+}
+
+void system_cancel_mapper_event(void) {
+    g_ctx->system.mapper_event_edge = UINT64_MAX;
+}
+
+// keeps the loop from jumping past the mapper's next event
+// an event on the current edge runs at the end of this iteration anyway
+static void _stop_at_mapper_event(void) {
+    if (g_ctx->system.mapper_event_edge > g_ctx->system.master_clock) {
+        g_ctx->system.next_ppu_edge = MIN(g_ctx->system.next_ppu_edge, g_ctx->system.mapper_event_edge);
+    }
+}
+
+static bool _needs_cpu_log(void) {
+    return tracer_is_running() || g_ctx->spin.watching || g_ctx->system.state_request.type != STATE_REQUEST_NONE;
+}
+
+// whether the CPU could be sitting on an NMI edge it hasn't acted on yet, which a save state wouldn't carry over
+// every edge is acted on within a couple of instructions (or right after an OAM DMA), so this never holds for long
+static bool _nmi_may_be_latched(void) {
+    return g_ctx->system.nmi_fall_cycle >= g_ctx->system.vector_read_cycle;
+}
+
+// the log callback runs as an instruction finishes, which is the only time the console can be saved or loaded
+static void _on_instruction_boundary(CpuRegisters regs) {
+    StateRequest *req = &g_ctx->system.state_request;
+
+    switch (req->type) {
+        case STATE_REQUEST_SAVE:
+            g_ctx->system.at_boundary = !_nmi_may_be_latched();
+            break;
+        case STATE_REQUEST_SAVE_REGS:
+            // the registers are reported at the start of each instruction, which is only where the state was saved if
+            // the CPU didn't take an interrupt in between
+            if (g_ctx->system.vector_read_cycle >= req->boundary_cycle) {
+                req->type = STATE_REQUEST_SAVE;
+                g_ctx->system.at_boundary = !_nmi_may_be_latched();
+            } else {
+                req->cpu_regs = regs;
+                g_ctx->system.at_boundary = true;
+            }
+            break;
+        case STATE_REQUEST_LOAD:
+            g_ctx->system.at_boundary = true;
+            break;
+        default:
+            break;
+    }
+}
+
+// the CPU has a single log callback, so everything which wants to see each instruction is fed from this one
+static void _cpu_log_callback(char *instr_str, CpuRegisters regs) {
+    // the program which restores the CPU's registers isn't part of the game
+    if (g_ctx->system.regs_restore.active) {
+        return;
+    }
+
+    _on_instruction_boundary(regs);
+
+    if (tracer_is_running()) {
+        tracer_on_instruction(instr_str, regs);
+    }
+
+    if (g_ctx->spin.watching) {
+        spin_on_instruction(regs);
+    }
+
+    // reporting every instruction isn't free for the CPU, so the callback is only left in place while it has users
+    if (!_needs_cpu_log()) {
+        cpu_set_log_callback(NULL);
+    }
+}
+
+// installs the CPU's log callback if anything currently wants to see instructions
+// it removes itself once nothing does anymore, so this only needs to be called when something starts wanting them
+void system_update_cpu_log(void) {
+    if (_needs_cpu_log()) {
+        cpu_set_log_callback(_cpu_log_callback);
+    }
+}
+
+// whether the PPU can fall behind the CPU until something observes it
+static bool _can_defer_ppu(void) {
+    return g_ctx->system.ppu_catch_up && !g_ctx->system.chr_open_bus && _can_skip_ppu_dots();
+}
+
+// skips whole iterations of a loop the CPU was found spinning in, up to the next PPU dot it could notice or the first
+// iteration whose $2002 read would come back different
+static void _skip_spin_loop(void) {
+    SpinState *spin = &g_ctx->spin;
+    uint64_t divider = g_ctx->system.cpu_clock_divider;
+
+    spin_reset();
+
+    // a save state has to see every instruction
+    if (g_ctx->system.state_request.type != STATE_REQUEST_NONE) {
+        return;
+    }
+
+    // the skipped cycles can't overlap anything which has to happen in step with the CPU
+    // (a mapper event due on this edge hasn't run yet, and could schedule another one before the next PPU edge)
+    if (!_can_defer_ppu()
+            || g_ctx->system.master_clock < g_ctx->system.rst_deadline
+            || g_ctx->system.mapper_event_edge <= g_ctx->system.master_clock
+            || g_ctx->system.next_ppu_edge <= g_ctx->system.next_cpu_edge) {
+        return;
+    }
+
+    uint64_t cycles = (g_ctx->system.next_ppu_edge - g_ctx->system.next_cpu_edge - 1) / divider + 1;
+    if (g_ctx->system.cycle_limit != 0) {
+        if (g_ctx->system.total_cpu_cycles >= g_ctx->system.cycle_limit) {
+            return;
+        }
+        cycles = MIN(cycles, g_ctx->system.cycle_limit - g_ctx->system.total_cpu_cycles);
+    }
+
+    uint64_t iterations = cycles / spin->period;
+
+    if (spin->polls_status) {
+        // sprite 0 hits and the like can happen on any dot, so check the value each skipped read would have seen
+        // if it differs, the PPU is left caught up to that read, which is fine since the CPU doesn't touch it again
+        // until then
+        uint64_t offset = spin->status_offset % spin->period;
+        if (offset == 0) {
+            offset = spin->period;
+        }
+
+        // the clock follows the reads, so that the PPU is never run ahead of it (e.g. A12 changes are timed by it)
+        uint64_t clock = g_ctx->system.master_clock;
+
+        uint64_t i;
+        for (i = 0; i < iterations; i++) {
+            uint64_t read_edge = g_ctx->system.next_cpu_edge + (i * spin->period + offset - 1) * divider;
+            g_ctx->system.master_clock = read_edge;
+            _catch_up_ppu(read_edge + 1);
+
+            if (ppu_peek_status() != spin->status_value) {
+                break;
+            }
+        }
+        iterations = i;
+
+        g_ctx->system.master_clock = clock;
+    }
+
+    uint64_t skipped = iterations * spin->period;
+    g_ctx->system.next_cpu_edge += skipped * divider;
+    g_ctx->system.total_cpu_cycles += skipped;
+    g_ctx->stats.spin_cycles += skipped;
+}
 
-    unsigned int cycles_since_sleep = 0;
+// the body of the system loop, which is instantiated once per TV system below so that the clock dividers are
+// constants in the hottest code
+static ALWAYS_INLINE void _run_system_loop(uint64_t cpu_divider, uint64_t ppu_divider) {
+    uint64_t cycles_per_interval = g_ctx->system.master_clock_speed * SLEEP_INTERVAL / 1000000;
 
+    uint64_t last_sleep_clock = g_ctx->system.master_clock;
     uint64_t last_sleep = now_us();
 
-    int cycles_since_log = 0;
-    uint64_t last_log = now_us();
+    system_update_cpu_log();
 
     while (true) {
-        if (g_dead) {
+        if (g_ctx->system.dead) {
             break;
         }
 
-        if (!g_halted) {
-            bool tick_cpu = (g_cycle_index % g_cpu_clock_divider) == 0;
-            bool tick_ppu = (g_cycle_index % g_ppu_clock_divider) == 0;
+        if (g_ctx->system.halted) {
+            // nothing to do until execution is resumed
+            uint64_t start_us = now_us();
+            sleep_cp(SLEEP_INTERVAL / 1000);
+            last_sleep = now_us();
 
-            if (tick_ppu) {
-                cycle_ppu();
+            g_ctx->stats.measured_ns[STATS_SECTION_IDLE] += (last_sleep - start_us) * 1000;
 
-                if (g_rst_cycles > 0) {
-                    g_rst_cycles--;
-                }
-            }
+            // a trace may be started while halted to follow the next step
+            system_update_cpu_log();
+            continue;
+        }
 
-            if (tick_cpu) {
-                if (g_dma_in_progress) {
-                    _handle_dma();
+        // jump straight to the next clock edge instead of walking every master tick in between
+        // when both edges coincide, the PPU is processed first (same as the original per-tick ordering)
+        g_ctx->system.master_clock = MIN(g_ctx->system.next_cpu_edge, g_ctx->system.next_ppu_edge);
+
+        bool tick_ppu = g_ctx->system.master_clock == g_ctx->system.next_ppu_edge;
+        bool tick_cpu = g_ctx->system.master_clock == g_ctx->system.next_cpu_edge;
+
+        // timing every edge would cost more than the work being measured, so only a fraction of them are timed
+        bool sample = false;
+        uint64_t lap = 0;
+        if (g_ctx->stats.time_sampling && --g_ctx->stats.sample_countdown == 0) {
+            g_ctx->stats.sample_countdown = STATS_SAMPLE_INTERVAL;
+            g_ctx->stats.excluded_ns = 0;
+            sample = true;
+            lap = now_ns();
+        }
+
+        if (tick_ppu) {
+            _catch_up_ppu_with(g_ctx->system.next_ppu_edge, ppu_divider);
+
+            if (_can_defer_ppu()) {
+                // this dot is one the CPU could notice (or the first after a sync), so it's run in step with the CPU
+                cycle_ppu();
+                g_ctx->stats.ppu_dots++;
+
+                g_ctx->system.next_ppu_edge += ppu_divider;
+                g_ctx->system.ppu_synced_edge = g_ctx->system.next_ppu_edge;
+
+                // the CPU runs ahead until the next such dot, and anything which touches the PPU before then catches
+                // it up first
+                g_ctx->system.next_ppu_edge += ppu_get_quiet_dots() * ppu_divider;
+                _stop_at_mapper_event();
+            } else {
+                unsigned int idle_dots = _can_skip_ppu_dots() ? ppu_get_idle_dots() : 0;
+
+                if (idle_dots > 0) {
+                    // during vblank and while rendering is disabled, the PPU only advances its counters
+                    // those dots are applied in bulk once the loop gets past them or the CPU touches the PPU
+                    g_ctx->system.next_ppu_edge += idle_dots * ppu_divider;
+                    _stop_at_mapper_event();
                 } else {
-                    cycle_cpu();
+                    cycle_ppu();
+                    g_ctx->stats.ppu_dots++;
+
+                    g_ctx->system.next_ppu_edge += ppu_divider;
+                    g_ctx->system.ppu_synced_edge = g_ctx->system.next_ppu_edge;
                 }
+            }
 
-                g_total_cpu_cycles++;
+            if (sample) {
+                lap = stats_lap(&g_ctx->stats, STATS_SECTION_PPU, lap);
             }
+        }
 
-            if (tick_ppu) {
-                if (g_cart->mapper->tick_func != NULL) {
-                    g_cart->mapper->tick_func();
-                }
+        if (tick_cpu) {
+            if (g_ctx->system.dma_in_progress) {
+                _handle_dma();
+                g_ctx->stats.dma_cycles++;
+            } else {
+                cycle_cpu();
             }
 
-            if (++g_cycle_index == g_clock_divider_cd) {
-                g_cycle_index = 0;
+            if (sample) {
+                lap = stats_lap(&g_ctx->stats, STATS_SECTION_CPU, lap);
             }
 
-            if (g_stepping) {
-                g_halted = true;
-                g_stepping = false;
+            g_ctx->system.total_cpu_cycles++;
+
+            g_ctx->system.next_cpu_edge += cpu_divider;
+
+            if (g_ctx->spin.found) {
+                _skip_spin_loop();
+            } else if (g_ctx->spin.enabled && !g_ctx->spin.watching
+                    && g_ctx->system.total_cpu_cycles - g_ctx->spin.clean_since >= SPIN_WATCH_CYCLES) {
+                spin_start_watching();
             }
         }
 
-        #if THROTTLE_SPEED
-        if (++cycles_since_sleep > cycles_per_interval) {
-            uint64_t now = now_us();
-            uint64_t delta_us = now - last_sleep;
-
-            if (delta_us < SLEEP_INTERVAL) {
-                uint64_t sleep_for_us = SLEEP_INTERVAL - delta_us;
-
-                if (sleep_for_us > SLEEP_OVERHEAD) {
-                    sleep_for_us -= SLEEP_OVERHEAD;
-                    struct timespec sleep_for;
-                    sleep_for.tv_sec = sleep_for_us / 1000000;
-                    sleep_for.tv_nsec = (sleep_for_us % 1000000) * 1000;
-                    
-                    nanosleep(&sleep_for, &sleep_for);
-                }
+        // the event can land on an edge the PPU had already been synced past by the CPU, so this isn't tied to tick_ppu
+        if (g_ctx->system.master_clock >= g_ctx->system.mapper_event_edge) {
+            g_ctx->system.mapper_event_edge = UINT64_MAX;
+
+            g_ctx->system.cart->mapper->event_func(g_ctx->system.cart);
+            g_ctx->stats.mapper_events++;
+
+            if (sample) {
+                lap = stats_lap(&g_ctx->stats, STATS_SECTION_MAPPER, lap);
             }
-            
-            last_sleep = now_us();
-            
-            cycles_since_sleep = 0;
         }
-        #endif
 
-        #if LOG_PERFORMANCE
-        if (cycles_since_log > g_master_clock_speed) {
-            cycles_since_log = 0;
+        // by now everything belonging to the cycle the instruction ended on has run
+        if (g_ctx->system.at_boundary) {
+            g_ctx->system.at_boundary = false;
+            _handle_state_request();
+
+            // a load can move the clock backwards
+            last_sleep_clock = MIN(last_sleep_clock, g_ctx->system.master_clock);
+        }
+
+        if (g_ctx->system.stepping) {
+            g_ctx->system.halted = true;
+            g_ctx->system.stepping = false;
+        }
 
-            uint64_t now = now_us();
+        if (g_ctx->system.frame_limit != 0 && g_ctx->system.frame_count >= g_ctx->system.frame_limit) {
+            break;
+        }
 
-            uint64_t delta_us = now - last_log;
-            
-            float fraction = 1000000.0 / delta_us;
+        if (g_ctx->system.cycle_limit != 0 && g_ctx->system.total_cpu_cycles >= g_ctx->system.cycle_limit) {
+            break;
+        }
 
-            printf("Running at %.1f%% fullspeed\n", fraction * 100);
+        if (g_ctx->system.throttle && g_ctx->system.master_clock - last_sleep_clock > cycles_per_interval) {
+            _sleep_until_next_interval(&last_sleep);
 
-            last_log = now;
-        } else {
-            cycles_since_log++;
+            last_sleep_clock = g_ctx->system.master_clock;
         }
-        #endif
     }
 }
 
+#define DEFINE_SYSTEM_LOOP(name, tv) \
+    static void _do_system_loop_##name(void) { \
+        _run_system_loop(CPU_CLOCK_DIVIDER_##tv, PPU_CLOCK_DIVIDER_##tv); \
+    }
+
+DEFINE_SYSTEM_LOOP(ntsc, NTSC)
+DEFINE_SYSTEM_LOOP(pal, PAL)
+DEFINE_SYSTEM_LOOP(dendy, DENDY)
+
+void do_system_loop(void) {
+    g_ctx->system.loop_func();
+
+    // leave the PPU consistent with the clock for whoever inspects it next
+    system_sync_ppu();
+}
+
 void break_execution(void) {
-    g_halted = true;
+    g_ctx->system.halted = true;
 }
 
 void continue_execution(void) {
-    g_halted = false;
+    g_ctx->system.halted = false;
 }
 
 void step_execution(void) {
-    g_halted = false;
-    g_stepping = true;
+    g_ctx->system.halted = false;
+    g_ctx->system.stepping = true;
 }
 
 bool is_execution_halted(void) {
-    return g_halted;
+    return g_ctx->system.halted;
 }
 
 void kill_execution(void) {
-    if (g_cart->has_nv_ram) {
-        _write_prg_nvram(g_cart);
+    if (!g_ctx->system.headless && g_ctx->system.cart->has_nv_ram) {
+        _write_prg_nvram(g_ctx->system.cart);
     }
-    g_dead = true;
+    g_ctx->system.dead = true;
 }
 
 void system_connect_nmi_line(unsigned int (*nmi_line_callback)(void)) {
-    g_nmi_line_callback = nmi_line_callback;
+    g_ctx->system.nmi_line_callback = nmi_line_callback;
 }
 
 void system_connect_irq_line(unsigned int (*irq_line_callback)(void)) {
-    g_irq_line_callback = irq_line_callback;
+    g_ctx->system.irq_line_callback = irq_line_callback;
 }
 
 void system_connect_rst_line(unsigned int (*irq_line_callback)(void)) {
-    g_rst_line_callback = irq_line_callback;
+    g_ctx->system.rst_line_callback = irq_line_callback;
 }
 
 void system_set_rst_cycles(unsigned int cycles) {
-    g_rst_cycles = cycles;
+    // the countdown is measured in PPU cycles
+    g_ctx->system.rst_deadline = g_ctx->system.master_clock + cycles * g_ctx->system.ppu_clock_divider;
+}
+
+void system_emit_pixel(unsigned int x, unsigned int y, uint8_t palette_index) {
+    g_ctx->system.framebuffer[y][x] = palette_index;
 }
 
-void system_emit_pixel(unsigned int x, unsigned int y, const RGBValue color) {
-    set_pixel(x, y, color);
+void system_emit_row_emphasis(unsigned int y, uint8_t emphasis) {
+    g_ctx->system.framebuffer_emphasis[y] = emphasis;
 }
 
 void system_submit_frame(void) {
-    submit_frame();
+    g_ctx->system.frame_count++;
+
+    if (!g_ctx->system.headless) {
+        if (g_ctx->stats.time_sampling) {
+            uint64_t start_ns = now_ns();
+            submit_frame(g_ctx->system.framebuffer, g_ctx->system.framebuffer_emphasis);
+
+            // this runs inside a PPU dot, so keep it from being counted twice if that dot is being sampled
+            uint64_t present_ns = now_ns() - start_ns;
+            g_ctx->stats.measured_ns[STATS_SECTION_PRESENT] += present_ns;
+            g_ctx->stats.excluded_ns += present_ns;
+        } else {
+            submit_frame(g_ctx->system.framebuffer, g_ctx->system.framebuffer_emphasis);
+        }
+    }
+
+    rewind_on_frame();
+
+    // picks up a trace started from another thread
+    system_update_cpu_log();
 }
@@ -0,0 +1,249 @@
+/*
+ * This file is a part of cNES.
+ * Copyright (c) 2019, Max Roncace <mproncace@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "context.h"
+#include "ppu.h"
+#include "system.h"
+#include "tracer.h"
+#include "util.h"
+
+#include "c6502/cpu.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+// in records; must be a power of two
+#define TRACE_RING_CAPACITY (1 << 20)
+#define TRACE_RING_MASK (TRACE_RING_CAPACITY - 1)
+
+#define WRITER_IDLE_SLEEP 1 // milliseconds
+
+// the ring is written by the emulation thread and drained by the writer thread
+// it's allocated once and never freed, so an instruction which straddles tracer_stop can't write to freed memory
+static TraceRecord *g_ring;
+static atomic_size_t g_ring_head; // next record to be written
+static atomic_size_t g_ring_tail; // next record to be drained
+
+static atomic_bool g_running;
+static atomic_bool g_writer_stop;
+
+// bumped by every tracer_start, so the emulation thread can tell when a new trace needs its first snapshot
+static atomic_uint g_session;
+// the last session the emulation thread took a snapshot for
+static unsigned int g_armed_session;
+
+static FILE *g_trace_file;
+
+#ifdef _WIN32
+static HANDLE g_writer_thread;
+#else
+static pthread_t g_writer_thread;
+#endif
+
+// the log callback fires once an instruction has executed, so the counters are captured here for the next one
+// these are only touched by the emulation thread
+static uint64_t g_cycle_snapshot;
+static uint16_t g_scanline_snapshot;
+static uint16_t g_scanline_tick_snapshot;
+
+// number of times the emulation thread had to wait for the writer to catch up
+static uint64_t g_stall_count;
+
+static void _take_snapshot(void) {
+    system_sync_ppu();
+
+    g_cycle_snapshot = system_get_cpu_cycles();
+    g_scanline_snapshot = ppu_get_scanline();
+    g_scanline_tick_snapshot = ppu_get_scanline_tick();
+}
+
+void tracer_on_instruction(char *instr_str, CpuRegisters regs) {
+    (void) instr_str; // the decoder disassembles the opcode bytes itself
+
+    // the trace may have been started in the middle of this instruction, so it only begins with the next one
+    unsigned int session = atomic_load(&g_session);
+    if (session != g_armed_session) {
+        g_armed_session = session;
+        _take_snapshot();
+        return;
+    }
+
+    size_t head = atomic_load_explicit(&g_ring_head, memory_order_relaxed);
+
+    // never drop records; it's better to slow down than to leave a hole in a trace
+    if (head - atomic_load_explicit(&g_ring_tail, memory_order_acquire) >= TRACE_RING_CAPACITY) {
+        g_stall_count++;
+        do {
+            if (!atomic_load(&g_running)) {
+                return;
+            }
+            sleep_cp(WRITER_IDLE_SLEEP);
+        } while (head - atomic_load_explicit(&g_ring_tail, memory_order_acquire) >= TRACE_RING_CAPACITY);
+    }
+
+    TraceRecord *record = &g_ring[head & TRACE_RING_MASK];
+    record->cpu_cycle = g_cycle_snapshot;
+    record->pc = regs.pc;
+    record->ppu_scanline = g_scanline_snapshot;
+    record->ppu_scanline_tick = g_scanline_tick_snapshot;
+    for (int i = 0; i < 3; i++) {
+        record->opcode[i] = system_peek_memory(regs.pc + i);
+    }
+    record->acc = regs.acc;
+    record->x = regs.x;
+    record->y = regs.y;
+    record->sp = regs.sp;
+    record->status = regs.status.serial;
+
+    atomic_store_explicit(&g_ring_head, head + 1, memory_order_release);
+
+    _take_snapshot();
+}
+
+static void *_writer_main(void *arg) {
+    (void) arg;
+
+    while (true) {
+        // read the stop flag first so that everything published before it was set still gets drained
+        bool stopping = atomic_load(&g_writer_stop);
+
+        size_t tail = atomic_load_explicit(&g_ring_tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&g_ring_head, memory_order_acquire);
+
+        if (head == tail) {
+            if (stopping) {
+                break;
+            }
+            sleep_cp(WRITER_IDLE_SLEEP);
+            continue;
+        }
+
+        // write up to the end of the ring in one go; anything past the wrap point is picked up next time around
+        size_t start = tail & TRACE_RING_MASK;
+        size_t count = head - tail;
+        if (start + count > TRACE_RING_CAPACITY) {
+            count = TRACE_RING_CAPACITY - start;
+        }
+
+        fwrite(&g_ring[start], sizeof(TraceRecord), count, g_trace_file);
+
+        atomic_store_explicit(&g_ring_tail, tail + count, memory_order_release);
+    }
+
+    return NULL;
+}
+
+bool tracer_start(const char *file_name) {
+    if (atomic_load(&g_running)) {
+        printf("Trace is already running\n");
+        return false;
+    }
+
+    if (g_ring == NULL) {
+        g_ring = (TraceRecord*) malloc(TRACE_RING_CAPACITY * sizeof(TraceRecord));
+        if (g_ring == NULL) {
+            printf("Failed to allocate trace buffer\n");
+            return false;
+        }
+    }
+
+    g_trace_file = fopen(file_name, "wb");
+    if (g_trace_file == NULL) {
+        printf("Failed to open trace file %s (%s)\n", file_name, strerror(errno));
+        return false;
+    }
+
+    TraceFileHeader header = {0};
+    memcpy(header.magic, TRACE_FILE_MAGIC, sizeof(TRACE_FILE_MAGIC));
+    header.version = TRACE_FILE_VERSION;
+    header.record_size = sizeof(TraceRecord);
+    fwrite(&header, sizeof(header), 1, g_trace_file);
+
+    atomic_store(&g_ring_head, 0);
+    atomic_store(&g_ring_tail, 0);
+    atomic_store(&g_writer_stop, false);
+    g_stall_count = 0;
+
+    #ifdef _WIN32
+    g_writer_thread = CreateThread(NULL, 0, _writer_main, NULL, 0, NULL);
+    if (g_writer_thread == NULL) {
+        printf("Failed to create trace writer thread (error code %d)\n", GetLastError());
+        fclose(g_trace_file);
+        return false;
+    }
+    #else
+    int rc;
+    if ((rc = pthread_create(&g_writer_thread, NULL, _writer_main, NULL)) != 0) {
+        printf("Failed to create trace writer thread (error code %d)\n", rc);
+        fclose(g_trace_file);
+        return false;
+    }
+    #endif
+
+    // the emulation thread takes it from here, since it's the only one which can safely look at the console
+    atomic_fetch_add(&g_session, 1);
+    atomic_store(&g_running, true);
+
+    printf("Tracing execution to %s\n", file_name);
+
+    return true;
+}
+
+void tracer_stop(void) {
+    if (!atomic_load(&g_running)) {
+        return;
+    }
+
+    // the system stops feeding instructions to the tracer as soon as it sees this
+    atomic_store(&g_running, false);
+
+    atomic_store(&g_writer_stop, true);
+
+    #ifdef _WIN32
+    WaitForSingleObject(g_writer_thread, INFINITE);
+    CloseHandle(g_writer_thread);
+    #else
+    pthread_join(g_writer_thread, NULL);
+    #endif
+
+    fclose(g_trace_file);
+    g_trace_file = NULL;
+
+    printf("Stopped tracing after %llu instructions (%llu stalls)\n",
+            (unsigned long long) atomic_load(&g_ring_head), (unsigned long long) g_stall_count);
+}
+
+bool tracer_is_running(void) {
+    return atomic_load(&g_running);
+}
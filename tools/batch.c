@@ -0,0 +1,377 @@
+/*
+ * This file is a part of cNES.
+ * Copyright (c) 2019, Max Roncace <mproncace@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+// Runs a set of ROMs headless for a fixed number of frames and prints one result line per ROM.
+//
+// The CPU core keeps its state in process-wide globals, so each ROM is run in its own forked worker process rather
+// than on a thread. On Windows, where fork isn't available, ROMs are run one after another in-process.
+
+#include "cartridge.h"
+#include "context.h"
+#include "loader.h"
+#include "system.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#define USAGE_MSG "Usage: %s [--frames <N>] [--jobs <N>] <ROM or directory>...\n"
+
+#define DEFAULT_FRAME_COUNT 600
+
+#define RESULT_MAX_LEN 256
+
+typedef struct {
+    char *path;
+    char result[RESULT_MAX_LEN];
+    bool done;
+    #ifndef _WIN32
+    pid_t pid;
+    int pipe_fd;
+    #endif
+} BatchJob;
+
+static BatchJob *g_jobs;
+static size_t g_job_count;
+static size_t g_job_capacity;
+
+static void _add_job(const char *path) {
+    if (g_job_count == g_job_capacity) {
+        g_job_capacity = g_job_capacity != 0 ? g_job_capacity * 2 : 64;
+        g_jobs = realloc(g_jobs, g_job_capacity * sizeof(BatchJob));
+    }
+
+    BatchJob *job = &g_jobs[g_job_count++];
+    memset(job, 0, sizeof(BatchJob));
+    job->path = strdup(path);
+}
+
+static bool _has_rom_extension(const char *name) {
+    const char *dot = strrchr(name, '.');
+    return dot != NULL && (strcmp(dot, ".nes") == 0 || strcmp(dot, ".NES") == 0);
+}
+
+static int _compare_paths(const void *a, const void *b) {
+    return strcmp(((const BatchJob*) a)->path, ((const BatchJob*) b)->path);
+}
+
+// adds every ROM in the given directory (non-recursively), or the path itself if it isn't a directory
+static void _add_path(const char *path) {
+    #ifdef _WIN32
+    DWORD attrs = GetFileAttributesA(path);
+    if (attrs == INVALID_FILE_ATTRIBUTES || !(attrs & FILE_ATTRIBUTE_DIRECTORY)) {
+        _add_job(path);
+        return;
+    }
+
+    char pattern[MAX_PATH];
+    snprintf(pattern, sizeof(pattern), "%s\\*.nes", path);
+
+    WIN32_FIND_DATAA find_data;
+    HANDLE find_handle = FindFirstFileA(pattern, &find_data);
+    if (find_handle == INVALID_HANDLE_VALUE) {
+        return;
+    }
+
+    size_t first = g_job_count;
+    do {
+        char full_path[MAX_PATH];
+        snprintf(full_path, sizeof(full_path), "%s\\%s", path, find_data.cFileName);
+        _add_job(full_path);
+    } while (FindNextFileA(find_handle, &find_data));
+    FindClose(find_handle);
+    #else
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        _add_job(path);
+        return;
+    }
+
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        fprintf(stderr, "Could not open directory %s\n", path);
+        return;
+    }
+
+    size_t first = g_job_count;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (!_has_rom_extension(entry->d_name)) {
+            continue;
+        }
+
+        size_t len = strlen(path) + strlen(entry->d_name) + 2;
+        char *full_path = malloc(len);
+        snprintf(full_path, len, "%s/%s", path, entry->d_name);
+        _add_job(full_path);
+        free(full_path);
+    }
+    closedir(dir);
+    #endif
+
+    // directory listings come back in no particular order
+    qsort(&g_jobs[first], g_job_count - first, sizeof(BatchJob), _compare_paths);
+}
+
+static uint64_t _hash_bytes(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *bytes = (const unsigned char*) data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+static char *_get_title(const char *path) {
+    const char *base_name = strrchr(path, '/');
+    #ifdef _WIN32
+    const char *base_name_alt = strrchr(path, '\\');
+    if (base_name_alt > base_name) {
+        base_name = base_name_alt;
+    }
+    #endif
+    base_name = base_name != NULL ? base_name + 1 : path;
+
+    const char *dot_ptr = strrchr(base_name, '.');
+    size_t len = dot_ptr != NULL ? (size_t) (dot_ptr - base_name) : strlen(base_name);
+
+    char *title = malloc(len + 1);
+    memcpy(title, base_name, len);
+    title[len] = '\0';
+    return title;
+}
+
+// runs a single ROM to completion and writes its result line to the given buffer
+static void _run_rom(const char *path, uint64_t frames, char *result) {
+    FILE *rom_file = fopen(path, "rb");
+    if (rom_file == NULL) {
+        snprintf(result, RESULT_MAX_LEN, "error=open");
+        return;
+    }
+
+    Cartridge *cart = load_rom(rom_file, _get_title(path));
+    fclose(rom_file);
+
+    if (cart == NULL) {
+        snprintf(result, RESULT_MAX_LEN, "error=load");
+        return;
+    }
+
+    NesContext *ctx = create_context();
+    make_context_current(ctx);
+
+    system_set_headless(true);
+    system_set_throttle(false);
+    system_set_frame_limit(frames);
+
+    initialize_system(cart);
+
+    uint64_t start_us = now_us();
+    do_system_loop();
+    uint64_t elapsed_us = now_us() - start_us;
+
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    hash = _hash_bytes(hash, ctx->system.framebuffer, sizeof(ctx->system.framebuffer));
+    hash = _hash_bytes(hash, ctx->system.ram, sizeof(ctx->system.ram));
+
+    uint64_t frames_run = system_get_frame_count();
+    double fps = elapsed_us != 0 ? frames_run * 1000000.0 / elapsed_us : 0;
+
+    snprintf(result, RESULT_MAX_LEN, "mapper=%u frames=%llu fps=%.1f hash=%016llx",
+            cart->mapper->id, (unsigned long long) frames_run, fps, (unsigned long long) hash);
+
+    destroy_context(ctx);
+    unload_rom(cart);
+}
+
+#ifndef _WIN32
+static bool _start_job(BatchJob *job, uint64_t frames) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+
+    if (pid == 0) {
+        close(fds[0]);
+
+        // the emulator core is chatty, so silence it so it doesn't interleave with the results
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDOUT_FILENO);
+            close(null_fd);
+        }
+
+        char result[RESULT_MAX_LEN];
+        _run_rom(job->path, frames, result);
+
+        ssize_t written = write(fds[1], result, strlen(result));
+        _exit(written > 0 ? 0 : 1);
+    }
+
+    close(fds[1]);
+    job->pid = pid;
+    job->pipe_fd = fds[0];
+    return true;
+}
+
+static void _finish_job(BatchJob *job, int status) {
+    // results are well under PIPE_BUF, so they arrive in a single write
+    ssize_t len = read(job->pipe_fd, job->result, RESULT_MAX_LEN - 1);
+    close(job->pipe_fd);
+
+    if (WIFSIGNALED(status)) {
+        snprintf(job->result, RESULT_MAX_LEN, "error=signal-%d", WTERMSIG(status));
+    } else if (len <= 0) {
+        snprintf(job->result, RESULT_MAX_LEN, "error=exit-%d", WEXITSTATUS(status));
+    } else {
+        job->result[len] = '\0';
+    }
+
+    job->done = true;
+}
+#endif
+
+static unsigned int _get_core_count(void) {
+    #ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+    #else
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (unsigned int) cores : 1;
+    #endif
+}
+
+static bool _parse_count(const char *arg, uint64_t *out) {
+    char *end;
+    unsigned long long val = strtoull(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || val == 0) {
+        return false;
+    }
+    *out = val;
+    return true;
+}
+
+int main(int argc, char **argv) {
+    uint64_t frames = DEFAULT_FRAME_COUNT;
+    uint64_t jobs = _get_core_count();
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--frames") == 0 || strcmp(argv[i], "--jobs") == 0) {
+            if (i + 1 >= argc || !_parse_count(argv[i + 1], argv[i][2] == 'f' ? &frames : &jobs)) {
+                printf("Option %s requires a positive numeric argument\n", argv[i]);
+                printf(USAGE_MSG, argv[0]);
+                exit(1);
+            }
+            i++;
+        } else if (argv[i][0] == '-' && argv[i][1] == '-') {
+            printf("Unrecognized option %s\n", argv[i]);
+            printf(USAGE_MSG, argv[0]);
+            exit(1);
+        } else {
+            _add_path(argv[i]);
+        }
+    }
+
+    if (g_job_count == 0) {
+        printf("No ROMs to run!\n");
+        printf(USAGE_MSG, argv[0]);
+        exit(1);
+    }
+
+    uint64_t start_us = now_us();
+
+    #ifdef _WIN32
+    (void) jobs;
+
+    for (size_t i = 0; i < g_job_count; i++) {
+        _run_rom(g_jobs[i].path, frames, g_jobs[i].result);
+        printf("%s %s\n", g_jobs[i].path, g_jobs[i].result);
+        fflush(stdout);
+    }
+    #else
+    size_t next_start = 0;
+    size_t next_print = 0;
+    size_t running = 0;
+
+    while (next_print < g_job_count) {
+        while (running < jobs && next_start < g_job_count) {
+            BatchJob *job = &g_jobs[next_start++];
+            if (_start_job(job, frames)) {
+                running++;
+            } else {
+                snprintf(job->result, RESULT_MAX_LEN, "error=spawn");
+                job->done = true;
+            }
+        }
+
+        if (running > 0) {
+            int status;
+            pid_t pid = wait(&status);
+            if (pid < 0) {
+                perror("wait");
+                exit(1);
+            }
+
+            for (size_t i = next_print; i < next_start; i++) {
+                if (!g_jobs[i].done && g_jobs[i].pid == pid) {
+                    _finish_job(&g_jobs[i], status);
+                    running--;
+                    break;
+                }
+            }
+        }
+
+        // print results in input order so runs can be diffed against each other
+        while (next_print < g_job_count && g_jobs[next_print].done) {
+            printf("%s %s\n", g_jobs[next_print].path, g_jobs[next_print].result);
+            fflush(stdout);
+            next_print++;
+        }
+    }
+    #endif
+
+    fprintf(stderr, "Ran %zu ROMs in %.3f s\n", g_job_count, (now_us() - start_us) / 1000000.0);
+
+    return 0;
+}
@@ -0,0 +1,451 @@
+/*
+ * This file is a part of cNES.
+ * Copyright (c) 2019, Max Roncace <mproncace@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+// Runs a fixed set of synthetic workloads through the emulator with throttling disabled and reports timing
+// statistics as JSON.
+//
+// The test programs are assembled by hand below and wrapped in an iNES image at runtime, so the results don't
+// depend on any ROMs being present on the machine running the benchmark.
+
+#include "cartridge.h"
+#include "context.h"
+#include "loader.h"
+#include "system.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define close _close
+#define dup _dup
+#define dup2 _dup2
+#define fileno _fileno
+#define NULL_DEVICE "NUL"
+#else
+#include <unistd.h>
+#define NULL_DEVICE "/dev/null"
+#endif
+
+#define USAGE_MSG "Usage: %s [--frames <N>] [--runs <N>] [--scenario <name>]\n"
+
+#define DEFAULT_FRAME_COUNT 300
+#define DEFAULT_RUN_COUNT 10
+
+#define PRG_BANK_SIZE 0x4000
+#define CHR_BANK_SIZE 0x2000
+
+#define VECTOR_NMI 0xFFFA
+#define VECTOR_RST 0xFFFC
+#define VECTOR_IRQ 0xFFFE
+
+typedef struct {
+    uint16_t addr;
+    const uint8_t *code;
+    size_t len;
+} CodeBlock;
+
+typedef struct {
+    const char *name;
+    unsigned int mapper_id;
+    unsigned int prg_banks; // in 16 KB units
+    const CodeBlock *blocks;
+    size_t block_count;
+    uint16_t rst_addr;
+    uint16_t nmi_addr;
+    uint16_t irq_addr;
+} Scenario;
+
+// common reset prologue: disable interrupts, set up the stack, and wait out the PPU's two warm-up frames
+#define RESET_PROLOGUE \
+    0x78,                   /* SEI           */ \
+    0xD8,                   /* CLD           */ \
+    0xA2, 0xFF,             /* LDX #$FF      */ \
+    0x9A,                   /* TXS           */ \
+    0xAD, 0x02, 0x20,       /* LDA $2002     */ \
+    0x10, 0xFB,             /* BPL -5        */ \
+    0xAD, 0x02, 0x20,       /* LDA $2002     */ \
+    0x10, 0xFB              /* BPL -5        */
+
+static const uint8_t g_rti[] = {
+    0x40,                   // RTI
+};
+
+// spins in a tight loop with the background enabled and an empty NMI handler
+static const uint8_t g_idle_main[] = {
+    RESET_PROLOGUE,
+    0xA9, 0x1E,             // LDA #$1E
+    0x8D, 0x01, 0x20,       // STA $2001
+    0xA9, 0x80,             // LDA #$80
+    0x8D, 0x00, 0x20,       // STA $2000
+    0x4C, 0x19, 0x80,       // JMP $8019
+};
+
+static const CodeBlock g_idle_blocks[] = {
+    {0x8000, g_idle_main, sizeof(g_idle_main)},
+    {0x8100, g_rti, sizeof(g_rti)},
+};
+
+// fills OAM with 64 sprites packed into the top quarter of the screen so that every line there overflows, then
+// re-uploads it through OAM DMA every frame
+static const uint8_t g_sprites_main[] = {
+    RESET_PROLOGUE,
+    0xA2, 0x00,             // LDX #$00
+    0x8A,                   // TXA
+    0x29, 0x3F,             // AND #$3F
+    0x9D, 0x00, 0x02,       // STA $0200,X
+    0xE8,                   // INX
+    0xD0, 0xF7,             // BNE -9
+    0xA9, 0x1E,             // LDA #$1E
+    0x8D, 0x01, 0x20,       // STA $2001
+    0xA9, 0x80,             // LDA #$80
+    0x8D, 0x00, 0x20,       // STA $2000
+    0x4C, 0x24, 0x80,       // JMP $8024
+};
+
+static const uint8_t g_sprites_nmi[] = {
+    0xA9, 0x02,             // LDA #$02
+    0x8D, 0x14, 0x40,       // STA $4014
+    0x40,                   // RTI
+};
+
+static const CodeBlock g_sprites_blocks[] = {
+    {0x8000, g_sprites_main, sizeof(g_sprites_main)},
+    {0x8100, g_sprites_nmi, sizeof(g_sprites_nmi)},
+};
+
+// arms the MMC3 scanline counter to fire every 32 lines and changes the scroll in the IRQ handler
+static const uint8_t g_mmc3_main[] = {
+    RESET_PROLOGUE,
+    0xA9, 0x1F,             // LDA #$1F
+    0x8D, 0x00, 0xC0,       // STA $C000
+    0x8D, 0x01, 0xC0,       // STA $C001
+    0x8D, 0x01, 0xE0,       // STA $E001
+    0xA9, 0x1E,             // LDA #$1E
+    0x8D, 0x01, 0x20,       // STA $2001
+    0xA9, 0x88,             // LDA #$88
+    0x8D, 0x00, 0x20,       // STA $2000
+    0x58,                   // CLI
+    0x4C, 0x25, 0xE0,       // JMP $E025
+};
+
+static const uint8_t g_mmc3_nmi[] = {
+    0xA9, 0x00,             // LDA #$00
+    0x8D, 0x05, 0x20,       // STA $2005
+    0x8D, 0x05, 0x20,       // STA $2005
+    0x40,                   // RTI
+};
+
+static const uint8_t g_mmc3_irq[] = {
+    0x8D, 0x00, 0xE0,       // STA $E000
+    0x8D, 0x01, 0xE0,       // STA $E001
+    0xE6, 0x10,             // INC $10
+    0xA5, 0x10,             // LDA $10
+    0x8D, 0x05, 0x20,       // STA $2005
+    0x8D, 0x05, 0x20,       // STA $2005
+    0x40,                   // RTI
+};
+
+static const CodeBlock g_mmc3_blocks[] = {
+    {0xE000, g_mmc3_main, sizeof(g_mmc3_main)},
+    {0xE100, g_mmc3_nmi, sizeof(g_mmc3_nmi)},
+    {0xE110, g_mmc3_irq, sizeof(g_mmc3_irq)},
+};
+
+// with rendering disabled, repeatedly writes a page of VRAM through $2007 and then reads it back
+static const uint8_t g_ppu_data_main[] = {
+    RESET_PROLOGUE,
+    0xA9, 0x20,             // LDA #$20
+    0x8D, 0x06, 0x20,       // STA $2006
+    0xA9, 0x00,             // LDA #$00
+    0x8D, 0x06, 0x20,       // STA $2006
+    0xA2, 0x00,             // LDX #$00
+    0x8E, 0x07, 0x20,       // STX $2007
+    0xE8,                   // INX
+    0xD0, 0xFA,             // BNE -6
+    0xA9, 0x20,             // LDA #$20
+    0x8D, 0x06, 0x20,       // STA $2006
+    0xA9, 0x00,             // LDA #$00
+    0x8D, 0x06, 0x20,       // STA $2006
+    0xAD, 0x07, 0x20,       // LDA $2007
+    0xE8,                   // INX
+    0xD0, 0xFA,             // BNE -6
+    0x4C, 0x0F, 0x80,       // JMP $800F
+};
+
+static const CodeBlock g_ppu_data_blocks[] = {
+    {0x8000, g_ppu_data_main, sizeof(g_ppu_data_main)},
+    {0x8100, g_rti, sizeof(g_rti)},
+};
+
+#define BLOCKS(b) b, sizeof(b) / sizeof(CodeBlock)
+
+static const Scenario g_scenarios[] = {
+    {"nrom_idle", MAPPER_ID_NROM, 1, BLOCKS(g_idle_blocks), 0x8000, 0x8100, 0x8100},
+    {"sprites", MAPPER_ID_NROM, 1, BLOCKS(g_sprites_blocks), 0x8000, 0x8100, 0x8100},
+    {"mmc3_irq_splits", MAPPER_ID_MMC3, 2, BLOCKS(g_mmc3_blocks), 0xE000, 0xE100, 0xE110},
+    {"ppu_data", MAPPER_ID_NROM, 1, BLOCKS(g_ppu_data_blocks), 0x8000, 0x8100, 0x8100},
+};
+
+#define SCENARIO_COUNT (sizeof(g_scenarios) / sizeof(Scenario))
+
+typedef struct {
+    double min;
+    double median;
+    double p99;
+} Summary;
+
+static int g_saved_stdout = -1;
+
+// the emulator core logs to stdout, which would corrupt the JSON report
+static void _silence_stdout(void) {
+    fflush(stdout);
+    g_saved_stdout = dup(fileno(stdout));
+    if (freopen(NULL_DEVICE, "w", stdout) == NULL) {
+        g_saved_stdout = -1;
+    }
+}
+
+static void _restore_stdout(void) {
+    fflush(stdout);
+    if (g_saved_stdout >= 0) {
+        dup2(g_saved_stdout, fileno(stdout));
+        close(g_saved_stdout);
+        g_saved_stdout = -1;
+    }
+}
+
+// maps a CPU address to its PRG offset, assuming the ROM is mirrored across $8000-$FFFF (NROM-128) or that the
+// code lives in the fixed last bank
+static size_t _prg_offset(size_t prg_size, uint16_t addr) {
+    return (addr - 0x8000) % prg_size;
+}
+
+static void _write_vector(uint8_t *prg, size_t prg_size, uint16_t vector, uint16_t addr) {
+    size_t offset = _prg_offset(prg_size, vector);
+    prg[offset] = addr & 0xFF;
+    prg[offset + 1] = addr >> 8;
+}
+
+// builds an iNES image for the scenario in a temporary file
+static FILE *_build_rom(const Scenario *scenario) {
+    size_t prg_size = scenario->prg_banks * PRG_BANK_SIZE;
+    uint8_t *prg = calloc(1, prg_size);
+    uint8_t *chr = malloc(CHR_BANK_SIZE);
+
+    for (size_t i = 0; i < scenario->block_count; i++) {
+        const CodeBlock *block = &scenario->blocks[i];
+        size_t offset = _prg_offset(prg_size, block->addr);
+        memcpy(&prg[offset], block->code, block->len);
+    }
+
+    _write_vector(prg, prg_size, VECTOR_NMI, scenario->nmi_addr);
+    _write_vector(prg, prg_size, VECTOR_RST, scenario->rst_addr);
+    _write_vector(prg, prg_size, VECTOR_IRQ, scenario->irq_addr);
+
+    // fill the pattern tables with noise so that every tile has opaque pixels
+    uint32_t seed = 0x1234567;
+    for (size_t i = 0; i < CHR_BANK_SIZE; i++) {
+        seed = seed * 1103515245 + 12345;
+        chr[i] = seed >> 16;
+    }
+
+    uint8_t header[16] = {'N', 'E', 'S', 0x1A};
+    header[4] = scenario->prg_banks;
+    header[5] = 1;
+    header[6] = (scenario->mapper_id & 0xF) << 4;
+    header[7] = scenario->mapper_id & 0xF0;
+
+    FILE *file = tmpfile();
+    if (file != NULL) {
+        fwrite(header, sizeof(header), 1, file);
+        fwrite(prg, prg_size, 1, file);
+        fwrite(chr, CHR_BANK_SIZE, 1, file);
+        rewind(file);
+    }
+
+    free(prg);
+    free(chr);
+
+    return file;
+}
+
+// runs the scenario once, returning false if the ROM couldn't be loaded
+static bool _run_once(const Scenario *scenario, uint64_t frames, double *ns_per_frame, double *cycles_per_sec) {
+    FILE *rom_file = _build_rom(scenario);
+    if (rom_file == NULL) {
+        return false;
+    }
+
+    Cartridge *cart = load_rom(rom_file, (char*) scenario->name);
+    fclose(rom_file);
+
+    if (cart == NULL) {
+        return false;
+    }
+
+    NesContext *ctx = create_context();
+    make_context_current(ctx);
+
+    system_set_headless(true);
+    system_set_throttle(false);
+    system_set_frame_limit(frames);
+
+    initialize_system(cart);
+
+    uint64_t start_us = now_us();
+    do_system_loop();
+    uint64_t elapsed_us = now_us() - start_us;
+
+    if (elapsed_us == 0) {
+        elapsed_us = 1;
+    }
+
+    *ns_per_frame = elapsed_us * 1000.0 / system_get_frame_count();
+    *cycles_per_sec = ctx->system.master_clock * 1000000.0 / elapsed_us;
+
+    destroy_context(ctx);
+    unload_rom(cart);
+
+    return true;
+}
+
+static int _compare_doubles(const void *a, const void *b) {
+    double x = *((const double*) a);
+    double y = *((const double*) b);
+    return (x > y) - (x < y);
+}
+
+static Summary _summarize(double *samples, size_t count) {
+    qsort(samples, count, sizeof(double), _compare_doubles);
+
+    // nearest-rank percentiles
+    size_t p99_index = (count * 99 + 99) / 100 - 1;
+
+    return (Summary) {
+        samples[0],
+        count % 2 ? samples[count / 2] : (samples[count / 2 - 1] + samples[count / 2]) / 2,
+        samples[p99_index]
+    };
+}
+
+static void _print_summary(const char *name, Summary summary, bool last) {
+    printf("      \"%s\": {\"min\": %.1f, \"median\": %.1f, \"p99\": %.1f}%s\n",
+            name, summary.min, summary.median, summary.p99, last ? "" : ",");
+}
+
+static bool _parse_count(const char *arg, uint64_t *out) {
+    char *end;
+    unsigned long long val = strtoull(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || val == 0) {
+        return false;
+    }
+    *out = val;
+    return true;
+}
+
+int main(int argc, char **argv) {
+    uint64_t frames = DEFAULT_FRAME_COUNT;
+    uint64_t runs = DEFAULT_RUN_COUNT;
+    const char *only_scenario = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--frames") == 0 || strcmp(argv[i], "--runs") == 0) {
+            if (i + 1 >= argc || !_parse_count(argv[i + 1], argv[i][2] == 'f' ? &frames : &runs)) {
+                fprintf(stderr, "Option %s requires a positive numeric argument\n", argv[i]);
+                fprintf(stderr, USAGE_MSG, argv[0]);
+                exit(1);
+            }
+            i++;
+        } else if (strcmp(argv[i], "--scenario") == 0 && i + 1 < argc) {
+            only_scenario = argv[++i];
+        } else {
+            fprintf(stderr, "Unrecognized argument %s\n", argv[i]);
+            fprintf(stderr, USAGE_MSG, argv[0]);
+            exit(1);
+        }
+    }
+
+    if (only_scenario != NULL) {
+        bool found = false;
+        for (size_t i = 0; i < SCENARIO_COUNT; i++) {
+            found |= strcmp(g_scenarios[i].name, only_scenario) == 0;
+        }
+        if (!found) {
+            fprintf(stderr, "Unknown scenario %s\n", only_scenario);
+            exit(1);
+        }
+    }
+
+    double *frame_samples = malloc(runs * sizeof(double));
+    double *cycle_samples = malloc(runs * sizeof(double));
+
+    printf("{\n");
+    printf("  \"frames_per_run\": %llu,\n", (unsigned long long) frames);
+    printf("  \"runs\": %llu,\n", (unsigned long long) runs);
+    printf("  \"scenarios\": {\n");
+
+    bool first = true;
+    for (size_t i = 0; i < SCENARIO_COUNT; i++) {
+        const Scenario *scenario = &g_scenarios[i];
+        if (only_scenario != NULL && strcmp(scenario->name, only_scenario) != 0) {
+            continue;
+        }
+
+        fprintf(stderr, "Running %s...\n", scenario->name);
+
+        _silence_stdout();
+
+        // one untimed run to warm up the caches and the allocator
+        double ignored_ns, ignored_cycles;
+        bool ok = _run_once(scenario, frames, &ignored_ns, &ignored_cycles);
+
+        for (uint64_t run = 0; ok && run < runs; run++) {
+            ok = _run_once(scenario, frames, &frame_samples[run], &cycle_samples[run]);
+        }
+
+        _restore_stdout();
+
+        if (!ok) {
+            fprintf(stderr, "Failed to load ROM for scenario %s\n", scenario->name);
+            exit(1);
+        }
+
+        printf("%s    \"%s\": {\n", first ? "" : ",\n", scenario->name);
+        _print_summary("ns_per_frame", _summarize(frame_samples, runs), false);
+        _print_summary("master_cycles_per_sec", _summarize(cycle_samples, runs), true);
+        printf("    }");
+        first = false;
+    }
+
+    printf("\n  }\n}\n");
+
+    free(frame_samples);
+    free(cycle_samples);
+
+    return 0;
+}
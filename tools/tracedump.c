@@ -0,0 +1,223 @@
+/*
+ * This file is a part of cNES.
+ * Copyright (c) 2019, Max Roncace <mproncace@gmail.com>
+ *
+ * The MIT License
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+// Prints a binary execution trace written by the tracer in a format resembling the nestest log.
+
+#include "tracer.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define USAGE_MSG "Usage: %s <trace file>\n"
+
+#define READ_CHUNK_RECORDS 4096
+
+typedef enum {
+    IMP, ACC, IMM, ZP, ZPX, ZPY, ABS, ABX, ABY, IND, IZX, IZY, REL
+} AddressingMode;
+
+typedef struct {
+    const char *mnemonic; // unofficial opcodes are prefixed with '*', as in the nestest log
+    AddressingMode mode;
+} OpcodeInfo;
+
+static const OpcodeInfo g_opcodes[256] = {
+    // 0x00
+    {"BRK", IMP}, {"ORA", IZX}, {"*KIL", IMP}, {"*SLO", IZX}, {"*NOP", ZP}, {"ORA", ZP}, {"ASL", ZP}, {"*SLO", ZP},
+    {"PHP", IMP}, {"ORA", IMM}, {"ASL", ACC}, {"*ANC", IMM}, {"*NOP", ABS}, {"ORA", ABS}, {"ASL", ABS}, {"*SLO", ABS},
+    // 0x10
+    {"BPL", REL}, {"ORA", IZY}, {"*KIL", IMP}, {"*SLO", IZY}, {"*NOP", ZPX}, {"ORA", ZPX}, {"ASL", ZPX}, {"*SLO", ZPX},
+    {"CLC", IMP}, {"ORA", ABY}, {"*NOP", IMP}, {"*SLO", ABY}, {"*NOP", ABX}, {"ORA", ABX}, {"ASL", ABX}, {"*SLO", ABX},
+    // 0x20
+    {"JSR", ABS}, {"AND", IZX}, {"*KIL", IMP}, {"*RLA", IZX}, {"BIT", ZP}, {"AND", ZP}, {"ROL", ZP}, {"*RLA", ZP},
+    {"PLP", IMP}, {"AND", IMM}, {"ROL", ACC}, {"*ANC", IMM}, {"BIT", ABS}, {"AND", ABS}, {"ROL", ABS}, {"*RLA", ABS},
+    // 0x30
+    {"BMI", REL}, {"AND", IZY}, {"*KIL", IMP}, {"*RLA", IZY}, {"*NOP", ZPX}, {"AND", ZPX}, {"ROL", ZPX}, {"*RLA", ZPX},
+    {"SEC", IMP}, {"AND", ABY}, {"*NOP", IMP}, {"*RLA", ABY}, {"*NOP", ABX}, {"AND", ABX}, {"ROL", ABX}, {"*RLA", ABX},
+    // 0x40
+    {"RTI", IMP}, {"EOR", IZX}, {"*KIL", IMP}, {"*SRE", IZX}, {"*NOP", ZP}, {"EOR", ZP}, {"LSR", ZP}, {"*SRE", ZP},
+    {"PHA", IMP}, {"EOR", IMM}, {"LSR", ACC}, {"*ALR", IMM}, {"JMP", ABS}, {"EOR", ABS}, {"LSR", ABS}, {"*SRE", ABS},
+    // 0x50
+    {"BVC", REL}, {"EOR", IZY}, {"*KIL", IMP}, {"*SRE", IZY}, {"*NOP", ZPX}, {"EOR", ZPX}, {"LSR", ZPX}, {"*SRE", ZPX},
+    {"CLI", IMP}, {"EOR", ABY}, {"*NOP", IMP}, {"*SRE", ABY}, {"*NOP", ABX}, {"EOR", ABX}, {"LSR", ABX}, {"*SRE", ABX},
+    // 0x60
+    {"RTS", IMP}, {"ADC", IZX}, {"*KIL", IMP}, {"*RRA", IZX}, {"*NOP", ZP}, {"ADC", ZP}, {"ROR", ZP}, {"*RRA", ZP},
+    {"PLA", IMP}, {"ADC", IMM}, {"ROR", ACC}, {"*ARR", IMM}, {"JMP", IND}, {"ADC", ABS}, {"ROR", ABS}, {"*RRA", ABS},
+    // 0x70
+    {"BVS", REL}, {"ADC", IZY}, {"*KIL", IMP}, {"*RRA", IZY}, {"*NOP", ZPX}, {"ADC", ZPX}, {"ROR", ZPX}, {"*RRA", ZPX},
+    {"SEI", IMP}, {"ADC", ABY}, {"*NOP", IMP}, {"*RRA", ABY}, {"*NOP", ABX}, {"ADC", ABX}, {"ROR", ABX}, {"*RRA", ABX},
+    // 0x80
+    {"*NOP", IMM}, {"STA", IZX}, {"*NOP", IMM}, {"*SAX", IZX}, {"STY", ZP}, {"STA", ZP}, {"STX", ZP}, {"*SAX", ZP},
+    {"DEY", IMP}, {"*NOP", IMM}, {"TXA", IMP}, {"*XAA", IMM}, {"STY", ABS}, {"STA", ABS}, {"STX", ABS}, {"*SAX", ABS},
+    // 0x90
+    {"BCC", REL}, {"STA", IZY}, {"*KIL", IMP}, {"*AHX", IZY}, {"STY", ZPX}, {"STA", ZPX}, {"STX", ZPY}, {"*SAX", ZPY},
+    {"TYA", IMP}, {"STA", ABY}, {"TXS", IMP}, {"*TAS", ABY}, {"*SHY", ABX}, {"STA", ABX}, {"*SHX", ABY}, {"*AHX", ABY},
+    // 0xA0
+    {"LDY", IMM}, {"LDA", IZX}, {"LDX", IMM}, {"*LAX", IZX}, {"LDY", ZP}, {"LDA", ZP}, {"LDX", ZP}, {"*LAX", ZP},
+    {"TAY", IMP}, {"LDA", IMM}, {"TAX", IMP}, {"*LAX", IMM}, {"LDY", ABS}, {"LDA", ABS}, {"LDX", ABS}, {"*LAX", ABS},
+    // 0xB0
+    {"BCS", REL}, {"LDA", IZY}, {"*KIL", IMP}, {"*LAX", IZY}, {"LDY", ZPX}, {"LDA", ZPX}, {"LDX", ZPY}, {"*LAX", ZPY},
+    {"CLV", IMP}, {"LDA", ABY}, {"TSX", IMP}, {"*LAS", ABY}, {"LDY", ABX}, {"LDA", ABX}, {"LDX", ABY}, {"*LAX", ABY},
+    // 0xC0
+    {"CPY", IMM}, {"CMP", IZX}, {"*NOP", IMM}, {"*DCP", IZX}, {"CPY", ZP}, {"CMP", ZP}, {"DEC", ZP}, {"*DCP", ZP},
+    {"INY", IMP}, {"CMP", IMM}, {"DEX", IMP}, {"*AXS", IMM}, {"CPY", ABS}, {"CMP", ABS}, {"DEC", ABS}, {"*DCP", ABS},
+    // 0xD0
+    {"BNE", REL}, {"CMP", IZY}, {"*KIL", IMP}, {"*DCP", IZY}, {"*NOP", ZPX}, {"CMP", ZPX}, {"DEC", ZPX}, {"*DCP", ZPX},
+    {"CLD", IMP}, {"CMP", ABY}, {"*NOP", IMP}, {"*DCP", ABY}, {"*NOP", ABX}, {"CMP", ABX}, {"DEC", ABX}, {"*DCP", ABX},
+    // 0xE0
+    {"CPX", IMM}, {"SBC", IZX}, {"*NOP", IMM}, {"*ISB", IZX}, {"CPX", ZP}, {"SBC", ZP}, {"INC", ZP}, {"*ISB", ZP},
+    {"INX", IMP}, {"SBC", IMM}, {"NOP", IMP}, {"*SBC", IMM}, {"CPX", ABS}, {"SBC", ABS}, {"INC", ABS}, {"*ISB", ABS},
+    // 0xF0
+    {"BEQ", REL}, {"SBC", IZY}, {"*KIL", IMP}, {"*ISB", IZY}, {"*NOP", ZPX}, {"SBC", ZPX}, {"INC", ZPX}, {"*ISB", ZPX},
+    {"SED", IMP}, {"SBC", ABY}, {"*NOP", IMP}, {"*ISB", ABY}, {"*NOP", ABX}, {"SBC", ABX}, {"INC", ABX}, {"*ISB", ABX},
+};
+
+static unsigned int _get_instr_length(AddressingMode mode) {
+    switch (mode) {
+        case IMP:
+        case ACC:
+            return 1;
+        case ABS:
+        case ABX:
+        case ABY:
+        case IND:
+            return 3;
+        default:
+            return 2;
+    }
+}
+
+static void _disassemble(const TraceRecord *record, char *buf, size_t buf_len) {
+    const OpcodeInfo *info = &g_opcodes[record->opcode[0]];
+    uint8_t lo = record->opcode[1];
+    uint16_t word = record->opcode[1] | (record->opcode[2] << 8);
+
+    switch (info->mode) {
+        case IMP:
+            snprintf(buf, buf_len, "%s", info->mnemonic);
+            break;
+        case ACC:
+            snprintf(buf, buf_len, "%s A", info->mnemonic);
+            break;
+        case IMM:
+            snprintf(buf, buf_len, "%s #$%02X", info->mnemonic, lo);
+            break;
+        case ZP:
+            snprintf(buf, buf_len, "%s $%02X", info->mnemonic, lo);
+            break;
+        case ZPX:
+            snprintf(buf, buf_len, "%s $%02X,X", info->mnemonic, lo);
+            break;
+        case ZPY:
+            snprintf(buf, buf_len, "%s $%02X,Y", info->mnemonic, lo);
+            break;
+        case ABS:
+            snprintf(buf, buf_len, "%s $%04X", info->mnemonic, word);
+            break;
+        case ABX:
+            snprintf(buf, buf_len, "%s $%04X,X", info->mnemonic, word);
+            break;
+        case ABY:
+            snprintf(buf, buf_len, "%s $%04X,Y", info->mnemonic, word);
+            break;
+        case IND:
+            snprintf(buf, buf_len, "%s ($%04X)", info->mnemonic, word);
+            break;
+        case IZX:
+            snprintf(buf, buf_len, "%s ($%02X,X)", info->mnemonic, lo);
+            break;
+        case IZY:
+            snprintf(buf, buf_len, "%s ($%02X),Y", info->mnemonic, lo);
+            break;
+        case REL:
+            snprintf(buf, buf_len, "%s $%04X", info->mnemonic, (uint16_t) (record->pc + 2 + (int8_t) lo));
+            break;
+    }
+}
+
+static void _print_record(const TraceRecord *record) {
+    unsigned int len = _get_instr_length(g_opcodes[record->opcode[0]].mode);
+
+    char bytes[10] = {0};
+    for (unsigned int i = 0; i < len; i++) {
+        snprintf(bytes + i * 3, sizeof(bytes) - i * 3, "%02X ", record->opcode[i]);
+    }
+
+    char disasm[32];
+    _disassemble(record, disasm, sizeof(disasm));
+
+    // unofficial opcodes eat into the byte column so that the mnemonics stay aligned
+    bool unofficial = disasm[0] == '*';
+
+    printf("%04X  %-*s%-*s A:%02X X:%02X Y:%02X P:%02X SP:%02X PPU:%3u,%3u CYC:%llu\n",
+            record->pc,
+            unofficial ? 9 : 10, bytes,
+            unofficial ? 32 : 31, disasm,
+            record->acc, record->x, record->y, record->status, record->sp,
+            record->ppu_scanline, record->ppu_scanline_tick,
+            (unsigned long long) record->cpu_cycle);
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        printf(USAGE_MSG, argv[0]);
+        exit(1);
+    }
+
+    FILE *file = fopen(argv[1], "rb");
+    if (file == NULL) {
+        printf("Could not open trace file %s.\n", argv[1]);
+        return -1;
+    }
+
+    TraceFileHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1
+            || memcmp(header.magic, TRACE_FILE_MAGIC, sizeof(TRACE_FILE_MAGIC)) != 0) {
+        printf("%s is not a trace file\n", argv[1]);
+        return -1;
+    }
+
+    if (header.version != TRACE_FILE_VERSION || header.record_size != sizeof(TraceRecord)) {
+        printf("Unsupported trace version %u (record size %u)\n", header.version, header.record_size);
+        return -1;
+    }
+
+    TraceRecord *records = malloc(READ_CHUNK_RECORDS * sizeof(TraceRecord));
+
+    size_t count;
+    while ((count = fread(records, sizeof(TraceRecord), READ_CHUNK_RECORDS, file)) > 0) {
+        for (size_t i = 0; i < count; i++) {
+            _print_record(&records[i]);
+        }
+    }
+
+    free(records);
+    fclose(file);
+
+    return 0;
+}